@@ -1,25 +1,35 @@
 #include "bitmap.hh"
 
 #include <algorithm>
+#include <bit>
+#include <cstring>
+
+// The raw byte view of the words is only in FFSys file order on
+// little-endian machines.
+static_assert(std::endian::native == std::endian::little);
+
+static constexpr unsigned int WORD_BITS = 64;
 
 Bitmap::Bitmap(char *buffer, unsigned int byte_count):
-    bm_(new char[byte_count]), size_(byte_count)
+    words_(new uint64_t[(byte_count + 7) / 8]), size_(byte_count),
+    n_words_((byte_count + 7) / 8)
 {
-    for (int i = 0; i < byte_count; ++i) {
-        bm_[i] = *(buffer+i);
-    }
+    words_[n_words_ - 1] = 0;
+    std::memcpy(words_, buffer, byte_count);
 }
 
 Bitmap::Bitmap(unsigned int byte_count):
-    bm_(new char[byte_count]), size_(byte_count)
+    words_(new uint64_t[(byte_count + 7) / 8]), size_(byte_count),
+    n_words_((byte_count + 7) / 8)
 {
     // Initialize as all free
-    std::fill_n(bm_, byte_count, 0b11111111);
+    std::fill_n(words_, n_words_, ~(uint64_t)0);
+    reserve_padding();
 }
 
 Bitmap::~Bitmap()
 {
-    delete[] bm_;
+    delete[] words_;
 }
 
 bool Bitmap::reserve(unsigned int i)
@@ -29,47 +39,212 @@ bool Bitmap::reserve(unsigned int i)
     }
 
     // Set bit to 0
-    bm_[i / 8] &= ~(1 << (i % 8));
+    words_[i / WORD_BITS] &= ~((uint64_t)1 << (i % WORD_BITS));
+    mark_dirty(i);
     return true;
 }
 
-int Bitmap::reserve_first_free()
+int Bitmap::reserve_next_free()
 {
-    for (unsigned int i = 0; i < size_; ++i) {
-        if (reserve(i)) {
-            return i;
+    for (unsigned int n = 0; n < n_words_; ++n) {
+        unsigned int w = (hint_ + n) % n_words_;
+        ++scan_steps_;
+        if (words_[w] == 0) {
+            continue;
         }
+
+        unsigned int bit = std::countr_zero(words_[w]);
+        words_[w] &= ~((uint64_t)1 << bit);
+        hint_ = w;
+        mark_dirty(w * WORD_BITS + bit);
+        return w * WORD_BITS + bit;
     }
 
     return -1;
 }
 
+int Bitmap::reserve_run(unsigned int wanted, unsigned int& length, int goal)
+{
+    unsigned int n_bits = size_ * 8;
+    int start = -1;
+    length = 0;
+
+    if (goal >= 0 and is_free(goal)) {
+        start = goal;
+        length = free_run_length(goal, wanted);
+    } else {
+        // Look at each run of free bits from the previous reservation
+        // onwards, and then from the start.
+        auto search = [&](unsigned int begin, unsigned int end) {
+            for (unsigned int i = next_free(begin, end); i < end; i = next_free(i, end)) {
+                unsigned int run = free_run_length(i, wanted);
+                if (run > length) {
+                    start = i;
+                    length = run;
+                    if (run == wanted) {
+                        return true;
+                    }
+                }
+                i += run;
+            }
+            return false;
+        };
+
+        unsigned int hint_bit = hint_ * WORD_BITS;
+        if (!search(hint_bit, n_bits)) {
+            search(0, hint_bit);
+        }
+    }
+
+    if (start == -1) {
+        return -1;
+    }
+
+    for (unsigned int i = start; i < start + length; ++i) {
+        words_[i / WORD_BITS] &= ~((uint64_t)1 << (i % WORD_BITS));
+    }
+    mark_dirty(start);
+    mark_dirty(start + length - 1);
+    hint_ = (start + length - 1) / WORD_BITS;
+    return start;
+}
+
 bool Bitmap::free(unsigned int i)
 {
-    if (is_free(i)) {
+    if (i >= size_ * 8 or is_free(i)) {
         return false;
     }
 
-    bm_[i / 8] |= (1 << (i % 8));
+    words_[i / WORD_BITS] |= ((uint64_t)1 << (i % WORD_BITS));
+    mark_dirty(i);
     return true;
 }
 
+unsigned int Bitmap::free_run(unsigned int i, unsigned int count)
+{
+    unsigned int end = std::min(i + count, size_ * 8);
+    if (i >= end) {
+        return 0;
+    }
+
+    unsigned int n_freed = 0;
+    for (unsigned int bit = i; bit < end;) {
+        unsigned int offset = bit % WORD_BITS;
+        unsigned int n = std::min(WORD_BITS - offset, end - bit);
+        uint64_t mask = (n == WORD_BITS ? ~(uint64_t)0 : ((uint64_t)1 << n) - 1) << offset;
+        uint64_t& word = words_[bit / WORD_BITS];
+        n_freed += std::popcount(~word & mask);
+        word |= mask;
+        bit += n;
+    }
+    mark_dirty(i);
+    mark_dirty(end - 1);
+    return n_freed;
+}
+
 bool Bitmap::is_free(unsigned int i)
 {
-    return (1 << (i % 8) & bm_[i / 8]) != 0;
+    if (i >= size_ * 8) {
+        return false;
+    }
+    return (words_[i / WORD_BITS] >> (i % WORD_BITS) & 1) != 0;
+}
+
+unsigned int Bitmap::count_free()
+{
+    unsigned int n_free = 0;
+    for (unsigned int w = 0; w < n_words_; ++w) {
+        n_free += std::popcount(words_[w]);
+    }
+    return n_free;
+}
+
+unsigned int Bitmap::dirty_begin()
+{
+    return dirty_begin_;
+}
+
+unsigned int Bitmap::dirty_end()
+{
+    return dirty_end_;
+}
+
+void Bitmap::clear_dirty()
+{
+    dirty_begin_ = 0;
+    dirty_end_ = 0;
 }
 
 char *Bitmap::get_bm()
 {
-    return bm_;
+    return reinterpret_cast<char*>(words_);
 }
 
 char *Bitmap::get_bm(unsigned int n)
 {
-    return bm_ + n;
+    return get_bm() + n;
 }
 
 unsigned int Bitmap::get_size()
 {
     return size_;
 }
+
+uint64_t Bitmap::take_scan_steps()
+{
+    uint64_t steps = scan_steps_;
+    scan_steps_ = 0;
+    return steps;
+}
+
+void Bitmap::mark_dirty(unsigned int i)
+{
+    unsigned int byte = i / 8;
+    if (dirty_begin_ == dirty_end_) {
+        dirty_begin_ = byte;
+        dirty_end_ = byte + 1;
+    } else {
+        dirty_begin_ = std::min(dirty_begin_, byte);
+        dirty_end_ = std::max(dirty_end_, byte + 1);
+    }
+}
+
+unsigned int Bitmap::next_free(unsigned int i, unsigned int end)
+{
+    while (i < end) {
+        ++scan_steps_;
+        uint64_t word = words_[i / WORD_BITS] >> (i % WORD_BITS);
+        if (word != 0) {
+            return std::min(i + (unsigned int)std::countr_zero(word), end);
+        }
+        i = (i / WORD_BITS + 1) * WORD_BITS;
+    }
+    return end;
+}
+
+unsigned int Bitmap::free_run_length(unsigned int i, unsigned int max_count)
+{
+    // The padding bits are reserved, so a run always ends by the last bit.
+    unsigned int length = 0;
+    while (length < max_count) {
+        ++scan_steps_;
+        unsigned int bit = (i + length) % WORD_BITS;
+        unsigned int ones = std::countr_one(words_[(i + length) / WORD_BITS] >> bit);
+        length += std::min(ones, WORD_BITS - bit);
+        if (ones < WORD_BITS - bit) {
+            break;
+        }
+        if ((i + length) / WORD_BITS >= n_words_) {
+            break;
+        }
+    }
+    return std::min(length, max_count);
+}
+
+void Bitmap::reserve_padding()
+{
+    unsigned int used_bits = (size_ * 8) % WORD_BITS;
+    if (used_bits != 0) {
+        words_[n_words_ - 1] &= ((uint64_t)1 << used_bits) - 1;
+    }
+}
@@ -1,41 +1,91 @@
 #ifndef BITMAP_HH
 #define BITMAP_HH
 
+#include <stdint.h>
+
+/**
+ * A bitmap where a set bit means a free element and a cleared bit a
+ * reserved one. The bits are stored in 64-bit words, so that free bits can
+ * be searched for a whole word at a time. The raw bytes (see get_bm) have
+ * the same layout as in the FFSys file: element i is bit i % 8 of byte i / 8.
+ */
 class Bitmap
 {
 public:
-    Bitmap(char* buffer, unsigned int count);
-    Bitmap(unsigned int count);
+    Bitmap(char* buffer, unsigned int byte_count);
+    Bitmap(unsigned int byte_count);
     ~Bitmap();
 
     // Reserves the bit at i if it is free.
     bool reserve(unsigned int i);
 
-    // Reserves the first free bit found and returns the index.
+    // Reserves the next free bit, searching onwards from the previously
+    // reserved one and wrapping around to the start, and returns its index.
     // Returns -1 if no free bit was found.
-    int reserve_first_free();
+    int reserve_next_free();
+
+    // Reserves up to wanted free bits in a row and returns the index of
+    // the first one, with the number of bits reserved in length. A run
+    // starting right at goal is preferred, then the next run of at least
+    // wanted free bits (searched like in reserve_next_free), and if there
+    // is none, the longest run there is. Returns -1 if no bit is free.
+    int reserve_run(unsigned int wanted, unsigned int& length, int goal = -1);
 
     // Frees the bit at i. Returns false if it is already free.
     bool free(unsigned int i);
 
+    // Frees the count bits starting from i, a word at a time. Returns the
+    // number of bits that were reserved, and so were freed.
+    unsigned int free_run(unsigned int i, unsigned int count);
+
     // Checks whether the bit at i is free or not.
     bool is_free(unsigned int i);
 
-    // Returns the nth byte in the bitmap.
-    char nth_byte(unsigned int n);
+    // Counts the free bits.
+    unsigned int count_free();
 
-    // Returns the byte to which the ith element belongs.
-    char byte_at(unsigned int i);
+    // The bytes changed by reserving and freeing since the last
+    // clear_dirty(), as the range [dirty_begin, dirty_end). The range
+    // is empty if nothing has changed.
+    unsigned int dirty_begin();
+    unsigned int dirty_end();
+    void clear_dirty();
 
     // Gets this bitmap as a raw char array.
     char* get_bm();
     char* get_bm(unsigned int n);
 
+    // Size of the bitmap in bytes.
     unsigned int get_size();
 
+    // The number of words examined while searching for free bits since
+    // the previous call.
+    uint64_t take_scan_steps();
+
 private:
-    char* bm_ = nullptr;
+    uint64_t* words_ = nullptr;
     unsigned int size_;
+    unsigned int n_words_;
+
+    // The word from which the search for a free bit continues.
+    unsigned int hint_ = 0;
+
+    unsigned int dirty_begin_ = 0;
+    unsigned int dirty_end_ = 0;
+
+    uint64_t scan_steps_ = 0;
+
+    void mark_dirty(unsigned int i);
+
+    // The index of the first free bit in [i, end), or end if there is none.
+    unsigned int next_free(unsigned int i, unsigned int end);
+
+    // The number of free bits in a row starting from i, at most max_count.
+    unsigned int free_run_length(unsigned int i, unsigned int max_count);
+
+    // Marks the bits past the last byte as reserved, so they are never
+    // handed out.
+    void reserve_padding();
 };
 
 #endif // BITMAP_HH
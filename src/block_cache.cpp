@@ -0,0 +1,477 @@
+#include "block_cache.hh"
+
+#include <algorithm>
+#include <cstring>
+
+using namespace std;
+
+namespace ffsys {
+
+BlockCache::BlockCache(Storage& storage, IOEngine& engine, unsigned int block_size, size_t capacity,
+                       Journal* journal, Stats* stats):
+    storage_(storage), engine_(engine), journal_(journal), stats_(stats), block_size_(block_size),
+    capacity_(capacity)
+{
+}
+
+bool BlockCache::read(unsigned int block_i, char* buffer, size_t count, size_t offset)
+{
+    vector<IORequest> runs;
+    {
+        lock_guard lock(mutex_);
+        if (!read_locked({block_i, buffer, count, offset}, runs)) {
+            return false;
+        }
+    }
+    return runs.empty() or engine_.run(runs);
+}
+
+bool BlockCache::write(unsigned int block_i, const char* buffer, size_t count, size_t offset)
+{
+    vector<IORequest> runs;
+    {
+        lock_guard lock(mutex_);
+        if (!write_locked({block_i, const_cast<char*>(buffer), count, offset}, runs)) {
+            return false;
+        }
+    }
+    return runs.empty() or engine_.run(runs);
+}
+
+bool BlockCache::read(vector<Range> const& ranges)
+{
+    vector<IORequest> runs;
+    {
+        lock_guard lock(mutex_);
+        for (Range const& range : ranges) {
+            if (!read_locked(range, runs)) {
+                return false;
+            }
+        }
+    }
+
+    // The runs of all the ranges are independent of each other, so the
+    // engine can have them in flight at the same time.
+    return runs.empty() or engine_.run(runs);
+}
+
+bool BlockCache::write(vector<Range> const& ranges)
+{
+    vector<IORequest> runs;
+    {
+        lock_guard lock(mutex_);
+        for (Range const& range : ranges) {
+            if (!write_locked(range, runs)) {
+                return false;
+            }
+        }
+    }
+
+    return runs.empty() or engine_.run(runs);
+}
+
+bool BlockCache::flush()
+{
+    lock_guard lock(mutex_);
+
+    if (n_dirty_ == 0) {
+        return true;
+    }
+
+    if (journal_ != nullptr) {
+        return commit();
+    }
+
+    for (Entry* entry : get_dirty()) {
+        if (!write_back(*entry)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool BlockCache::checkpoint()
+{
+    lock_guard lock(mutex_);
+    return checkpoint_locked();
+}
+
+size_t BlockCache::get_capacity()
+{
+    return capacity_;
+}
+
+size_t BlockCache::get_n_dirty()
+{
+    lock_guard lock(mutex_);
+    return n_dirty_;
+}
+
+BlockCache::Entry* BlockCache::get_entry(unsigned int block_i, bool load)
+{
+    auto iter = entries_.find(block_i);
+    if (iter != entries_.end()) {
+        // Move to the front of the LRU list.
+        lru_.splice(lru_.begin(), lru_, iter->second);
+        count(StatCounter::CACHE_HITS);
+        return &*iter->second;
+    }
+
+    count(StatCounter::CACHE_MISSES);
+    if (!make_room()) {
+        return nullptr;
+    }
+
+    Entry entry = {block_i, false, false, 0, vector<char>(block_size_)};
+    if (load) {
+        if (!storage_.read((size_t)block_i * block_size_, entry.data.data(), block_size_)) {
+            return nullptr;
+        }
+    }
+
+    lru_.push_front(std::move(entry));
+    entries_.insert({block_i, lru_.begin()});
+    return &lru_.front();
+}
+
+bool BlockCache::make_room()
+{
+    while (!lru_.empty() and lru_.size() >= capacity_) {
+        // Dirty blocks may not be written to their places before they
+        // have been logged, so with a journal they stay (and the cache
+        // grows past its capacity) until the next commit. Pinned blocks
+        // stay until they are unpinned.
+        auto victim = prev(lru_.end());
+        while (victim->pins > 0 or (journal_ != nullptr and victim->dirty)) {
+            if (victim == lru_.begin()) {
+                return true;
+            }
+            --victim;
+        }
+
+        if (!write_back(*victim)) {
+            return false;
+        }
+        entries_.erase(victim->block_i);
+        lru_.erase(victim);
+        count(StatCounter::CACHE_EVICTIONS);
+    }
+    return true;
+}
+
+bool BlockCache::pin(unsigned int block_i, unsigned int count, vector<const char*>& data, bool only_cached)
+{
+    lock_guard lock(mutex_);
+
+    data.assign(count, nullptr);
+    vector<char> run;
+    for (unsigned int i = 0; i < count;) {
+        if (entries_.count(block_i + i)) {
+            Entry* entry = get_entry(block_i + i);
+            ++entry->pins;
+            data[i++] = entry->data.data();
+            continue;
+        }
+
+        unsigned int end = i + 1;
+        while (end < count and !entries_.count(block_i + end)) {
+            ++end;
+        }
+        if (only_cached) {
+            i = end;
+            continue;
+        }
+
+        unsigned int start = i;
+        run.resize((size_t)(end - start) * block_size_);
+        Entry* entry = nullptr;
+        if (storage_.read((size_t)(block_i + start) * block_size_, run.data(), run.size())) {
+            for (; i < end; ++i) {
+                entry = get_entry(block_i + i, false);
+                if (entry == nullptr) {
+                    break;
+                }
+                memcpy(entry->data.data(), run.data() + (size_t)(i - start) * block_size_, block_size_);
+                ++entry->pins;
+                data[i] = entry->data.data();
+            }
+        }
+
+        if (entry == nullptr) {
+            for (unsigned int k = 0; k < i; ++k) {
+                if (data[k] != nullptr) {
+                    --entries_[block_i + k]->pins;
+                }
+            }
+            data.assign(count, nullptr);
+            return false;
+        }
+    }
+    return true;
+}
+
+void BlockCache::unpin(unsigned int block_i)
+{
+    lock_guard lock(mutex_);
+
+    auto iter = entries_.find(block_i);
+    if (iter == entries_.end() or iter->second->pins == 0) {
+        return;
+    }
+    --iter->second->pins;
+
+    // A block that was only kept for its pins goes, so that a disabled
+    // cache stays empty.
+    if (lru_.size() > capacity_) {
+        make_room();
+    }
+}
+
+void BlockCache::count(StatCounter counter)
+{
+    if (stats_ != nullptr) {
+        stats_->add(counter);
+    }
+}
+
+bool BlockCache::write_back(Entry& entry)
+{
+    if (!entry.dirty and !entry.logged) {
+        return true;
+    }
+
+    if (!storage_.write((size_t)entry.block_i * block_size_, entry.data.data(), block_size_)) {
+        return false;
+    }
+
+    if (entry.dirty) {
+        entry.dirty = false;
+        --n_dirty_;
+    }
+    entry.logged = false;
+    return true;
+}
+
+void BlockCache::mark_dirty(Entry& entry)
+{
+    if (!entry.dirty) {
+        entry.dirty = true;
+        ++n_dirty_;
+    }
+}
+
+bool BlockCache::read_locked(Range range, vector<IORequest>& runs)
+{
+    range.block_i += range.offset / block_size_;
+    range.offset %= block_size_;
+
+    // Small accesses (i-nodes, addresses, bitmap bytes) are served
+    // through the cache. They can still continue over to the next block.
+    if (capacity_ > 0 && range.count <= block_size_) {
+        while (range.count > 0) {
+            size_t part = min(block_size_ - range.offset, range.count);
+            Entry* entry = get_entry(range.block_i);
+            if (entry == nullptr) {
+                return false;
+            }
+
+            memcpy(range.buffer, entry->data.data() + range.offset, part);
+            range.buffer += part;
+            range.count -= part;
+            range.offset = 0;
+            ++range.block_i;
+        }
+        return true;
+    }
+
+    // Ranges longer than a block are file contents, which would only push
+    // the often used metadata blocks out of the cache. Blocks that are
+    // already cached are copied from the cache, and each run of uncached
+    // blocks is read from the file at once.
+    return split_range(range, false, runs, [](char* buffer, Entry& entry, size_t offset, size_t count) {
+        memcpy(buffer, entry.data.data() + offset, count);
+    });
+}
+
+bool BlockCache::write_locked(Range range, vector<IORequest>& runs)
+{
+    range.block_i += range.offset / block_size_;
+    range.offset %= block_size_;
+
+    // A block that an earlier range of the batch writes straight to the
+    // file must not be loaded into the cache before that write is done,
+    // so such a range is written straight to the file as well.
+    if (capacity_ > 0 && range.count <= block_size_ && !overlaps_runs(range, runs)) {
+        while (range.count > 0) {
+            size_t part = min(block_size_ - range.offset, range.count);
+
+            // No need to read the old contents if all of them are overwritten.
+            Entry* entry = get_entry(range.block_i, part < block_size_);
+            if (entry == nullptr) {
+                return false;
+            }
+
+            memcpy(entry->data.data() + range.offset, range.buffer, part);
+            mark_dirty(*entry);
+            range.buffer += part;
+            range.count -= part;
+            range.offset = 0;
+            ++range.block_i;
+        }
+        return true;
+    }
+
+    // Same as with reading, cached blocks are updated in the cache, and
+    // runs of uncached blocks are written straight to the file.
+    return split_range(range, true, runs, [this](char* buffer, Entry& entry, size_t offset, size_t count) {
+        memcpy(entry.data.data() + offset, buffer, count);
+        mark_dirty(entry);
+    });
+}
+
+vector<BlockCache::Entry*> BlockCache::get_dirty()
+{
+    // In block order, so that the writes are as sequential as possible.
+    vector<Entry*> dirty;
+    for (Entry& entry : lru_) {
+        if (entry.dirty) {
+            dirty.push_back(&entry);
+        }
+    }
+    sort(dirty.begin(), dirty.end(), [](Entry* a, Entry* b) {
+        return a->block_i < b->block_i;
+    });
+    return dirty;
+}
+
+bool BlockCache::commit()
+{
+    vector<Entry*> dirty = get_dirty();
+
+    size_t needed = journal_->blocks_needed(dirty.size());
+    if (needed > journal_->get_free() and !checkpoint_locked()) {
+        return false;
+    }
+
+    if (needed > journal_->get_free()) {
+        // Too large for the whole journal. The blocks are written to
+        // their places without its protection.
+        for (Entry* entry : dirty) {
+            if (!write_back(*entry)) {
+                return false;
+            }
+        }
+        return storage_.sync();
+    }
+
+    vector<pair<unsigned int, const char*>> blocks;
+    for (Entry* entry : dirty) {
+        blocks.push_back({entry->block_i, entry->data.data()});
+    }
+
+    vector<size_t> positions;
+    if (!journal_->append(blocks, positions)) {
+        return false;
+    }
+    count(StatCounter::JOURNAL_COMMITS);
+
+    for (size_t i = 0; i < dirty.size(); ++i) {
+        dirty[i]->dirty = false;
+        dirty[i]->logged = true;
+        journaled_[dirty[i]->block_i] = positions[i];
+    }
+    n_dirty_ -= dirty.size();
+
+    return true;
+}
+
+bool BlockCache::checkpoint_locked()
+{
+    if (journal_ == nullptr or journaled_.empty()) {
+        return true;
+    }
+
+    // Blocks that were evicted have been written already. A block that
+    // has changed again since it was logged is written as it was logged.
+    vector<char> image(block_size_);
+    for (Entry& entry : lru_) {
+        if (!entry.logged) {
+            continue;
+        }
+
+        const char* data = entry.data.data();
+        if (entry.dirty) {
+            if (!journal_->read_image(journaled_[entry.block_i], image.data())) {
+                return false;
+            }
+            data = image.data();
+        }
+
+        if (!storage_.write((size_t)entry.block_i * block_size_, data, block_size_)) {
+            return false;
+        }
+        entry.logged = false;
+    }
+
+    if (!storage_.sync() or !journal_->clear()) {
+        return false;
+    }
+    journaled_.clear();
+    return true;
+}
+
+bool BlockCache::overlaps_runs(Range const& range, vector<IORequest> const& runs)
+{
+    size_t first_block = range.block_i;
+    size_t last_block = range.block_i + (range.offset + range.count - 1) / block_size_;
+
+    for (IORequest const& run : runs) {
+        size_t run_first_block = run.pos / block_size_;
+        size_t run_last_block = (run.pos + run.count - 1) / block_size_;
+        if (run_first_block <= last_block and first_block <= run_last_block) {
+            return true;
+        }
+    }
+    return false;
+}
+
+template <typename CopyFunction>
+bool BlockCache::split_range(Range range, bool write, vector<IORequest>& runs, CopyFunction copy)
+{
+    size_t first_run = runs.size();
+
+    while (range.count > 0) {
+        size_t part = min(block_size_ - range.offset, range.count);
+
+        auto iter = entries_.find(range.block_i);
+        if (iter != entries_.end()) {
+            count(StatCounter::CACHE_HITS);
+            copy(range.buffer, *iter->second, range.offset, part);
+        } else if (write and journaled_.count(range.block_i)) {
+            // The block has an image in the journal, which would overwrite
+            // a straight write on replay. Through the cache, the new
+            // contents get logged as well.
+            Entry* entry = get_entry(range.block_i, part < block_size_);
+            if (entry == nullptr) {
+                return false;
+            }
+            copy(range.buffer, *entry, range.offset, part);
+        } else if (runs.size() > first_run and runs.back().buffer + runs.back().count == range.buffer) {
+            count(StatCounter::CACHE_MISSES);
+            runs.back().count += part;
+        } else {
+            count(StatCounter::CACHE_MISSES);
+            runs.push_back({write, (size_t)range.block_i * block_size_ + range.offset, range.buffer, part});
+        }
+
+        range.buffer += part;
+        range.count -= part;
+        range.offset = 0;
+        ++range.block_i;
+    }
+
+    return true;
+}
+
+} // namespace ffsys
@@ -0,0 +1,175 @@
+#ifndef BLOCK_CACHE_HH
+#define BLOCK_CACHE_HH
+
+#include "io_engine.hh"
+#include "journal.hh"
+#include "stats.hh"
+#include "storage.hh"
+
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace ffsys {
+
+/**
+ * Write-back cache of whole FFSys blocks that sits between the FFSys class
+ * and the FFSys file. Blocks are loaded on first access and kept in memory
+ * until they are evicted in least recently used order. Written blocks are
+ * only marked dirty, and reach the file when they are evicted or when
+ * flush() is called.
+ *
+ * Only accesses of at most one block in length load blocks into the
+ * cache. Longer ranges (file contents) use the blocks that are already
+ * cached and otherwise go straight to the file, one I/O per run of
+ * uncached blocks. Those runs are carried out by an IOEngine, which can
+ * have all the runs of a call in flight at the same time.
+ *
+ * A capacity of 0 disables caching, in which case every access goes
+ * straight to the file, except to pinned blocks.
+ *
+ * With a Journal, dirty blocks are not written to their places on
+ * eviction. flush() logs them all as one transaction instead, after which
+ * they can be written to their places whenever they are evicted, and at
+ * the latest by checkpoint(), which then empties the journal. Until it is
+ * logged, the caller has to keep the cached contents consistent only at
+ * the points where it calls flush(). A block that has an image in the
+ * journal is always written through the cache, so that a replay can not
+ * overwrite newer contents with the logged ones.
+ *
+ * The cache can be used from many threads. The uncached runs of long
+ * ranges are transferred without holding the cache's lock, so the caller
+ * must make sure no one else accesses those blocks at the same time. The
+ * FFSys class does this with its per-file locks, since only file contents
+ * are accessed in ranges longer than a block.
+ */
+class BlockCache
+{
+public:
+    // Hits, misses, evictions and commits are counted into stats, if given.
+    BlockCache(Storage& storage, IOEngine& engine, unsigned int block_size, size_t capacity,
+               Journal* journal = nullptr, Stats* stats = nullptr);
+
+    // Reads count bytes starting offset bytes into the i:th block. The
+    // range may continue over the following blocks.
+    bool read(unsigned int block_i, char* buffer, size_t count, size_t offset = 0);
+
+    // Writes count bytes starting offset bytes into the i:th block. The
+    // range may continue over the following blocks.
+    bool write(unsigned int block_i, const char* buffer, size_t count, size_t offset = 0);
+
+    // A range of bytes starting offset bytes into the i:th block, for
+    // reading or writing several ranges at once.
+    struct Range {
+        unsigned int block_i;
+        char* buffer;
+        size_t count;
+        size_t offset;
+    };
+
+    // Like read and write above, but for many ranges, which must not
+    // overlap. The uncached runs of all of them are handed to the engine
+    // as one batch.
+    bool read(std::vector<Range> const& ranges);
+    bool write(std::vector<Range> const& ranges);
+
+    // Pins the count blocks from the i:th on in the cache, loading the
+    // ones that are not cached yet with one read per run of them, and sets
+    // data to their contents in the cache. The contents stay in place until
+    // a block has been unpinned as many times as it was pinned, since a
+    // pinned block is not evicted (the cache grows past its capacity
+    // instead). If only_cached, blocks that are not cached already are not
+    // loaded or pinned, and their data is nullptr. Returns false if the
+    // blocks could not be read, in which case none of them are pinned.
+    bool pin(unsigned int block_i, unsigned int count, std::vector<const char*>& data, bool only_cached = false);
+    void unpin(unsigned int block_i);
+
+    // Writes all dirty blocks to the storage, in block order, or with a
+    // journal, logs them as one transaction. Returns false if they could
+    // not be written.
+    bool flush();
+
+    // Writes the logged blocks to their places and empties the journal.
+    bool checkpoint();
+
+    size_t get_capacity();
+    size_t get_n_dirty();
+
+private:
+    struct Entry {
+        unsigned int block_i;
+
+        // Changed since it was last written or logged.
+        bool dirty;
+
+        // Logged, but not written to its place since.
+        bool logged;
+
+        // How many times the block is pinned.
+        unsigned int pins;
+
+        std::vector<char> data;
+    };
+
+    Storage& storage_;
+    IOEngine& engine_;
+    Journal* journal_;
+    Stats* stats_;
+    unsigned int block_size_;
+
+    // Guards everything below.
+    std::mutex mutex_;
+
+    size_t capacity_;
+    size_t n_dirty_ = 0;
+
+    // Most recently used entry at the front.
+    std::list<Entry> lru_;
+    std::unordered_map<unsigned int, std::list<Entry>::iterator> entries_;
+
+    // The journal position of the newest image of each logged block.
+    std::unordered_map<unsigned int, size_t> journaled_;
+
+    // Returns the cache entry of the given block, loading it from the file
+    // if it is not cached yet. If load is false, a missing block is not read
+    // from the file (used when the whole block is about to be overwritten).
+    // Returns nullptr if the block could not be read.
+    Entry* get_entry(unsigned int block_i, bool load = true);
+
+    // Evicts least recently used entries until there is room for one more.
+    bool make_room();
+
+    void count(StatCounter counter);
+
+    // Writes the entry to its place, if it is dirty or logged.
+    bool write_back(Entry& entry);
+    void mark_dirty(Entry& entry);
+
+    // The dirty entries in block order.
+    std::vector<Entry*> get_dirty();
+
+    // Logs the dirty entries as one transaction, making room in the
+    // journal with a checkpoint if needed.
+    bool commit();
+    bool checkpoint_locked();
+
+    // Transfer a range through the cache, adding the runs that go
+    // straight to the storage to runs. mutex_ must be held.
+    bool read_locked(Range range, std::vector<IORequest>& runs);
+    bool write_locked(Range range, std::vector<IORequest>& runs);
+
+    // Whether the range shares a block with any of the runs.
+    bool overlaps_runs(Range const& range, std::vector<IORequest> const& runs);
+
+    // Splits a range into the parts that are cached,
+    // which are given to copy, and runs of uncached blocks, which are
+    // added to runs. mutex_ must be held.
+    template <typename CopyFunction>
+    bool split_range(Range range, bool write, std::vector<IORequest>& runs, CopyFunction copy);
+};
+
+} // namespace ffsys
+
+#endif // BLOCK_CACHE_HH
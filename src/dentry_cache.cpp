@@ -0,0 +1,66 @@
+#include "dentry_cache.hh"
+
+using namespace std;
+
+namespace ffsys {
+
+DentryCache::DentryCache(size_t capacity, Stats* stats):
+    stats_(stats), capacity_(capacity)
+{
+}
+
+bool DentryCache::find(unsigned int directory, string const& name, unsigned int& inode)
+{
+    auto iter = entries_.find(make_key(directory, name));
+    if (iter == entries_.end()) {
+        if (stats_ != nullptr) {
+            stats_->add(StatCounter::DENTRY_MISSES);
+        }
+        return false;
+    }
+
+    // Move to the front of the LRU list.
+    lru_.splice(lru_.begin(), lru_, iter->second);
+    if (stats_ != nullptr) {
+        stats_->add(StatCounter::DENTRY_HITS);
+    }
+    inode = iter->second->inode;
+    return true;
+}
+
+void DentryCache::insert(unsigned int directory, string const& name, unsigned int inode)
+{
+    if (capacity_ == 0) {
+        return;
+    }
+
+    string key = make_key(directory, name);
+    auto iter = entries_.find(key);
+    if (iter != entries_.end()) {
+        iter->second->inode = inode;
+        lru_.splice(lru_.begin(), lru_, iter->second);
+        return;
+    }
+
+    if (lru_.size() >= capacity_) {
+        entries_.erase(lru_.back().key);
+        lru_.pop_back();
+    }
+
+    lru_.push_front({key, inode});
+    entries_.insert({std::move(key), lru_.begin()});
+}
+
+size_t DentryCache::size()
+{
+    return lru_.size();
+}
+
+string DentryCache::make_key(unsigned int directory, string const& name)
+{
+    string key(reinterpret_cast<char const*>(&directory), sizeof(directory));
+    key += name;
+    return key;
+}
+
+} // namespace ffsys
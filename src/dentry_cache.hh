@@ -0,0 +1,55 @@
+#ifndef DENTRY_CACHE_HH
+#define DENTRY_CACHE_HH
+
+#include "stats.hh"
+
+#include <list>
+#include <string>
+#include <unordered_map>
+
+namespace ffsys {
+
+/**
+ * Cache of directory entries: the i-node numbers of names that have been
+ * looked up in (or added to) directories, so that resolving the same
+ * paths again does not need to read the directories' index blocks. Holds
+ * at most capacity entries, and evicts them in least recently used order.
+ * A capacity of 0 disables caching.
+ *
+ * Entries are never changed, since files can not be removed or renamed.
+ * The cache is not thread safe: the FFSys class only uses it with its
+ * names lock held.
+ */
+class DentryCache
+{
+public:
+    // Hits and misses are counted into stats, if given.
+    DentryCache(size_t capacity, Stats* stats = nullptr);
+
+    // Finds the i-node of the name in the directory of the given i-node.
+    bool find(unsigned int directory, std::string const& name, unsigned int& inode);
+
+    void insert(unsigned int directory, std::string const& name, unsigned int inode);
+
+    size_t size();
+
+private:
+    // The key is the directory's i-node number followed by the name.
+    struct Entry {
+        std::string key;
+        unsigned int inode;
+    };
+
+    Stats* stats_;
+    size_t capacity_;
+
+    // Most recently used entry at the front.
+    std::list<Entry> lru_;
+    std::unordered_map<std::string, std::list<Entry>::iterator> entries_;
+
+    static std::string make_key(unsigned int directory, std::string const& name);
+};
+
+} // namespace ffsys
+
+#endif // DENTRY_CACHE_HH
@@ -1,661 +1,3555 @@
 #include "ffsys.hh"
 #include "utilities.hh"
 
+#include <algorithm>
+#include <cstring>
 #include <iostream>
 #include <iomanip>
+#include <limits>
 #include <ctime>
+#include <filesystem>
 
 using namespace std;
 
 namespace ffsys {
 
-FFSys::FFSys(string path, unsigned long block_size):
-    fs_(path,
-        std::ios_base::binary
-      | std::ios_base::in
-      | std::ios_base::out
-      | std::ios_base::trunc
-    )
+namespace {
+
+// Walks through the buffers of an IOVec array in order.
+struct IOVecCursor {
+    IOVec const* iov;
+    size_t offset = 0;
+
+    // Returns the next part of the buffers, at most max_count bytes long.
+    // There must be bytes left in the buffers.
+    pair<char*, size_t> next(size_t max_count)
+    {
+        while (offset == iov->len) {
+            ++iov;
+            offset = 0;
+        }
+
+        size_t count = min(max_count, iov->len - offset);
+        char* part = iov->base + offset;
+        offset += count;
+        return {part, count};
+    }
+};
+
+size_t total_length(IOVec const* iov, int iovcnt)
+{
+    size_t length = 0;
+    for (int i = 0; i < iovcnt; ++i) {
+        length += iov[i].len;
+    }
+    return length;
+}
+
+// Copies count bytes from data into the buffers, starting offset bytes in.
+void copy_to_iov(IOVec const* iov, size_t offset, const char* data, size_t count)
+{
+    IOVecCursor buffers = {iov};
+    while (offset > 0) {
+        offset -= buffers.next(offset).second;
+    }
+    while (count > 0) {
+        auto [buffer, part] = buffers.next(count);
+        memcpy(buffer, data, part);
+        data += part;
+        count -= part;
+    }
+}
+
+// What the holes of sparse files read as. Views of holes point here, so
+// it is never written to.
+constexpr size_t ZEROS_SIZE = 1 << 20;
+char zeros[ZEROS_SIZE];
+
+// Fills count bytes of the buffers with zeros, starting offset bytes in.
+void zero_iov(IOVec const* iov, size_t offset, size_t count)
+{
+    IOVecCursor buffers = {iov};
+    while (offset > 0) {
+        offset -= buffers.next(offset).second;
+    }
+    while (count > 0) {
+        auto [buffer, part] = buffers.next(count);
+        memset(buffer, 0, part);
+        count -= part;
+    }
+}
+
+// Copies count bytes from the buffers into data.
+void copy_from_iov(char* data, IOVec const* iov, size_t count)
+{
+    IOVecCursor buffers = {iov};
+    while (count > 0) {
+        auto [buffer, part] = buffers.next(count);
+        memcpy(data, buffer, part);
+        data += part;
+        count -= part;
+    }
+}
+
+// The 32-bit FNV-1a hash of a name, by which directory entries are
+// indexed.
+uint32_t name_hash(string const& name)
+{
+    uint32_t hash = 2166136261u;
+    for (unsigned char c : name) {
+        hash ^= c;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// A directory entry read out of a leaf block.
+struct LeafRecord {
+    uint32_t hash;
+    string name;
+    uint32_t inode;
+    bool directory;
+};
+
+size_t record_size(LeafRecord const& record)
+{
+    return sizeof(DirectoryEntry) + record.name.size();
+}
+
+void read_leaf(char const* block, size_t block_size, vector<LeafRecord>& records)
+{
+    DirectoryLeaf leaf;
+    memcpy(&leaf, block, sizeof(leaf));
+    size_t pos = sizeof(DirectoryLeaf);
+    size_t end = min<size_t>(block_size, pos + leaf.used);
+    while (pos + sizeof(DirectoryEntry) <= end) {
+        DirectoryEntry entry;
+        memcpy(&entry, block + pos, sizeof(entry));
+        pos += sizeof(entry);
+        if (pos + entry.name_length > end) {
+            break;
+        }
+
+        string name(block + pos, entry.name_length);
+        pos += entry.name_length;
+        records.push_back({name_hash(name), std::move(name), entry.inode, entry.directory != 0});
+    }
+}
+
+void write_leaf(char* block, size_t block_size, LeafRecord const* begin, LeafRecord const* end)
+{
+    memset(block, 0, block_size);
+    size_t pos = sizeof(DirectoryLeaf);
+    for (LeafRecord const* record = begin; record != end; ++record) {
+        DirectoryEntry entry = {record->inode, (uint16_t)record->name.size(), record->directory, 0};
+        memcpy(block + pos, &entry, sizeof(entry));
+        memcpy(block + pos + sizeof(entry), record->name.data(), record->name.size());
+        pos += record_size(*record);
+    }
+    DirectoryLeaf leaf = {(uint32_t)(pos - sizeof(DirectoryLeaf))};
+    memcpy(block, &leaf, sizeof(leaf));
+}
+
+// Chooses where to split the records (sorted by hash) of a full leaf in
+// two: between two different hashes, so that the entries of one hash stay
+// in the same leaf, and as near the middle by bytes as possible while both
+// halves fit. The second half starts at split.
+bool choose_leaf_split(vector<LeafRecord> const& records, size_t block_size, size_t& split)
+{
+    size_t capacity = block_size - sizeof(DirectoryLeaf);
+    size_t total = 0;
+    for (LeafRecord const& record : records) {
+        total += record_size(record);
+    }
+
+    bool found = false;
+    size_t best_difference = 0;
+    size_t first_half = 0;
+    for (size_t i = 1; i < records.size(); ++i) {
+        first_half += record_size(records[i - 1]);
+        if (records[i - 1].hash == records[i].hash or first_half > capacity or total - first_half > capacity) {
+            continue;
+        }
+
+        size_t difference = max(first_half, total - first_half) - min(first_half, total - first_half);
+        if (!found or difference < best_difference) {
+            found = true;
+            best_difference = difference;
+            split = i;
+        }
+    }
+    return found;
+}
+
+// The index node of a directory block: right after the header in the
+// root, and at the start of other index blocks.
+DirectoryIndexNode* index_node(char* block, bool root)
+{
+    return reinterpret_cast<DirectoryIndexNode*>(block + (root ? sizeof(DirectoryHeader) : 0));
+}
+
+DirectoryIndexEntry* index_entries(DirectoryIndexNode* node)
+{
+    return reinterpret_cast<DirectoryIndexEntry*>(node + 1);
+}
+
+unsigned int index_capacity(size_t block_size, bool root)
+{
+    size_t node_start = root ? sizeof(DirectoryHeader) : 0;
+    return (block_size - node_start - sizeof(DirectoryIndexNode)) / sizeof(DirectoryIndexEntry);
+}
+
+void write_index_node(char* block, bool root, DirectoryIndexEntry const* begin, DirectoryIndexEntry const* end)
+{
+    DirectoryIndexNode* node = index_node(block, root);
+    node->count = end - begin;
+    copy(begin, end, index_entries(node));
+}
+
+}
+
+thread_local ErrorNumber FFSys::errnum_ = ErrorNumber::NO_ERROR;
+
+FFSys::FFSys(string path, unsigned long block_size, MountOptions options):
+    use_extents_(options.extents),
+    use_inline_data_(options.inline_data),
+    write_buffer_size_(options.write_buffer_size),
+    read_ahead_size_(options.read_ahead_size),
+    n_async_threads_(options.io_threads)
 {
 
     if (block_size < SUPERBLOCK_SIZE) {
         throw std::string("Error: block size is too small");
     }
-
-    if (!fs_) {
-        throw std::string("Error opening file");
+    if (block_size > numeric_limits<uint16_t>::max()) {
+        throw std::string("Error: block size is too large");
     }
 
     // Superblock with default values, calculated based on block size.
+    // Each group has as many i-nodes and data blocks as fit into one
+    // bitmap block.
     sb_.block_size = block_size;
-    sb_.n_data_blocks = 8 * block_size;
-    sb_.n_inodes = 8 * block_size;
-    sb_.n_inode_blocks = (sb_.n_inodes * INODE_SIZE + block_size - 1) / block_size;
-
-    sb_.inode_bitmap_i = 1;
-    sb_.data_block_bitmap_i = 2;
-    sb_.inodes_start_i = 3;
-    sb_.data_blocks_start_i = sb_.inodes_start_i + sb_.n_inode_blocks;
+    sb_.features = FEATURE_INODE_FLAGS | FEATURE_BLOCK_GROUPS;
+    sb_.n_groups = max(1u, options.block_groups);
+    sb_.inodes_per_group = 8 * block_size;
+    sb_.inode_blocks_per_group = (sb_.inodes_per_group * INODE_SIZE + block_size - 1) / block_size;
+    sb_.data_blocks_per_group = 8 * block_size;
+    sb_.group_table_i = 1;
+
+    // Data block addresses are 32-bit signed, and block indices 32-bit
+    // with room left for the journal.
+    if (sb_.total_n_blocks() * 2 > numeric_limits<uint32_t>::max()) {
+        throw std::string("Error: too many block groups");
+    }
 
+    sb_.n_inodes = sb_.n_groups * sb_.inodes_per_group;
+    sb_.n_data_blocks = sb_.n_groups * sb_.data_blocks_per_group;
     sb_.n_free_inodes = sb_.n_inodes;
     sb_.n_free_data_blocks = sb_.n_data_blocks;
 
     sb_.address_block_capacity = block_size / sizeof(int32_t);
 
-    // Init file as all zero bytes.
-    for (int i = 0; i < sb_.total_n_blocks() * block_size; ++i) {
-        fs_.put(NULL_CHAR);
+    unsigned int first_group_i = sb_.group_table_i + sb_.n_group_table_blocks();
+    for (unsigned int g = 0; g < sb_.n_groups; ++g) {
+        GroupDescriptor group;
+        group.inode_bitmap_i = first_group_i + g * sb_.n_group_blocks();
+        group.data_block_bitmap_i = group.inode_bitmap_i + 1;
+        group.inodes_start_i = group.inode_bitmap_i + 2;
+        group.data_blocks_start_i = group.inodes_start_i + sb_.inode_blocks_per_group;
+        group.n_free_inodes = sb_.inodes_per_group;
+        group.n_free_data_blocks = sb_.data_blocks_per_group;
+        groups_.push_back(group);
+    }
+
+    // The journal takes about 3 % more space than the data blocks.
+    if (options.journal) {
+        sb_.journal_start_i = first_group_i + sb_.n_groups * sb_.n_group_blocks();
+        sb_.n_journal_blocks = max(64u, sb_.n_data_blocks / 32);
+    }
+
+    // Init file as all zero bytes. Only the size of the file is set, so the
+    // zeros are not actually written (and take no space on filesystems that
+    // support sparse files). The i-node table and the data blocks are left
+    // like this: an i-node is only read once it has been reserved and fully
+    // written, and address blocks are filled when they are reserved.
+    {
+        ofstream file(path, std::ios_base::binary | std::ios_base::trunc);
+        if (!file) {
+            throw std::string("Error opening file");
+        }
+    }
+
+    std::error_code error;
+    filesystem::resize_file(path, (uintmax_t)sb_.total_n_blocks() * block_size, error);
+    if (error) {
+        throw std::string("Error opening file");
     }
 
+    storage_ = Storage::open(path, options.storage);
+    init_cache(options);
+
     // Write superblock
     write_superblock();
 
-    // Allocate bitmap helper buffers
-    inode_bitmap_ = new Bitmap(block_size);
-    data_block_bitmap_ = new Bitmap(block_size);
-
     // Helper buffer for initializing address blocks.
     empty_address_block_buffer = new int32_t[sb_.address_block_capacity];
     for (int i = 0; i < sb_.address_block_capacity; ++i) {
         empty_address_block_buffer[i] = -1;
     }
 
-    // Init the bitmaps.
-    write_block(sb_.inode_bitmap_i, inode_bitmap_->get_bm());
-    write_block(sb_.data_block_bitmap_i, data_block_bitmap_->get_bm());
-}
+    // Allocate bitmap helper buffers, and init the bitmaps and the group
+    // descriptors.
+    for (unsigned int g = 0; g < sb_.n_groups; ++g) {
+        inode_bitmaps_.push_back(new Bitmap(block_size));
+        data_block_bitmaps_.push_back(new Bitmap(block_size));
 
-FFSys::FFSys(string path):
-    fs_(path,
-        std::ios_base::binary
-      | std::ios_base::in
-      | std::ios_base::out
-    )
-{
-    if (!fs_) {
-        throw std::string("Error opening file");
+        write_block(groups_[g].inode_bitmap_i, inode_bitmaps_[g]->get_bm());
+        write_block(groups_[g].data_block_bitmap_i, data_block_bitmaps_[g]->get_bm());
+        write_group_descriptor(g);
     }
 
+    dentries_ = new DentryCache(options.dentry_cache_size, &stats_);
+    create_root_directory();
+
+    // The journal is found through the superblock, so it has to be in
+    // its place from the start.
+    if (!sync() or !cache_->checkpoint()) {
+        throw std::string("Error writing file");
+    }
+}
+
+FFSys::FFSys(string path, MountOptions options):
+    use_extents_(options.extents),
+    use_inline_data_(options.inline_data),
+    write_buffer_size_(options.write_buffer_size),
+    read_ahead_size_(options.read_ahead_size),
+    storage_(Storage::open(path, options.storage)),
+    n_async_threads_(options.io_threads)
+{
     // Read superblock
     if (!read_superblock(sb_)) {
         throw "Error reading superblock, corrupted.";
     }
 
-    // Read bitmaps
-    inode_bitmap_ = new Bitmap(sb_.block_size);
-    read_block(sb_.inode_bitmap_i, inode_bitmap_->get_bm());
+    init_cache(options);
+
+    // Finish what was logged before a crash. The superblock may have
+    // been logged too.
+    if (journal_ != nullptr) {
+        unsigned int replayed = 0;
+        if (!journal_->replay(replayed)) {
+            throw std::string("Error replaying the journal");
+        }
+        if (replayed > 0 and !read_superblock(sb_)) {
+            throw std::string("Error reading superblock, corrupted.");
+        }
+    }
 
-    data_block_bitmap_ = new Bitmap(sb_.block_size);
-    read_block(sb_.data_block_bitmap_i, data_block_bitmap_->get_bm());
+    load_groups();
 
     // Helper buffer for initializing address blocks.
     empty_address_block_buffer = new int32_t[sb_.address_block_capacity];
     for (int i = 0; i < sb_.address_block_capacity; ++i) {
         empty_address_block_buffer[i] = -1;
     }
+
+    dentries_ = new DentryCache(options.dentry_cache_size, &stats_);
+
+    if (!(sb_.features & FEATURE_INODE_FLAGS)) {
+        upgrade_inode_flags();
+    }
+
+    if (!(sb_.features & FEATURE_DIRECTORIES)) {
+        upgrade_directories();
+    }
 }
 
 FFSys::~FFSys()
 {
-    if (fs_) {
-        fs_.close();
+    // Lets the background reads and writes finish first.
+    if (async_pool_ != nullptr) {
+        delete async_pool_;
+    }
+
+    // Leaves the journal empty, so nothing is replayed on the next mount.
+    if (sync()) {
+        cache_->checkpoint();
+    }
+
+    if (cache_ != nullptr) {
+        delete cache_;
+    }
+
+    if (journal_ != nullptr) {
+        delete journal_;
+    }
+
+    if (io_engine_ != nullptr) {
+        delete io_engine_;
+    }
+
+    if (storage_ != nullptr) {
+        delete storage_;
         cout << "FS file closed." << endl;
     }
 
-    if (inode_bitmap_ != nullptr) {
-        delete inode_bitmap_;
+    for (Bitmap* bitmap : inode_bitmaps_) {
+        delete bitmap;
     }
 
-    if (data_block_bitmap_ != nullptr) {
-        delete data_block_bitmap_;
+    for (Bitmap* bitmap : data_block_bitmaps_) {
+        delete bitmap;
     }
 
     if (empty_address_block_buffer != nullptr) {
         delete[] empty_address_block_buffer;
     }
+
+    if (dentries_ != nullptr) {
+        delete dentries_;
+    }
 }
 
-file_descriptor FFSys::open(std::string name, int flags)
+file_descriptor FFSys::open(std::string path, int flags)
 {
-    INode file = {};
+    Stats::Timer timer(stats_, StatOp::OPEN);
+
+    shared_lock transaction_lock(transaction_mutex_);
+
+    shared_ptr<CachedINode> cached;
+    {
+        lock_guard names_lock(names_mutex_);
+        INode file = {};
+
+        unsigned int directory;
+        string name;
+        if (!resolve_parent(path, directory, name)) {
+            return -1;
+        }
+        if (name.empty()) {
+            errnum_ = ErrorNumber::IS_A_DIRECTORY;
+            return -1;
+        }
 
-    // Try to find file from FS by name.
-    if (!find_file(name, file)) {
+        // Try to find file from its directory by name.
+        int inode_i = lookup(directory, name);
+        if (inode_i == -1) {
+
+            // If file wasn't found and the create flag was not specified, return
+            if (not (flags & OpenFlags::CREATE)) {
+                errnum_ = ErrorNumber::NO_SUCH_FILE;
+                return -1;
+            }
 
-        // If file wasn't found and the create flag was not specified, return
-        if (not (flags & OpenFlags::CREATE)) {
-            errnum_ = ErrorNumber::NO_SUCH_FILE;
+            // Try to create the file.
+            if (!create_file(name, directory, file)) {
+                flush_metadata();
+                return -1;
+            }
+        } else if (!read_inode(inode_i, file)) {
+            errnum_ = ErrorNumber::CANT_READ_INODE;
             return -1;
         }
 
-        // Try to create the file.
-        if (!create_file(name, file)) {
+        if (file.flags & INODE_DIRECTORY) {
+            errnum_ = ErrorNumber::IS_A_DIRECTORY;
             return -1;
         }
-    }
 
-    // Clear the file contents if TRUNCATE is wanted
-    if (flags & OpenFlags::TRUNCATE) {
-        file.size = 0;
-        free_unused_file_blocks(file);
+        cached = get_cached_inode(file);
     }
 
-    // Generate new file descriptor.
-    file_descriptor fd = 0;
-    while (open_files_.find(fd) != open_files_.end()) {
-        ++fd;
+    size_t file_pos = 0;
+    {
+        unique_lock file_lock(cached->lock);
+
+        // Clear the file contents if TRUNCATE is wanted. If that fails,
+        // no descriptor is opened.
+        if (flags & OpenFlags::TRUNCATE and !truncate_file(*cached, 0)) {
+            file_lock.unlock();
+            unsigned int inode = cached->inode.index;
+            cached.reset();
+            release_cached_inode(inode);
+            flush_metadata();
+            return -1;
+        }
+
+        if (flags & OpenFlags::END) {
+            file_pos = cached->size();
+        }
     }
 
-    size_t file_pos = flags & OpenFlags::END ? file.size : 0;
-    auto file_info = make_shared<OpenFile>(fd, file.index, file_pos);
-    open_files_.insert({file_info->fd, file_info});
+    file_descriptor fd = add_open_file(cached->inode.index, file_pos, cached);
+
+    flush_metadata();
+    transaction_lock.unlock();
+    commit_if_due();
 
-    return file_info->fd;
+    return fd;
 }
 
-ssize_t FFSys::read(file_descriptor fd, char* buf, size_t count)
+bool FFSys::mkdir(std::string path)
 {
-    if (open_files_.find(fd) == open_files_.end()) {
-        errnum_ = ErrorNumber::NO_SUCH_FILE_DESCRIPTOR;
-        return -1;
+    Stats::Timer timer(stats_, StatOp::MKDIR);
+
+    shared_lock transaction_lock(transaction_mutex_);
+
+    bool created;
+    {
+        lock_guard names_lock(names_mutex_);
+
+        unsigned int directory;
+        string name;
+        if (!resolve_parent(path, directory, name)) {
+            return false;
+        }
+        if (name.empty() or lookup(directory, name) != -1) {
+            errnum_ = ErrorNumber::FILE_ALREADY_EXISTS;
+            return false;
+        }
+
+        INode inode;
+        created = create_file(name, directory, inode, true);
     }
 
-    auto file = open_files_.at(fd);
+    flush_metadata();
+    transaction_lock.unlock();
+    commit_if_due();
+
+    return created;
+}
+
+bool FFSys::list_directory(std::string path, vector<DirEntry>& entries)
+{
+    Stats::Timer timer(stats_, StatOp::LIST_DIRECTORY);
+
+    lock_guard names_lock(names_mutex_);
+
+    unsigned int directory;
+    string name;
+    if (!resolve_parent(path, directory, name)) {
+        return false;
+    }
+    if (!name.empty()) {
+        int inode_i = lookup(directory, name);
+        if (inode_i == -1) {
+            errnum_ = ErrorNumber::PATH_NOT_FOUND;
+            return false;
+        }
+        directory = inode_i;
+    }
 
-    INode inode = {};
-    if (!read_inode(file->inode, inode)) {
+    INode inode;
+    if (!read_inode(directory, inode)) {
         errnum_ = ErrorNumber::CANT_READ_INODE;
+        return false;
+    }
+    if (!(inode.flags & INODE_DIRECTORY)) {
+        errnum_ = ErrorNumber::NOT_A_DIRECTORY;
+        return false;
+    }
+
+    entries.clear();
+    return read_entries(inode, entries);
+}
+
+ssize_t FFSys::read(file_descriptor fd, char* buf, size_t count)
+{
+    Stats::Timer timer(stats_, StatOp::READ);
+
+    auto file = get_open_file(fd);
+    if (file == nullptr) {
+        errnum_ = ErrorNumber::NO_SUCH_FILE_DESCRIPTOR;
         return -1;
     }
 
-    size_t read = read_n_bytes_from_file(inode, buf, count, file->pos);
-    file->pos += read;
+    lock_guard pos_lock(file->pos_mutex);
+    shared_lock file_lock(file->cached->lock);
 
-    return read;
+    IOVec iov = {buf, count};
+    return read_at_position(*file, &iov, 1);
 }
 
 ssize_t FFSys::write(file_descriptor fd, char* buffer, size_t count)
 {
-    if (open_files_.find(fd) == open_files_.end()) {
+    Stats::Timer timer(stats_, StatOp::WRITE);
+
+    shared_lock transaction_lock(transaction_mutex_);
+
+    auto file = get_open_file(fd);
+    if (file == nullptr) {
         errnum_ = ErrorNumber::NO_SUCH_FILE_DESCRIPTOR;
         return -1;
     }
 
-    auto file = open_files_.at(fd);
+    ssize_t written = 0;
+    {
+        lock_guard pos_lock(file->pos_mutex);
+        unique_lock file_lock(file->cached->lock);
 
-    INode inode = {};
-    if (!read_inode(file->inode, inode)) {
-        errnum_ = ErrorNumber::CANT_READ_INODE;
-        return -1;
+        IOVec iov = {buffer, count};
+        written = buffered_write(*file->cached, &iov, 1, file->pos);
+        file->pos += max(written, (ssize_t)0);
     }
 
-    size_t written = write_n_bytes_to_file(inode, buffer, count, file->pos);
-    file->pos += written;
+    flush_metadata();
+    transaction_lock.unlock();
+    commit_if_due();
 
     return written;
 }
 
-bool FFSys::close(file_descriptor fd)
+ssize_t FFSys::pread(file_descriptor fd, char* buffer, size_t count, size_t offset)
 {
-    auto file_iter = open_files_.find(fd);
-    if (file_iter == open_files_.end()) {
+    Stats::Timer timer(stats_, StatOp::PREAD);
+
+    auto file = get_open_file(fd);
+    if (file == nullptr) {
         errnum_ = ErrorNumber::NO_SUCH_FILE_DESCRIPTOR;
-        return false;
+        return -1;
     }
 
-    open_files_.erase(file_iter);
+    shared_lock file_lock(file->cached->lock);
 
-    return true;
+    return read_n_bytes_from_file(*file->cached, buffer, count, offset);
 }
 
-bool FFSys::seek(file_descriptor fd, size_t pos)
+ssize_t FFSys::read_view(file_descriptor fd, size_t offset, size_t count, ReadView& view)
 {
-    if (open_files_.find(fd) == open_files_.end()) {
+    Stats::Timer timer(stats_, StatOp::READ_VIEW);
+
+    release_view(view);
+
+    auto file = get_open_file(fd);
+    if (file == nullptr) {
         errnum_ = ErrorNumber::NO_SUCH_FILE_DESCRIPTOR;
-        return false;
+        return -1;
     }
+    CachedINode& cached = *file->cached;
 
-    auto file = open_files_.at(fd);
+    // Buffered data is not in any block yet, so a buffer that starts
+    // before the end of the range is written first.
+    shared_lock file_lock(cached.lock);
+    while (!cached.buffer.empty() and cached.buffer_pos < offset + count) {
+        file_lock.unlock();
 
-    INode inode = {};
-    if (!read_inode(file->inode, inode)) {
-        errnum_ = ErrorNumber::CANT_READ_INODE;
-        return false;
+        bool flushed = true;
+        {
+            shared_lock transaction_lock(transaction_mutex_);
+            {
+                unique_lock write_lock(cached.lock);
+                flushed = flush_write_buffer(cached);
+            }
+            flush_metadata();
+        }
+        commit_if_due();
+
+        if (!flushed) {
+            return -1;
+        }
+        file_lock.lock();
     }
 
-    if (inode.size < pos) {
-        return false;
+    if (offset >= cached.size()) {
+        return 0;
     }
+    count = min(count, cached.size() - offset);
 
-    file->pos = pos;
-    return true;
-}
+    // The part of the range in the blocks. The rest is a hole up to the
+    // buffer.
+    size_t block_count = offset < cached.inode.size ? min(count, (size_t)cached.inode.size - offset) : 0;
 
-ErrorNumber FFSys::errnum()
-{
-    return errnum_;
-}
+    view.file = file->cached;
+    ++cached.n_views;
 
+    auto add_span = [&view](const char* data, size_t length) {
+        auto& spans = view.spans;
+        if (!spans.empty() and spans.back().data() + spans.back().size() == data) {
+            spans.back() = {spans.back().data(), spans.back().size() + length};
+        } else {
+            spans.push_back({data, length});
+        }
+    };
+    auto add_zeros = [&add_span](size_t length) {
+        for (size_t done = 0; done < length; done += ZEROS_SIZE) {
+            add_span(zeros, min(ZEROS_SIZE, length - done));
+        }
+    };
+
+    // Inline data has no block to point to, and is small enough to copy.
+    size_t done = 0;
+    if (cached.inode.flags & INODE_INLINE_DATA) {
+        view.copied.assign(cached.inode.inline_data + offset, cached.inode.inline_data + offset + block_count);
+        add_span(view.copied.data(), block_count);
+        done = block_count;
+    }
 
-bool FFSys::read_block(unsigned int block_i, char* block_buf, size_t count, size_t offset)
-{
-    fs_.seekg(block_i * sb_.block_size + offset);
-    fs_.read(block_buf, count);
-    return true;
-}
+    // Releasing the view can free the file's blocks, which takes the file
+    // lock exclusively.
+    auto fail = [&]() -> ssize_t {
+        file_lock.unlock();
+        release_view(view);
+        return -1;
+    };
+
+    vector<const char*> blocks;
+    unsigned int block_index = offset / sb_.block_size;
+    size_t block_offset = offset % sb_.block_size;
+    while (done < block_count) {
+        unsigned int blocks_left = (block_offset + block_count - done + sb_.block_size - 1) / sb_.block_size;
+        unsigned int run_length = 0;
+        int block_address = -1;
+        if (!get_file_block_run(cached, block_index, blocks_left, block_address, run_length)) {
+            return fail();
+        }
 
-bool FFSys::read_block(unsigned int block_i, char *block_buffer)
-{
-    return read_block(block_i, block_buffer, sb_.block_size);
-}
+        if (block_address == -1) {
+            unsigned int next = block_index;
+            if (!find_mapped_block(cached, block_index, block_index + blocks_left, next)) {
+                return fail();
+            }
+            size_t hole = min((size_t)(next - block_index) * sb_.block_size - block_offset, block_count - done);
+            add_zeros(hole);
+            done += hole;
 
-void FFSys::write_block(unsigned int block_i, char* block_buffer, size_t count, size_t offset)
-{
-    fs_.seekp(block_i * sb_.block_size + offset);
-    fs_.write(block_buffer, count);
-}
+            block_index = next;
+            block_offset = 0;
+            continue;
+        }
 
-void FFSys::write_block(unsigned int block_i, char *block_buffer)
-{
-    write_block(block_i, block_buffer, sb_.block_size);
-}
+        // A cached block can be newer than the one in the FFSys file, so
+        // the mapped blocks are only used for the blocks that are not
+        // cached.
+        unsigned int first = data_block_i(block_address);
+        const char* mapped = storage_->mapped((size_t)first * sb_.block_size, (size_t)run_length * sb_.block_size);
+        if (!cache_->pin(first, run_length, blocks, mapped != nullptr)) {
+            errnum_ = ErrorNumber::IO_ERROR;
+            return fail();
+        }
 
-bool FFSys::read_inode(int inode_i, INode& result)
-{
-    // Read bytes
-    unsigned int inode_start = sb_.inodes_start_i * sb_.block_size + inode_i * INODE_SIZE;
-    fs_.seekg(inode_start);
-    char buf[INODE_SIZE];
-    fs_.read(buf, INODE_SIZE);
+        for (unsigned int k = 0; k < run_length; ++k) {
+            const char* data = blocks[k];
+            if (data != nullptr) {
+                view.pinned_blocks.push_back(first + k);
+            } else {
+                data = mapped + (size_t)k * sb_.block_size;
+            }
 
-    // Cast the byte array to an INode.
-    result = bit_cast<INode>(buf);
-    return true;
-}
+            size_t part = min(sb_.block_size - block_offset, block_count - done);
+            add_span(data + block_offset, part);
+            done += part;
+            block_offset = 0;
+        }
 
-void FFSys::write_inode(INode& inode)
-{
-    unsigned int inode_start = sb_.inodes_start_i * sb_.block_size + inode.index * INODE_SIZE;
-    fs_.seekp(inode_start);
-    fs_.write(reinterpret_cast<char*>(&inode), INODE_SIZE);
+        block_index += run_length;
+    }
+
+    add_zeros(count - done);
+    return count;
 }
 
-bool FFSys::read_superblock(Superblock &result)
+void FFSys::release_view(ReadView& view)
 {
-    char buf[SUPERBLOCK_SIZE];
+    for (unsigned int block_i : view.pinned_blocks) {
+        cache_->unpin(block_i);
+    }
 
-    if (!read_block(SUPERBLOCK_I, buf, SUPERBLOCK_SIZE)) {
-        return false;
+    // The last view of the file frees the blocks that the file stopped
+    // using while it was held.
+    if (view.file != nullptr and view.file->n_views.fetch_sub(1) == 1) {
+        CachedINode& file = *view.file;
+
+        shared_lock transaction_lock(transaction_mutex_);
+        bool freed = false;
+        {
+            unique_lock file_lock(file.lock);
+            if (file.n_views == 0 and file.free_pending) {
+                file.free_pending = false;
+                free_unused_file_blocks(file);
+                freed = true;
+            }
+        }
+
+        if (freed) {
+            flush_metadata();
+            transaction_lock.unlock();
+            commit_if_due();
+        }
     }
 
-    result = bit_cast<Superblock>(buf);
-    return true;
+    view = {};
 }
 
-void FFSys::write_superblock()
+ssize_t FFSys::pwrite(file_descriptor fd, char* buffer, size_t count, size_t offset)
 {
-    write_block(SUPERBLOCK_I, reinterpret_cast<char*>(&sb_), SUPERBLOCK_SIZE);
-}
+    Stats::Timer timer(stats_, StatOp::PWRITE);
 
-bool FFSys::create_file(string name, INode &result)
-{
-    int inode_i = reserve_inode();
-    if (inode_i == -1) {
-        errnum_ = ErrorNumber::NO_FREE_INODES;
+    shared_lock transaction_lock(transaction_mutex_);
+
+    auto file = get_open_file(fd);
+    if (file == nullptr) {
+        errnum_ = ErrorNumber::NO_SUCH_FILE_DESCRIPTOR;
+        return -1;
+    }
+
+    ssize_t written = 0;
+    {
+        unique_lock file_lock(file->cached->lock);
+
+        IOVec iov = {buffer, count};
+        written = buffered_write(*file->cached, &iov, 1, offset);
+    }
+
+    flush_metadata();
+    transaction_lock.unlock();
+    commit_if_due();
+
+    return written;
+}
+
+ssize_t FFSys::readv(file_descriptor fd, IOVec const* iov, int iovcnt)
+{
+    Stats::Timer timer(stats_, StatOp::READV);
+
+    auto file = get_open_file(fd);
+    if (file == nullptr) {
+        errnum_ = ErrorNumber::NO_SUCH_FILE_DESCRIPTOR;
+        return -1;
+    }
+
+    lock_guard pos_lock(file->pos_mutex);
+    shared_lock file_lock(file->cached->lock);
+
+    return read_at_position(*file, iov, iovcnt);
+}
+
+ssize_t FFSys::writev(file_descriptor fd, IOVec const* iov, int iovcnt)
+{
+    Stats::Timer timer(stats_, StatOp::WRITEV);
+
+    shared_lock transaction_lock(transaction_mutex_);
+
+    auto file = get_open_file(fd);
+    if (file == nullptr) {
+        errnum_ = ErrorNumber::NO_SUCH_FILE_DESCRIPTOR;
+        return -1;
+    }
+
+    ssize_t written = 0;
+    {
+        lock_guard pos_lock(file->pos_mutex);
+        unique_lock file_lock(file->cached->lock);
+
+        written = buffered_write(*file->cached, iov, iovcnt, file->pos);
+        file->pos += max(written, (ssize_t)0);
+    }
+
+    flush_metadata();
+    transaction_lock.unlock();
+    commit_if_due();
+
+    return written;
+}
+
+bool FFSys::close(file_descriptor fd)
+{
+    Stats::Timer timer(stats_, StatOp::CLOSE);
+
+    shared_lock transaction_lock(transaction_mutex_);
+
+    shared_ptr<OpenFile> file;
+    {
+        OpenFileShard& shard = open_files_[fd % N_OPEN_FILE_SHARDS];
+        unique_lock shard_lock(shard.mutex);
+
+        auto file_iter = shard.files.find(fd);
+        if (file_iter == shard.files.end()) {
+            errnum_ = ErrorNumber::NO_SUCH_FILE_DESCRIPTOR;
+            return false;
+        }
+
+        file = file_iter->second;
+        shard.files.erase(file_iter);
+    }
+
+    bool flushed = true;
+    {
+        unique_lock file_lock(file->cached->lock);
+        flushed = flush_write_buffer(*file->cached);
+    }
+    flush_metadata();
+
+    unsigned int inode = file->inode;
+    file.reset();
+
+    // Drop the cached i-node once the file's last descriptor is closed.
+    release_cached_inode(inode);
+
+    transaction_lock.unlock();
+    commit_if_due();
+
+    return flushed;
+}
+
+bool FFSys::seek(file_descriptor fd, size_t pos)
+{
+    Stats::Timer timer(stats_, StatOp::SEEK);
+
+    auto file = get_open_file(fd);
+    if (file == nullptr) {
+        errnum_ = ErrorNumber::NO_SUCH_FILE_DESCRIPTOR;
+        return false;
+    }
+
+    lock_guard pos_lock(file->pos_mutex);
+    file->pos = pos;
+    return true;
+}
+
+ssize_t FFSys::seek_data(file_descriptor fd, size_t offset)
+{
+    return seek_data_or_hole(fd, offset, false);
+}
+
+ssize_t FFSys::seek_hole(file_descriptor fd, size_t offset)
+{
+    return seek_data_or_hole(fd, offset, true);
+}
+
+ssize_t FFSys::seek_data_or_hole(file_descriptor fd, size_t offset, bool hole)
+{
+    Stats::Timer timer(stats_, StatOp::SEEK);
+
+    auto file = get_open_file(fd);
+    if (file == nullptr) {
+        errnum_ = ErrorNumber::NO_SUCH_FILE_DESCRIPTOR;
+        return -1;
+    }
+
+    lock_guard pos_lock(file->pos_mutex);
+    shared_lock file_lock(file->cached->lock);
+
+    size_t size = file->cached->size();
+    size_t pos = size;
+    if (offset < size and !find_data(*file->cached, offset, hole, pos)) {
+        return -1;
+    }
+    if (offset >= size or (!hole and pos == size)) {
+        errnum_ = ErrorNumber::INVALID_POSITION;
+        return -1;
+    }
+
+    file->pos = pos;
+    return pos;
+}
+
+bool FFSys::fallocate(file_descriptor fd, size_t offset, size_t len)
+{
+    Stats::Timer timer(stats_, StatOp::FALLOCATE);
+
+    shared_lock transaction_lock(transaction_mutex_);
+
+    auto file = get_open_file(fd);
+    if (file == nullptr) {
+        errnum_ = ErrorNumber::NO_SUCH_FILE_DESCRIPTOR;
+        return false;
+    }
+
+    // The buffered writes get their blocks first, so that their claims
+    // (which can be more than they use) do not take space from this.
+    flush_write_buffers();
+
+    bool reserved = true;
+    if (len > 0) {
+        unique_lock file_lock(file->cached->lock);
+
+        unsigned int first = offset / sb_.block_size;
+        unsigned int last = (offset + len - 1) / sb_.block_size;
+        if (file->cached->inode.flags & INODE_INLINE_DATA and !move_inline_data(*file->cached)) {
+            reserved = false;
+        } else {
+            // Blocks given to holes inside the file are filled with zeros,
+            // as the holes read. Past its end, they are only filled when
+            // the file grows over them (see zero_file_range).
+            unsigned int end_block = (file->cached->inode.size + sb_.block_size - 1) / sb_.block_size;
+            if (first < end_block) {
+                unsigned int inside = min(last, end_block - 1);
+                reserved = reserve_missing_file_blocks(*file->cached, first, inside, true) > inside;
+            }
+            if (reserved and last >= end_block) {
+                reserved = reserve_missing_file_blocks(*file->cached, max(first, end_block), last) > last;
+            }
+            write_inode(file->cached->inode);
+        }
+    }
+
+    flush_metadata();
+    transaction_lock.unlock();
+    commit_if_due();
+
+    return reserved;
+}
+
+bool FFSys::truncate(file_descriptor fd, size_t size)
+{
+    Stats::Timer timer(stats_, StatOp::TRUNCATE);
+
+    shared_lock transaction_lock(transaction_mutex_);
+
+    auto file = get_open_file(fd);
+    if (file == nullptr) {
+        errnum_ = ErrorNumber::NO_SUCH_FILE_DESCRIPTOR;
+        return false;
+    }
+
+    bool truncated = true;
+    {
+        unique_lock file_lock(file->cached->lock);
+        truncated = truncate_file(*file->cached, size);
+    }
+
+    flush_metadata();
+    transaction_lock.unlock();
+    commit_if_due();
+
+    return truncated;
+}
+
+uint64_t FFSys::submit_read(file_descriptor fd, char* buffer, size_t count, size_t offset)
+{
+    return submit([=, this] {
+        return pread(fd, buffer, count, offset);
+    });
+}
+
+uint64_t FFSys::submit_write(file_descriptor fd, char* buffer, size_t count, size_t offset)
+{
+    return submit([=, this] {
+        return pwrite(fd, buffer, count, offset);
+    });
+}
+
+size_t FFSys::poll_completions(vector<Completion>& completions)
+{
+    return wait_completions(completions, 0);
+}
+
+size_t FFSys::wait_completions(vector<Completion>& completions, size_t min_count)
+{
+    unique_lock async_lock(async_mutex_);
+
+    min_count = min(min_count, async_completions_.size() + n_async_in_progress_);
+    async_cv_.wait(async_lock, [&] {
+        return async_completions_.size() >= min_count;
+    });
+
+    size_t n = async_completions_.size();
+    completions.insert(completions.end(), async_completions_.begin(), async_completions_.end());
+    async_completions_.clear();
+    return n;
+}
+
+bool FFSys::fsync(file_descriptor fd)
+{
+    Stats::Timer timer(stats_, StatOp::FSYNC);
+
+    {
+        shared_lock transaction_lock(transaction_mutex_);
+
+        auto file = get_open_file(fd);
+        if (file == nullptr) {
+            errnum_ = ErrorNumber::NO_SUCH_FILE_DESCRIPTOR;
+            return false;
+        }
+
+        bool flushed = true;
+        {
+            unique_lock file_lock(file->cached->lock);
+            flushed = flush_write_buffer(*file->cached);
+        }
+        flush_metadata();
+
+        if (!flushed) {
+            return false;
+        }
+    }
+
+    return sync();
+}
+
+bool FFSys::sync()
+{
+    Stats::Timer timer(stats_, StatOp::SYNC);
+
+    if (cache_ == nullptr) {
+        return false;
+    }
+
+    unique_lock transaction_lock(transaction_mutex_);
+    bool flushed = flush_write_buffers();
+    flush_metadata();
+    return cache_->flush() and storage_->sync() and flushed;
+}
+
+ErrorNumber FFSys::errnum()
+{
+    return errnum_;
+}
+
+StatsSnapshot FFSys::get_stats()
+{
+    return stats_.snapshot();
+}
+
+void FFSys::reset_stats()
+{
+    stats_.reset();
+}
+
+void FFSys::commit_if_due()
+{
+    if (journal_ == nullptr or cache_->get_n_dirty() < commit_threshold_) {
+        return;
+    }
+
+    unique_lock transaction_lock(transaction_mutex_);
+
+    // Someone else may have committed while this thread waited.
+    if (cache_->get_n_dirty() >= commit_threshold_) {
+        flush_metadata();
+        cache_->flush();
+    }
+}
+
+uint64_t FFSys::submit(function<ssize_t()> operation)
+{
+    lock_guard async_lock(async_mutex_);
+
+    if (async_pool_ == nullptr) {
+        async_pool_ = new ThreadPool(n_async_threads_);
+    }
+
+    uint64_t id = next_async_id_++;
+    ++n_async_in_progress_;
+
+    async_pool_->post([this, id, operation] {
+        // errnum_ is per thread, so it is read on the worker that failed.
+        ssize_t result = operation();
+        Completion completion = {id, result, result == -1 ? errnum_ : ErrorNumber::NO_ERROR};
+
+        lock_guard async_lock(async_mutex_);
+        --n_async_in_progress_;
+        async_completions_.push_back(completion);
+        async_cv_.notify_all();
+    });
+
+    return id;
+}
+
+void FFSys::init_cache(MountOptions const& options)
+{
+    stats_.set_enabled(options.stats);
+    storage_->set_stats(&stats_);
+    io_engine_ = IOEngine::create(*storage_, options.io_engine, options.io_threads);
+
+    size_t capacity = options.cache_capacity;
+    if (sb_.n_journal_blocks > 0) {
+        journal_ = new Journal(*storage_, sb_.block_size, sb_.journal_start_i, sb_.n_journal_blocks);
+
+        // The changes wait in the cache until they are committed.
+        capacity = max(capacity, (size_t)16);
+        commit_threshold_ = max((size_t)1, min(journal_->get_size() / 4, capacity / 2));
+    }
+
+    cache_ = new BlockCache(*storage_, *io_engine_, sb_.block_size, capacity, journal_, &stats_);
+}
+
+shared_ptr<OpenFile> FFSys::get_open_file(file_descriptor fd)
+{
+    if (fd < 0) {
+        return nullptr;
+    }
+
+    OpenFileShard& shard = open_files_[fd % N_OPEN_FILE_SHARDS];
+    shared_lock shard_lock(shard.mutex);
+
+    auto iter = shard.files.find(fd);
+    if (iter == shard.files.end()) {
+        return nullptr;
+    }
+    return iter->second;
+}
+
+file_descriptor FFSys::add_open_file(unsigned int inode, size_t pos, shared_ptr<CachedINode> cached)
+{
+    lock_guard alloc_lock(fd_alloc_mutex_);
+
+    // Generate new file descriptor.
+    file_descriptor fd = 0;
+    while (get_open_file(fd) != nullptr) {
+        ++fd;
+    }
+
+    OpenFileShard& shard = open_files_[fd % N_OPEN_FILE_SHARDS];
+    unique_lock shard_lock(shard.mutex);
+    shard.files.insert({fd, make_shared<OpenFile>(fd, inode, pos, cached)});
+
+    return fd;
+}
+
+
+bool FFSys::read_block(unsigned int block_i, char* block_buf, size_t count, size_t offset)
+{
+    Stats::Timer timer(stats_, StatOp::READ_BLOCK);
+
+    return cache_->read(block_i, block_buf, count, offset);
+}
+
+bool FFSys::read_block(unsigned int block_i, char *block_buffer)
+{
+    return read_block(block_i, block_buffer, sb_.block_size);
+}
+
+bool FFSys::write_block(unsigned int block_i, char* block_buffer, size_t count, size_t offset)
+{
+    Stats::Timer timer(stats_, StatOp::WRITE_BLOCK);
+
+    return cache_->write(block_i, block_buffer, count, offset);
+}
+
+bool FFSys::write_block(unsigned int block_i, char *block_buffer)
+{
+    return write_block(block_i, block_buffer, sb_.block_size);
+}
+
+bool FFSys::read_inode(int inode_i, INode& result)
+{
+    Stats::Timer timer(stats_, StatOp::READ_INODE);
+
+    // Read bytes. I-nodes are packed back to back, so one can continue
+    // over to the next block.
+    GroupDescriptor const& group = groups_[inode_i / sb_.inodes_per_group];
+    char buf[INODE_SIZE];
+    if (!read_block(group.inodes_start_i, buf, INODE_SIZE, (inode_i % sb_.inodes_per_group) * INODE_SIZE)) {
+        return false;
+    }
+
+    // Cast the byte array to an INode.
+    result = bit_cast<INode>(buf);
+    return true;
+}
+
+void FFSys::write_inode(INode& inode)
+{
+    Stats::Timer timer(stats_, StatOp::WRITE_INODE);
+
+    GroupDescriptor const& group = groups_[inode.index / sb_.inodes_per_group];
+    write_block(group.inodes_start_i, reinterpret_cast<char*>(&inode), INODE_SIZE,
+                (inode.index % sb_.inodes_per_group) * INODE_SIZE);
+}
+
+bool FFSys::read_superblock(Superblock &result)
+{
+    char buf[SUPERBLOCK_SIZE];
+
+    // Read straight from the storage, since the block size (and so the
+    // block cache) is not known before the superblock has been read.
+    if (!storage_->read(SUPERBLOCK_I, buf, SUPERBLOCK_SIZE)) {
+        return false;
+    }
+
+    result = bit_cast<Superblock>(buf);
+
+    // Older files are one group, and have only the 16-bit counts. The
+    // bytes after them are not part of the superblock.
+    if (!(result.features & FEATURE_BLOCK_GROUPS)) {
+        result.n_groups = 1;
+        result.group_table_i = 0;
+        result.inodes_per_group = result.n_inodes16;
+        result.inode_blocks_per_group = result.n_inode_blocks16;
+        result.data_blocks_per_group = result.n_data_blocks16;
+        result.n_inodes = result.n_inodes16;
+        result.n_data_blocks = result.n_data_blocks16;
+        result.n_free_inodes = result.n_free_inodes16;
+        result.n_free_data_blocks = result.n_free_data_blocks16;
+    }
+    return true;
+}
+
+void FFSys::write_superblock()
+{
+    if (sb_.features & FEATURE_BLOCK_GROUPS) {
+        write_block(SUPERBLOCK_I, reinterpret_cast<char*>(&sb_), SUPERBLOCK_SIZE);
+    } else {
+        // The root directory's i-node comes after the fields that older
+        // files have, but the rest of their first block is unused.
+        sb_.n_free_inodes16 = sb_.n_free_inodes;
+        sb_.n_free_data_blocks16 = sb_.n_free_data_blocks;
+        write_block(SUPERBLOCK_I, reinterpret_cast<char*>(&sb_),
+                    sb_.features & FEATURE_DIRECTORIES ? SUPERBLOCK_SIZE : LEGACY_SUPERBLOCK_SIZE);
+    }
+    sb_dirty_ = false;
+}
+
+void FFSys::load_groups()
+{
+    if (sb_.features & FEATURE_BLOCK_GROUPS) {
+        groups_.resize(sb_.n_groups);
+        for (unsigned int g = 0; g < sb_.n_groups; ++g) {
+            read_block(sb_.group_table_i, reinterpret_cast<char*>(&groups_[g]),
+                       GROUP_DESCRIPTOR_SIZE, g * GROUP_DESCRIPTOR_SIZE);
+        }
+    } else {
+        groups_ = {{sb_.inode_bitmap_i, sb_.data_block_bitmap_i, sb_.inodes_start_i, sb_.data_blocks_start_i,
+                    sb_.n_free_inodes, sb_.n_free_data_blocks}};
+    }
+
+    // The free counts are only written on sync, so after a crash they
+    // can be behind the bitmaps. The bitmaps are the ones to trust.
+    uint32_t n_free_inodes = 0;
+    uint32_t n_free_data_blocks = 0;
+    for (unsigned int g = 0; g < groups_.size(); ++g) {
+        GroupDescriptor& group = groups_[g];
+
+        inode_bitmaps_.push_back(new Bitmap(sb_.block_size));
+        read_block(group.inode_bitmap_i, inode_bitmaps_[g]->get_bm());
+
+        data_block_bitmaps_.push_back(new Bitmap(sb_.block_size));
+        read_block(group.data_block_bitmap_i, data_block_bitmaps_[g]->get_bm());
+
+        uint32_t group_free_inodes = inode_bitmaps_[g]->count_free();
+        uint32_t group_free_data_blocks = data_block_bitmaps_[g]->count_free();
+        if (group_free_inodes != group.n_free_inodes or group_free_data_blocks != group.n_free_data_blocks) {
+            group.n_free_inodes = group_free_inodes;
+            group.n_free_data_blocks = group_free_data_blocks;
+            dirty_inode_groups_.insert(g);
+        }
+        n_free_inodes += group_free_inodes;
+        n_free_data_blocks += group_free_data_blocks;
+    }
+
+    if (n_free_inodes != sb_.n_free_inodes or n_free_data_blocks != sb_.n_free_data_blocks) {
+        sb_.n_free_inodes = n_free_inodes;
+        sb_.n_free_data_blocks = n_free_data_blocks;
+        sb_dirty_ = true;
+    }
+}
+
+void FFSys::write_group_descriptor(unsigned int group)
+{
+    // The one group of an older file is described by its superblock.
+    if (sb_.features & FEATURE_BLOCK_GROUPS) {
+        write_block(sb_.group_table_i, reinterpret_cast<char*>(&groups_[group]),
+                    GROUP_DESCRIPTOR_SIZE, group * GROUP_DESCRIPTOR_SIZE);
+    }
+}
+
+void FFSys::write_bitmap_changes(Bitmap& bitmap, unsigned int block_i)
+{
+    unsigned int begin = bitmap.dirty_begin();
+    unsigned int end = bitmap.dirty_end();
+    if (begin != end) {
+        write_block(block_i, bitmap.get_bm(begin), end - begin, begin);
+        bitmap.clear_dirty();
+    }
+}
+
+bool FFSys::is_inode_free(unsigned int i)
+{
+    return inode_bitmaps_[i / sb_.inodes_per_group]->is_free(i % sb_.inodes_per_group);
+}
+
+unsigned int FFSys::data_block_i(int32_t i)
+{
+    return groups_[i / sb_.data_blocks_per_group].data_blocks_start_i + i % sb_.data_blocks_per_group;
+}
+
+unsigned int FFSys::blocks_left_in_group(int32_t i)
+{
+    return sb_.data_blocks_per_group - i % sb_.data_blocks_per_group;
+}
+
+void FFSys::flush_metadata()
+{
+    lock_guard inode_lock(inode_alloc_mutex_);
+    lock_guard data_lock(data_alloc_mutex_);
+
+    if (sb_dirty_) {
+        write_superblock();
+    }
+
+    for (unsigned int group : dirty_inode_groups_) {
+        write_bitmap_changes(*inode_bitmaps_[group], groups_[group].inode_bitmap_i);
+        write_group_descriptor(group);
+    }
+    for (unsigned int group : dirty_data_groups_) {
+        write_bitmap_changes(*data_block_bitmaps_[group], groups_[group].data_block_bitmap_i);
+        if (!dirty_inode_groups_.count(group)) {
+            write_group_descriptor(group);
+        }
+    }
+    dirty_inode_groups_.clear();
+    dirty_data_groups_.clear();
+}
+
+bool FFSys::create_file(string name, unsigned int directory_i, INode &result, bool is_directory)
+{
+    if (name.size() > max_name_length()) {
+        errnum_ = ErrorNumber::NAME_TOO_LONG;
+        return false;
+    }
+
+    INode directory;
+    if (!read_inode(directory_i, directory)) {
+        errnum_ = ErrorNumber::CANT_READ_INODE;
+        return false;
+    }
+
+    int inode_i = reserve_inode();
+    if (inode_i == -1) {
+        errnum_ = ErrorNumber::NO_FREE_INODES;
+        return false;
+    }
+
+    INode inode;
+    inode.index = inode_i;
+    inode.flags = 0;
+    inode.size = 0;
+    inode.created_time = time(nullptr);
+
+    if (is_directory) {
+        inode.flags |= INODE_DIRECTORY | INODE_INDIRECT_TREE;
+    } else if (use_extents_) {
+        inode.flags |= INODE_EXTENTS;
+        inode.extent_list = {{}, 0, -1};
+    } else {
+        inode.flags |= INODE_INDIRECT_TREE;
+    }
+
+    if (!is_directory and use_inline_data_) {
+        inode.flags |= INODE_INLINE_DATA;
+        memset(inode.inline_data, 0, INLINE_DATA_SIZE);
+    }
+
+    int i = 0;
+    while (i < min(sizeof(INode::name)-1, name.size())) {
+        inode.name[i] = name.at(i);
+        ++i;
+    }
+    inode.name[i] = '\0';
+
+    // Write inode to disk
+    write_inode(inode);
+
+    if (is_directory) {
+        if (!init_directory(inode, directory_i)) {
+            for (unsigned int block = 0; free_file_block(inode, block); ++block) {}
+            free_inode(inode_i);
+            return false;
+        }
+    } else if (!(inode.flags & INODE_INLINE_DATA)) {
+        reserve_file_block(inode, 0);
+    }
+
+    if (!add_entry(directory, name, inode_i, is_directory)) {
+        for (unsigned int block = 0; free_file_block(inode, block); ++block) {}
+        free_inode(inode_i);
+        return false;
+    }
+    dentries_->insert(directory_i, name, inode_i);
+
+    result = inode;
+    return true;
+}
+
+bool FFSys::resolve_parent(string const& path, unsigned int& directory, string& name)
+{
+    directory = sb_.root_inode;
+    name.clear();
+
+    // Names are separated by any number of slashes, and "." is skipped.
+    vector<string> names;
+    size_t start = 0;
+    while (start <= path.size()) {
+        size_t end = min(path.find('/', start), path.size());
+        if (end > start and path.compare(start, end - start, ".") != 0) {
+            names.push_back(path.substr(start, end - start));
+        }
+        start = end + 1;
+    }
+
+    for (size_t k = 0; k < names.size(); ++k) {
+        if (names[k] == "..") {
+            INode inode;
+            DirectoryHeader header;
+            int address = -1;
+            bool found = read_inode(directory, inode) and get_file_block_address(inode, 0, address) and address != -1;
+            if (!found or !read_block(data_block_i(address), reinterpret_cast<char*>(&header), sizeof(header))) {
+                errnum_ = ErrorNumber::CANT_READ_INODE;
+                return false;
+            }
+            directory = header.parent;
+            continue;
+        }
+
+        if (k + 1 == names.size()) {
+            name = names[k];
+            break;
+        }
+
+        int inode_i = lookup(directory, names[k]);
+        if (inode_i == -1) {
+            errnum_ = ErrorNumber::PATH_NOT_FOUND;
+            return false;
+        }
+
+        INode inode;
+        if (!read_inode(inode_i, inode)) {
+            errnum_ = ErrorNumber::CANT_READ_INODE;
+            return false;
+        }
+        if (!(inode.flags & INODE_DIRECTORY)) {
+            errnum_ = ErrorNumber::NOT_A_DIRECTORY;
+            return false;
+        }
+        directory = inode_i;
+    }
+    return true;
+}
+
+int FFSys::lookup(unsigned int directory, string const& name)
+{
+    unsigned int inode_i;
+    if (dentries_->find(directory, name, inode_i)) {
+        return inode_i;
+    }
+
+    INode inode;
+    if (!read_inode(directory, inode)) {
+        return -1;
+    }
+
+    int found = find_entry(inode, name);
+    if (found != -1) {
+        dentries_->insert(directory, name, found);
+    }
+    return found;
+}
+
+unsigned int FFSys::max_name_length()
+{
+    // A leaf block holds at least four entries with the longest name.
+    size_t leaf_capacity = sb_.block_size - sizeof(DirectoryLeaf);
+    return min<size_t>(MAX_NAME_LENGTH, leaf_capacity / 4 - sizeof(DirectoryEntry));
+}
+
+bool FFSys::init_directory(INode& inode, unsigned int parent)
+{
+    vector<char> block(sb_.block_size, 0);
+
+    DirectoryHeader header = {DIRECTORY_MAGIC, parent, 0, 2, 0};
+    memcpy(block.data(), &header, sizeof(header));
+    DirectoryIndexEntry first_leaf = {0, 1};
+    write_index_node(block.data(), true, &first_leaf, &first_leaf + 1);
+    if (!write_directory_block(inode, 0, block.data())) {
+        return false;
+    }
+
+    // An empty leaf block.
+    fill(block.begin(), block.end(), 0);
+    return write_directory_block(inode, 1, block.data());
+}
+
+void FFSys::create_root_directory()
+{
+    int inode_i = reserve_inode();
+    if (inode_i == -1) {
+        throw std::string("Error: no free i-node for the root directory");
+    }
+
+    INode root;
+    root.index = inode_i;
+    root.name[0] = '\0';
+    root.flags = INODE_DIRECTORY | INODE_INDIRECT_TREE;
+    root.size = 0;
+    root.created_time = time(nullptr);
+    write_inode(root);
+
+    if (!init_directory(root, inode_i)) {
+        throw std::string("Error: no space for the root directory");
+    }
+
+    sb_.root_inode = inode_i;
+    sb_.features |= FEATURE_DIRECTORIES;
+    sb_dirty_ = true;
+}
+
+bool FFSys::read_directory_block(INode const& directory, unsigned int i, char* buffer)
+{
+    int address = -1;
+    if (!get_file_block_address(directory, i, address) or address == -1) {
+        return false;
+    }
+    return read_block(data_block_i(address), buffer);
+}
+
+bool FFSys::write_directory_block(INode& directory, unsigned int i, char* buffer)
+{
+    int address = -1;
+    if (!get_file_block_address(directory, i, address)) {
+        return false;
+    }
+    if (address == -1) {
+        address = reserve_file_block(directory, i);
+        if (address == -1) {
+            return false;
+        }
+    }
+    write_block(data_block_i(address), buffer);
+
+    if (directory.size < (uint64_t)(i + 1) * sb_.block_size) {
+        directory.size = (uint64_t)(i + 1) * sb_.block_size;
+        write_inode(directory);
+    }
+    return true;
+}
+
+bool FFSys::find_leaf(INode const& directory, char* root, uint32_t hash, vector<IndexStep>& path,
+                      unsigned int& leaf)
+{
+    DirectoryHeader header;
+    memcpy(&header, root, sizeof(header));
+    if (header.magic != DIRECTORY_MAGIC) {
+        return false;
+    }
+
+    vector<char> buffer(sb_.block_size);
+    char* node_block = root;
+    unsigned int block = 0;
+    path.clear();
+    for (unsigned int level = 0; level <= header.depth; ++level) {
+        DirectoryIndexNode* node = index_node(node_block, level == 0);
+        DirectoryIndexEntry* entries = index_entries(node);
+        if (node->count == 0 or node->count > index_capacity(sb_.block_size, level == 0)) {
+            return false;
+        }
+
+        // Follow the last entry whose hash is at most hash.
+        DirectoryIndexEntry* next = upper_bound(entries, entries + node->count, hash,
+            [](uint32_t value, DirectoryIndexEntry const& entry) { return value < entry.hash; });
+        unsigned int position = max<ptrdiff_t>(next - entries, 1) - 1;
+        path.push_back({block, position});
+
+        block = entries[position].block;
+        if (block >= header.n_blocks) {
+            return false;
+        }
+        if (level < header.depth) {
+            if (!read_directory_block(directory, block, buffer.data())) {
+                return false;
+            }
+            node_block = buffer.data();
+        }
+    }
+
+    leaf = block;
+    return true;
+}
+
+int FFSys::find_entry(INode const& directory, string const& name)
+{
+    vector<char> block(sb_.block_size);
+    vector<IndexStep> path;
+    unsigned int leaf;
+    if (!read_directory_block(directory, 0, block.data())
+        or !find_leaf(directory, block.data(), name_hash(name), path, leaf)
+        or !read_directory_block(directory, leaf, block.data())) {
+        return -1;
+    }
+
+    DirectoryLeaf header;
+    memcpy(&header, block.data(), sizeof(header));
+    size_t pos = sizeof(DirectoryLeaf);
+    size_t end = min<size_t>(sb_.block_size, pos + header.used);
+    while (pos + sizeof(DirectoryEntry) <= end) {
+        DirectoryEntry entry;
+        memcpy(&entry, block.data() + pos, sizeof(entry));
+        pos += sizeof(entry);
+        if (entry.name_length == name.size() and pos + entry.name_length <= end
+            and memcmp(block.data() + pos, name.data(), name.size()) == 0) {
+            return entry.inode;
+        }
+        pos += entry.name_length;
+    }
+    return -1;
+}
+
+bool FFSys::add_entry(INode& directory, string const& name, unsigned int inode, bool is_directory)
+{
+    unsigned int block_size = sb_.block_size;
+    vector<char> root(block_size);
+    vector<char> leaf_block(block_size);
+    vector<IndexStep> path;
+    unsigned int leaf;
+    uint32_t hash = name_hash(name);
+    if (!read_directory_block(directory, 0, root.data())
+        or !find_leaf(directory, root.data(), hash, path, leaf)
+        or !read_directory_block(directory, leaf, leaf_block.data())) {
+        errnum_ = ErrorNumber::CANT_READ_INODE;
+        return false;
+    }
+    DirectoryHeader* header = reinterpret_cast<DirectoryHeader*>(root.data());
+
+    // Usually the entry fits into the end of its leaf.
+    DirectoryLeaf* leaf_header = reinterpret_cast<DirectoryLeaf*>(leaf_block.data());
+    LeafRecord record = {hash, name, inode, is_directory};
+    if (sizeof(DirectoryLeaf) + leaf_header->used + record_size(record) <= block_size) {
+        DirectoryEntry entry = {inode, (uint16_t)name.size(), is_directory, 0};
+        char* end = leaf_block.data() + sizeof(DirectoryLeaf) + leaf_header->used;
+        memcpy(end, &entry, sizeof(entry));
+        memcpy(end + sizeof(entry), name.data(), name.size());
+        leaf_header->used += record_size(record);
+        if (!write_directory_block(directory, leaf, leaf_block.data())) {
+            return false;
+        }
+
+        header->n_entries += 1;
+        return write_directory_block(directory, 0, root.data());
+    }
+
+    // Otherwise the leaf is split in two by hash, and the new leaf is added
+    // to the index node above it, which may in turn have to be split, up to
+    // the root. The changed blocks are written once all of them are ready,
+    // the new ones first, so that running out of space leaves the directory
+    // as it was.
+    map<unsigned int, vector<char>> changed;
+    unsigned int old_n_blocks = header->n_blocks;
+
+    vector<LeafRecord> records;
+    read_leaf(leaf_block.data(), block_size, records);
+    records.push_back(record);
+    stable_sort(records.begin(), records.end(),
+        [](LeafRecord const& a, LeafRecord const& b) { return a.hash < b.hash; });
+
+    size_t split;
+    if (!choose_leaf_split(records, block_size, split)) {
+        errnum_ = ErrorNumber::NO_FREE_DATA_BLOCKS;
+        return false;
+    }
+
+    unsigned int new_leaf = header->n_blocks++;
+    changed[leaf].resize(block_size);
+    write_leaf(changed[leaf].data(), block_size, records.data(), records.data() + split);
+    changed[new_leaf].resize(block_size);
+    write_leaf(changed[new_leaf].data(), block_size, records.data() + split, records.data() + records.size());
+
+    DirectoryIndexEntry new_entry = {records[split].hash, new_leaf};
+    for (int level = header->depth; level >= 0; --level) {
+        IndexStep const& step = path[level];
+        char* node_block = root.data();
+        if (level > 0) {
+            vector<char>& buffer = changed[step.block];
+            buffer.resize(block_size);
+            if (!read_directory_block(directory, step.block, buffer.data())) {
+                errnum_ = ErrorNumber::CANT_READ_INODE;
+                return false;
+            }
+            node_block = buffer.data();
+        }
+
+        DirectoryIndexNode* node = index_node(node_block, level == 0);
+        vector<DirectoryIndexEntry> entries(index_entries(node), index_entries(node) + node->count);
+        entries.insert(entries.begin() + step.position + 1, new_entry);
+        if (entries.size() <= index_capacity(block_size, level == 0)) {
+            write_index_node(node_block, level == 0, entries.data(), entries.data() + entries.size());
+            break;
+        }
+
+        // The upper half of a full node moves into a new index block,
+        // which is added to the node above.
+        size_t half = entries.size() / 2;
+        unsigned int upper_block = header->n_blocks++;
+        changed[upper_block].assign(block_size, 0);
+        write_index_node(changed[upper_block].data(), false, entries.data() + half, entries.data() + entries.size());
+
+        if (level > 0) {
+            write_index_node(node_block, false, entries.data(), entries.data() + half);
+            new_entry = {entries[half].hash, upper_block};
+            continue;
+        }
+
+        // A full root keeps only the two new index blocks, one level above
+        // its old entries.
+        unsigned int lower_block = header->n_blocks++;
+        changed[lower_block].assign(block_size, 0);
+        write_index_node(changed[lower_block].data(), false, entries.data(), entries.data() + half);
+
+        DirectoryIndexEntry root_entries[] = {{0, lower_block}, {entries[half].hash, upper_block}};
+        write_index_node(root.data(), true, root_entries, root_entries + 2);
+        header->depth += 1;
+    }
+
+    for (auto& [block, contents] : changed) {
+        if (block >= old_n_blocks and !write_directory_block(directory, block, contents.data())) {
+            return false;
+        }
+    }
+    for (auto& [block, contents] : changed) {
+        if (block < old_n_blocks) {
+            write_directory_block(directory, block, contents.data());
+        }
+    }
+
+    header->n_entries += 1;
+    return write_directory_block(directory, 0, root.data());
+}
+
+bool FFSys::read_entries(INode const& directory, vector<DirEntry>& entries)
+{
+    vector<char> block(sb_.block_size);
+    if (!read_directory_block(directory, 0, block.data())) {
+        return false;
+    }
+    DirectoryHeader header;
+    memcpy(&header, block.data(), sizeof(header));
+    if (header.magic != DIRECTORY_MAGIC) {
+        return false;
+    }
+
+    // The blocks still to be read, and their levels below the root. The
+    // leaf blocks are one level below the last index blocks.
+    vector<pair<unsigned int, unsigned int>> pending;
+    auto add_children = [&](bool root, unsigned int level) {
+        DirectoryIndexNode* node = index_node(block.data(), root);
+        unsigned int count = min(node->count, index_capacity(sb_.block_size, root));
+        for (unsigned int k = 0; k < count; ++k) {
+            pending.push_back({index_entries(node)[k].block, level});
+        }
+    };
+    add_children(true, 1);
+
+    vector<LeafRecord> records;
+    while (!pending.empty()) {
+        auto [block_i, level] = pending.back();
+        pending.pop_back();
+        if (!read_directory_block(directory, block_i, block.data())) {
+            return false;
+        }
+
+        if (level <= header.depth) {
+            add_children(false, level + 1);
+            continue;
+        }
+
+        records.clear();
+        read_leaf(block.data(), sb_.block_size, records);
+        for (LeafRecord& record : records) {
+            entries.push_back({std::move(record.name), record.inode, record.directory});
+        }
+    }
+    return true;
+}
+
+void FFSys::upgrade_inode_flags()
+{
+    INode inode;
+    for (unsigned int i = 0; i < sb_.n_inodes; ++i) {
+        if (!is_inode_free(i) and read_inode(i, inode)) {
+            inode.flags = 0;
+            write_inode(inode);
+        }
+    }
+
+    sb_.features |= FEATURE_INODE_FLAGS;
+    write_superblock();
+}
+
+void FFSys::upgrade_directories()
+{
+    // The root directory is found through the superblock, which has to
+    // fit into the first block.
+    if (sb_.block_size < SUPERBLOCK_SIZE) {
+        throw std::string("Error: block size is too small for directories");
+    }
+
+    create_root_directory();
+
+    INode root;
+    if (!read_inode(sb_.root_inode, root)) {
+        throw std::string("Error reading the root directory");
+    }
+
+    INode inode;
+    for (unsigned int i = 0; i < sb_.n_inodes; ++i) {
+        if (i != sb_.root_inode and !is_inode_free(i) and read_inode(i, inode)) {
+            if (!add_entry(root, string(inode.name), i, false)) {
+                throw std::string("Error: no space for the root directory");
+            }
+        }
+    }
+
+    write_superblock();
+}
+
+shared_ptr<CachedINode> FFSys::get_cached_inode(INode const& inode)
+{
+    auto iter = cached_inodes_.find(inode.index);
+    if (iter != cached_inodes_.end()) {
+        if (auto cached = iter->second.lock()) {
+            return cached;
+        }
+    }
+
+    auto cached = make_shared<CachedINode>(inode);
+    cached_inodes_[inode.index] = cached;
+    return cached;
+}
+
+void FFSys::release_cached_inode(unsigned int inode)
+{
+    lock_guard names_lock(names_mutex_);
+    auto cached_iter = cached_inodes_.find(inode);
+    if (cached_iter != cached_inodes_.end() and cached_iter->second.expired()) {
+        cached_inodes_.erase(cached_iter);
+    }
+}
+
+ssize_t FFSys::read_n_bytes_from_file(CachedINode& file, char* buffer, size_t count, size_t pos)
+{
+    IOVec iov = {buffer, count};
+    return read_n_bytes_from_file(file, &iov, 1, pos);
+}
+
+ssize_t FFSys::read_n_bytes_from_file(CachedINode& file, IOVec const* iov, int iovcnt, size_t pos)
+{
+    size_t size = file.size();
+    if (pos >= size) {
+        return 0;
+    }
+
+    size_t count = min(total_length(iov, iovcnt), size - pos);
+
+    // The part of the range that is in the data blocks. Buffered data is
+    // copied over it at the end.
+    size_t block_count = pos < file.inode.size ? min(count, (size_t)file.inode.size - pos) : 0;
+
+    size_t read_count = 0;
+    unsigned int block_index = pos / sb_.block_size;
+    size_t offset = pos % sb_.block_size;
+    IOVecCursor buffers = {iov};
+
+    // Inline data is in the cached i-node itself.
+    if (file.inode.flags & INODE_INLINE_DATA) {
+        copy_to_iov(iov, 0, file.inode.inline_data + pos, block_count);
+        read_count = block_count;
+    }
+
+    // One range per run of consecutive data blocks and buffer, all read
+    // at once at the end, so that the I/O engine can overlap them.
+    vector<BlockCache::Range> ranges;
+    while (read_count < block_count) {
+        unsigned int blocks_left = (offset + block_count - read_count + sb_.block_size - 1) / sb_.block_size;
+        unsigned int run_length = 0;
+        int block_address = -1;
+        if (!get_file_block_run(file, block_index, blocks_left, block_address, run_length)) {
+            return -1;
+        }
+
+        // Holes read as zeros, without touching the FFSys file.
+        if (block_address == -1) {
+            unsigned int next = block_index;
+            if (!find_mapped_block(file, block_index, block_index + blocks_left, next)) {
+                return -1;
+            }
+            size_t to_zero = min((size_t)(next - block_index) * sb_.block_size - offset, block_count - read_count);
+            for (size_t done = 0; done < to_zero;) {
+                auto [buffer, part] = buffers.next(to_zero - done);
+                memset(buffer, 0, part);
+                done += part;
+            }
+            read_count += to_zero;
+
+            block_index = next;
+            offset = 0;
+            continue;
+        }
+
+        size_t to_read = min((size_t)run_length * sb_.block_size - offset, block_count - read_count);
+        for (size_t done = 0; done < to_read;) {
+            auto [buffer, part] = buffers.next(to_read - done);
+            ranges.push_back({data_block_i(block_address), buffer, part, offset + done});
+            done += part;
+        }
+        read_count += to_read;
+
+        block_index += run_length;
+        offset = 0;
+    }
+
+    if (!cache_->read(ranges)) {
+        errnum_ = ErrorNumber::IO_ERROR;
+        return -1;
+    }
+
+    // Past the end of the blocks' part, the file can only have buffered
+    // data, after a hole if the buffer starts past the end.
+    if (block_count < count) {
+        zero_iov(iov, block_count, count - block_count);
+    }
+
+    if (!file.buffer.empty()) {
+        size_t begin = max(pos, file.buffer_pos);
+        size_t end = min(pos + count, file.buffer_pos + file.buffer.size());
+        if (begin < end) {
+            copy_to_iov(iov, begin - pos, file.buffer.data() + (begin - file.buffer_pos), end - begin);
+        }
+    }
+
+    return count;
+}
+
+ssize_t FFSys::write_n_bytes_to_file(CachedINode& file, char *buffer, size_t count, size_t pos)
+{
+    IOVec iov = {buffer, count};
+    return write_n_bytes_to_file(file, &iov, 1, pos);
+}
+
+ssize_t FFSys::write_n_bytes_to_file(CachedINode& file, IOVec const* iov, int iovcnt, size_t pos)
+{
+    size_t count = total_length(iov, iovcnt);
+    if (count == 0) {
+        return 0;
+    }
+
+    // A file stays inline as long as its contents fit into the i-node.
+    if (file.inode.flags & INODE_INLINE_DATA) {
+        if (pos + count <= INLINE_DATA_SIZE) {
+            if (pos > file.inode.size) {
+                memset(file.inode.inline_data + file.inode.size, 0, pos - file.inode.size);
+            }
+            copy_from_iov(file.inode.inline_data + pos, iov, count);
+            file.inode.size = max((uint64_t)(pos + count), file.inode.size);
+            write_inode(file.inode);
+            return count;
+        }
+
+        if (!move_inline_data(file)) {
+            return 0;
+        }
+    }
+
+    // The indices of the first and last block written to (not the indices
+    // of the actual file data blocks, but the indices into the i-node's
+    // blocks, which give the actual ones).
+    unsigned int first_file_block_i = pos / sb_.block_size;
+    unsigned int last_file_block_i = (pos + count - 1) / sb_.block_size;
+
+    // The first and last block are only partly written. If they are new,
+    // the rest of them is filled with zeros, so that what the data block
+    // held before does not show.
+    unsigned int run_length = 0;
+    int first_address = -1;
+    int last_address = -1;
+    if (!get_file_block_run(file, first_file_block_i, 1, first_address, run_length) or
+        !get_file_block_run(file, last_file_block_i, 1, last_address, run_length))
+    {
+        return -1;
+    }
+    bool first_is_new = first_address == -1;
+    bool last_is_new = last_address == -1;
+
+    // Reserve the blocks that are still missing first, so the data can
+    // then be written one run of consecutive blocks at a time.
+    unsigned int end = reserve_missing_file_blocks(file, first_file_block_i, last_file_block_i);
+    if (end <= last_file_block_i) {
+        // No more free data blocks, write only up to here.
+        if (end == first_file_block_i) {
+            return 0;
+        }
+        count = (size_t)end * sb_.block_size - pos;
+        last_file_block_i = end - 1;
+    }
+
+    // Writing past the end leaves a hole up to pos. The blocks that the
+    // file already has there (reserved by fallocate, or the rest of its
+    // last block) are filled with zeros.
+    if (pos > file.inode.size and !zero_file_range(file, file.inode.size, pos)) {
+        return -1;
+    }
+
+    size_t written = 0;
+    unsigned int current_file_block_i = first_file_block_i;
+    size_t offset = pos % sb_.block_size;
+    IOVecCursor buffers = {iov};
+
+    // Same as with reading, the ranges are written all at once.
+    vector<BlockCache::Range> ranges;
+    size_t end_offset = (pos + count) % sb_.block_size;
+    if (first_is_new and offset > 0) {
+        if (!get_file_block_run(file, first_file_block_i, 1, first_address, run_length)) {
+            return -1;
+        }
+        add_zero_ranges(ranges, data_block_i(first_address), 0, offset);
+    }
+    if (last_is_new and end_offset > 0) {
+        if (!get_file_block_run(file, last_file_block_i, 1, last_address, run_length)) {
+            return -1;
+        }
+        add_zero_ranges(ranges, data_block_i(last_address), end_offset, sb_.block_size - end_offset);
+    }
+
+    while (written < count) {
+        int current_block_address = -1;
+        if (!get_file_block_run(file, current_file_block_i, last_file_block_i - current_file_block_i + 1,
+                                current_block_address, run_length))
+        {
+            return -1;
+        }
+
+        size_t to_write = min((size_t)run_length * sb_.block_size - offset, count - written);
+        unsigned int block_i = data_block_i(current_block_address);
+        for (size_t done = 0; done < to_write;) {
+            auto [buffer, part] = buffers.next(to_write - done);
+            ranges.push_back({block_i, buffer, part, offset + done});
+            done += part;
+        }
+
+        written += to_write;
+        current_file_block_i += run_length;
+        offset = 0;
+    }
+
+    // The blocks stay reserved, but the size does not grow over data that
+    // may not have been written.
+    if (!cache_->write(ranges)) {
+        errnum_ = ErrorNumber::IO_ERROR;
+        return -1;
+    }
+
+    file.inode.size = max((uint64_t)(pos + written), file.inode.size);
+    write_inode(file.inode);
+
+    return written;
+}
+
+bool FFSys::find_data(CachedINode& file, size_t pos, bool hole, size_t& found)
+{
+    size_t end = file.size();
+    size_t buffer_end = file.buffer_pos + file.buffer.size();
+
+    while (pos < end) {
+        if (!file.buffer.empty() and pos >= file.buffer_pos and pos < buffer_end) {
+            if (!hole) {
+                found = pos;
+                return true;
+            }
+            pos = buffer_end;
+            continue;
+        }
+
+        // Whether pos is in data, and where that data (or hole) ends.
+        bool in_data = false;
+        size_t next = end;
+        if (pos < file.inode.size) {
+            if (file.inode.flags & INODE_INLINE_DATA) {
+                in_data = true;
+            } else {
+                unsigned int i = pos / sb_.block_size;
+                unsigned int last = (file.inode.size - 1) / sb_.block_size;
+                unsigned int run_length = 0;
+                int address = -1;
+                if (!get_file_block_run(file, i, last - i + 1, address, run_length)) {
+                    return false;
+                }
+                in_data = address != -1;
+                unsigned int next_i = i + run_length;
+                if (!in_data and !find_mapped_block(file, i, last + 1, next_i)) {
+                    return false;
+                }
+                next = (size_t)next_i * sb_.block_size;
+            }
+            next = min(next, (size_t)file.inode.size);
+        }
+        if (!file.buffer.empty() and file.buffer_pos > pos and file.buffer_pos < next) {
+            next = file.buffer_pos;
+        }
+
+        if (in_data != hole) {
+            found = pos;
+            return true;
+        }
+        pos = next;
+    }
+    found = end;
+    return true;
+}
+
+bool FFSys::zero_file_range(CachedINode& file, size_t begin, size_t end)
+{
+    if (begin >= end) {
+        return true;
+    }
+
+    vector<BlockCache::Range> ranges;
+    unsigned int i = begin / sb_.block_size;
+    unsigned int last = (end - 1) / sb_.block_size;
+    while (i <= last) {
+        unsigned int run_length = 0;
+        int address = -1;
+        if (!get_file_block_run(file, i, last - i + 1, address, run_length)) {
+            return false;
+        }
+        if (address == -1) {
+            if (!find_mapped_block(file, i, last + 1, i)) {
+                return false;
+            }
+            continue;
+        }
+
+        size_t run_begin = max(begin, (size_t)i * sb_.block_size);
+        size_t run_end = min(end, (size_t)(i + run_length) * sb_.block_size);
+        add_zero_ranges(ranges, data_block_i(address), run_begin - (size_t)i * sb_.block_size, run_end - run_begin);
+        i += run_length;
+    }
+
+    if (!cache_->write(ranges)) {
+        errnum_ = ErrorNumber::IO_ERROR;
+        return false;
+    }
+    return true;
+}
+
+bool FFSys::truncate_file(CachedINode& file, size_t size)
+{
+    INode& inode = file.inode;
+    if (size > max_file_size(inode)) {
+        errnum_ = ErrorNumber::INVALID_POSITION;
+        return false;
+    }
+    ++file.version;
+
+    // Buffered writes past the new end are dropped. The position of an
+    // empty buffer still counts in size(), so it is reset too.
+    if (file.buffer.empty() or file.buffer_pos >= size) {
+        file.buffer.clear();
+        file.buffer_pos = 0;
+        release_buffer_blocks(file);
+    } else if (file.buffer_pos + file.buffer.size() > size) {
+        file.buffer.resize(size - file.buffer_pos);
+    }
+
+    if (inode.size > size) {
+        inode.size = size;
+        free_unused_file_blocks(file);
+        return true;
+    }
+    if (file.size() >= size) {
+        return true;
+    }
+
+    // Growing: the buffered writes go first, so that the i-node has the
+    // whole old size. The bytes between the old and the new end read as
+    // zeros, whatever the blocks reserved past the end held.
+    if (!flush_write_buffer(file)) {
+        return false;
+    }
+    if (inode.flags & INODE_INLINE_DATA and size > INLINE_DATA_SIZE and !move_inline_data(file)) {
+        return false;
+    }
+    if (inode.flags & INODE_INLINE_DATA) {
+        memset(inode.inline_data + inode.size, 0, size - inode.size);
+    } else if (!zero_file_range(file, inode.size, size)) {
+        return false;
+    }
+    inode.size = size;
+    write_inode(inode);
+    return true;
+}
+
+void FFSys::add_zero_ranges(vector<BlockCache::Range>& ranges, unsigned int block_i, size_t offset, size_t count)
+{
+    for (size_t done = 0; done < count; done += ZEROS_SIZE) {
+        ranges.push_back({block_i, zeros, min(ZEROS_SIZE, count - done), offset + done});
+    }
+}
+
+ssize_t FFSys::read_at_position(OpenFile& file, IOVec const* iov, int iovcnt)
+{
+    size_t count = total_length(iov, iovcnt);
+
+    if (file.pos == file.next_read_pos) {
+        file.read_ahead_window = file.read_ahead_window == 0
+            ? 4 * sb_.block_size : file.read_ahead_window * 2;
+        file.read_ahead_window = min(file.read_ahead_window, read_ahead_size_);
+    } else {
+        file.read_ahead_window = 0;
+        file.read_ahead.clear();
+    }
+
+    // Reads as large as the window gain nothing from going through it.
+    if (count >= file.read_ahead_window or count == 0) {
+        ssize_t read = read_n_bytes_from_file(*file.cached, iov, iovcnt, file.pos);
+        if (read < 0) {
+            return -1;
+        }
+        file.pos += read;
+        file.next_read_pos = file.pos;
+        return read;
+    }
+
+    if (file.read_ahead_version != file.cached->version) {
+        file.read_ahead.clear();
+    }
+
+    size_t read = 0;
+    while (read < count) {
+        size_t pos = file.pos + read;
+        size_t ahead_end = file.read_ahead_pos + file.read_ahead.size();
+
+        if (pos < file.read_ahead_pos or pos >= ahead_end) {
+            // Refill up to the window's last whole block, so that a block
+            // is not read partly twice.
+            size_t end = (pos + file.read_ahead_window) / sb_.block_size * sb_.block_size;
+            if (end < pos + count - read) {
+                end = pos + file.read_ahead_window;
+            }
+
+            file.read_ahead.resize(end - pos);
+            ssize_t filled = read_n_bytes_from_file(*file.cached, file.read_ahead.data(), file.read_ahead.size(), pos);
+            if (filled < 0) {
+                // What was read before the error is still returned.
+                file.read_ahead.clear();
+                if (read == 0) {
+                    return -1;
+                }
+                break;
+            }
+            file.read_ahead.resize(filled);
+            file.read_ahead_pos = pos;
+            file.read_ahead_version = file.cached->version;
+            if (file.read_ahead.empty()) {
+                break;
+            }
+            ahead_end = pos + file.read_ahead.size();
+        }
+
+        size_t part = min(count - read, ahead_end - pos);
+        copy_to_iov(iov, read, file.read_ahead.data() + (pos - file.read_ahead_pos), part);
+        read += part;
+    }
+
+    file.pos += read;
+    file.next_read_pos = file.pos;
+    return read;
+}
+
+ssize_t FFSys::buffered_write(CachedINode& file, IOVec const* iov, int iovcnt, size_t pos)
+{
+    ++file.version;
+
+    size_t count = total_length(iov, iovcnt);
+    if (pos + count > max_file_size(file.inode)) {
+        errnum_ = ErrorNumber::INVALID_POSITION;
+        return 0;
+    }
+
+    if (write_buffer_size_ == 0 or count == 0) {
+        return write_n_bytes_to_file(file, iov, iovcnt, pos);
+    }
+
+    bool continues = file.buffer.empty() or pos == file.buffer_pos + file.buffer.size();
+    if (!continues or file.buffer.size() + count > write_buffer_size_) {
+        if (!flush_write_buffer(file)) {
+            return 0;
+        }
+    }
+
+    if (count >= write_buffer_size_ or !claim_buffer_blocks(file, pos, count)) {
+        if (!flush_write_buffer(file)) {
+            return 0;
+        }
+        return write_n_bytes_to_file(file, iov, iovcnt, pos);
+    }
+
+    if (file.buffer.empty()) {
+        file.buffer_pos = pos;
+    }
+    for (int i = 0; i < iovcnt; ++i) {
+        file.buffer.insert(file.buffer.end(), iov[i].base, iov[i].base + iov[i].len);
+    }
+    return count;
+}
+
+bool FFSys::flush_write_buffer(CachedINode& file)
+{
+    if (file.buffer.empty()) {
+        return true;
+    }
+
+    release_buffer_blocks(file);
+
+    // What could not be written (for lack of space) stays in the buffer,
+    // so that the error is reported again instead of the data being lost
+    // silently.
+    ssize_t written = write_n_bytes_to_file(file, file.buffer.data(), file.buffer.size(), file.buffer_pos);
+    if (written < 0) {
+        return false;
+    }
+    file.buffer.erase(file.buffer.begin(), file.buffer.begin() + written);
+    file.buffer_pos += written;
+    return file.buffer.empty();
+}
+
+bool FFSys::claim_buffer_blocks(CachedINode& file, size_t pos, size_t count)
+{
+    // The blocks the buffer would span, and the address blocks they might
+    // need.
+    size_t begin = file.buffer.empty() ? pos : file.buffer_pos;
+    size_t end = pos + count;
+    unsigned int n_blocks = (end - 1) / sb_.block_size - begin / sb_.block_size + 1;
+    unsigned int needed = n_blocks + n_blocks / (sb_.block_size / sizeof(int32_t)) + 1;
+
+    lock_guard alloc_lock(data_alloc_mutex_);
+
+    size_t others = n_buffered_blocks_ - file.buffer_blocks;
+    if (others + needed > sb_.n_free_data_blocks) {
+        return false;
+    }
+
+    n_buffered_blocks_ = others + needed;
+    file.buffer_blocks = needed;
+    return true;
+}
+
+void FFSys::release_buffer_blocks(CachedINode& file)
+{
+    lock_guard alloc_lock(data_alloc_mutex_);
+    n_buffered_blocks_ -= file.buffer_blocks;
+    file.buffer_blocks = 0;
+}
+
+bool FFSys::flush_write_buffers()
+{
+    // The files are locked after the names lock has been let go of, to
+    // keep to the lock order.
+    vector<shared_ptr<CachedINode>> files;
+    {
+        lock_guard names_lock(names_mutex_);
+        for (auto& [inode, cached] : cached_inodes_) {
+            if (auto file = cached.lock()) {
+                files.push_back(file);
+            }
+        }
+    }
+
+    bool flushed = true;
+    for (auto& file : files) {
+        unique_lock file_lock(file->lock);
+        flushed = flush_write_buffer(*file) and flushed;
+    }
+    return flushed;
+}
+
+int FFSys::reserve_inode()
+{
+    Stats::Timer timer(stats_, StatOp::RESERVE_INODE);
+
+    lock_guard alloc_lock(inode_alloc_mutex_);
+
+    if (sb_.n_free_inodes == 0) {
+        return -1;
+    }
+
+    unsigned int group = choose_inode_group();
+    int reserved_i = inode_bitmaps_[group]->reserve_next_free();
+    stats_.add(StatCounter::BITMAP_SCAN_STEPS, inode_bitmaps_[group]->take_scan_steps());
+    if (reserved_i == -1) {
+        return -1;
+    }
+
+    groups_[group].n_free_inodes -= 1;
+    sb_.n_free_inodes -= 1;
+    dirty_inode_groups_.insert(group);
+    inode_group_hint_ = group;
+    sb_dirty_ = true;
+
+    return group * sb_.inodes_per_group + reserved_i;
+}
+
+unsigned int FFSys::choose_inode_group()
+{
+    lock_guard data_lock(data_alloc_mutex_);
+
+    uint32_t average = sb_.n_free_data_blocks / sb_.n_groups;
+    for (unsigned int k = 0; k < sb_.n_groups; ++k) {
+        unsigned int group = (inode_group_hint_ + k) % sb_.n_groups;
+        if (groups_[group].n_free_inodes > 0 and groups_[group].n_free_data_blocks >= average) {
+            return group;
+        }
+    }
+
+    for (unsigned int k = 0; k < sb_.n_groups; ++k) {
+        unsigned int group = (inode_group_hint_ + k) % sb_.n_groups;
+        if (groups_[group].n_free_inodes > 0) {
+            return group;
+        }
+    }
+    return inode_group_hint_;
+}
+
+int FFSys::reserve_data_block(int goal)
+{
+    unsigned int length = 0;
+    return reserve_data_blocks(1, length, goal);
+}
+
+int FFSys::reserve_data_blocks(unsigned int wanted, unsigned int& length, int goal)
+{
+    Stats::Timer timer(stats_, StatOp::RESERVE_DATA_BLOCK);
+
+    lock_guard alloc_lock(data_alloc_mutex_);
+
+    // The blocks claimed by write buffers are not given away.
+    if (sb_.n_free_data_blocks <= n_buffered_blocks_) {
+        errnum_ = ErrorNumber::NO_FREE_DATA_BLOCKS;
+        return -1;
+    }
+    wanted = min(wanted, (unsigned int)(sb_.n_free_data_blocks - n_buffered_blocks_));
+
+    unsigned int group = choose_data_group(wanted, goal);
+    int group_goal = -1;
+    if (goal != -1 and goal / sb_.data_blocks_per_group == group) {
+        group_goal = goal % sb_.data_blocks_per_group;
+    }
+
+    int reserved_i = data_block_bitmaps_[group]->reserve_run(wanted, length, group_goal);
+    stats_.add(StatCounter::BITMAP_SCAN_STEPS, data_block_bitmaps_[group]->take_scan_steps());
+    if (reserved_i == -1) {
+        errnum_ = ErrorNumber::NO_FREE_DATA_BLOCKS;
+        return -1;
+    }
+
+    groups_[group].n_free_data_blocks -= length;
+    sb_.n_free_data_blocks -= length;
+    dirty_data_groups_.insert(group);
+    data_group_hint_ = group;
+    sb_dirty_ = true;
+
+    return group * sb_.data_blocks_per_group + reserved_i;
+}
+
+unsigned int FFSys::choose_data_group(unsigned int wanted, int goal)
+{
+    unsigned int start = data_group_hint_;
+    if (goal >= 0 and (uint32_t)goal < sb_.n_data_blocks) {
+        start = goal / sb_.data_blocks_per_group;
+        if (data_block_bitmaps_[start]->is_free(goal % sb_.data_blocks_per_group)) {
+            return start;
+        }
+    }
+
+    unsigned int most_free = start;
+    for (unsigned int k = 0; k < sb_.n_groups; ++k) {
+        unsigned int group = (start + k) % sb_.n_groups;
+        if (groups_[group].n_free_data_blocks >= wanted) {
+            return group;
+        }
+        if (groups_[group].n_free_data_blocks > groups_[most_free].n_free_data_blocks) {
+            most_free = group;
+        }
+    }
+    return most_free;
+}
+
+void FFSys::free_inode(int i)
+{
+    lock_guard alloc_lock(inode_alloc_mutex_);
+
+    unsigned int group = i / sb_.inodes_per_group;
+    if (!inode_bitmaps_[group]->free(i % sb_.inodes_per_group)) {
+        return;
+    }
+
+    groups_[group].n_free_inodes += 1;
+    sb_.n_free_inodes += 1;
+    dirty_inode_groups_.insert(group);
+    sb_dirty_ = true;
+}
+
+bool FFSys::free_data_block(int i)
+{
+    if (i < 0 or (uint32_t)i >= sb_.n_data_blocks) {
         return false;
     }
 
-    INode inode;
-    inode.index = inode_i;
-    inode.size = 0;
-    inode.created_time = time(nullptr);
+    lock_guard alloc_lock(data_alloc_mutex_);
 
-    int i = 0;
-    while (i < min(sizeof(INode::name)-1, name.size())) {
-        inode.name[i] = name.at(i);
-        ++i;
+    unsigned int group = i / sb_.data_blocks_per_group;
+    if (!data_block_bitmaps_[group]->free(i % sb_.data_blocks_per_group)) {
+        return false;
+    }
+
+    groups_[group].n_free_data_blocks += 1;
+    sb_.n_free_data_blocks += 1;
+    dirty_data_groups_.insert(group);
+    sb_dirty_ = true;
+
+    return true;
+}
+
+unsigned int FFSys::free_data_blocks(int first, unsigned int count)
+{
+    if (first < 0 or (uint32_t)first >= sb_.n_data_blocks) {
+        return 0;
+    }
+    uint32_t end = first + min(count, sb_.n_data_blocks - first);
+
+    lock_guard alloc_lock(data_alloc_mutex_);
+
+    // A run may cross from one group to the next.
+    unsigned int n_freed = 0;
+    for (uint32_t i = first; i < end;) {
+        unsigned int group = i / sb_.data_blocks_per_group;
+        unsigned int offset = i % sb_.data_blocks_per_group;
+        unsigned int n = min(end - i, sb_.data_blocks_per_group - offset);
+
+        unsigned int freed = data_block_bitmaps_[group]->free_run(offset, n);
+        if (freed > 0) {
+            groups_[group].n_free_data_blocks += freed;
+            sb_.n_free_data_blocks += freed;
+            dirty_data_groups_.insert(group);
+            sb_dirty_ = true;
+            n_freed += freed;
+        }
+        i += n;
+    }
+
+    return n_freed;
+}
+
+void FFSys::free_data_blocks(vector<int32_t>& blocks)
+{
+    sort(blocks.begin(), blocks.end());
+    for (size_t i = 0; i < blocks.size();) {
+        size_t run = 1;
+        while (i + run < blocks.size() and blocks[i + run] == blocks[i] + (int32_t)run) {
+            ++run;
+        }
+        free_data_blocks(blocks[i], run);
+        i += run;
+    }
+}
+
+/**
+ * Reserves a data block for the i:th block of file.
+ */
+int FFSys::reserve_file_block(INode &inode, unsigned int i)
+{
+    // A file's first block is looked for in the group of its i-node.
+    int goal = -1;
+    if (i == 0) {
+        goal = inode.index / sb_.inodes_per_group * sb_.data_blocks_per_group;
+    }
+
+    int reserved_i = reserve_data_block(goal);
+    if (reserved_i == -1) {
+        return -1;
+    }
+
+    // Write the new address to the address block.
+    if (set_file_block_address(inode, i, (int32_t)reserved_i)) {
+        return reserved_i;
+    } else {
+        free_data_block(reserved_i);
+        return -1;
+    }
+}
+
+bool FFSys::move_inline_data(CachedINode& file)
+{
+    INode& inode = file.inode;
+    char data[INLINE_DATA_SIZE];
+    memcpy(data, inode.inline_data, INLINE_DATA_SIZE);
+
+    inode.flags &= ~INODE_INLINE_DATA;
+    if (inode.flags & INODE_EXTENTS) {
+        inode.extent_list = {{}, 0, -1};
+    } else {
+        fill(begin(inode.blocks), end(inode.blocks), -1);
+    }
+
+    int address = reserve_file_block(inode, 0);
+    if (address == -1) {
+        inode.flags |= INODE_INLINE_DATA;
+        memcpy(inode.inline_data, data, INLINE_DATA_SIZE);
+        return false;
+    }
+
+    {
+        lock_guard map_lock(file.block_map_mutex);
+        file.block_map.clear();
+    }
+
+    if (inode.size > 0) {
+        write_block(data_block_i(address), data, min<uint64_t>(inode.size, INLINE_DATA_SIZE));
+    }
+    write_inode(inode);
+    return true;
+}
+
+unsigned int FFSys::reserve_file_blocks(CachedINode& file, unsigned int first, unsigned int count, bool zero)
+{
+    unsigned int done = 0;
+    while (done < count) {
+        unsigned int i = first + done;
+
+        // Continue right after the file's previous block, if it is free.
+        int goal = -1;
+        int previous = -1;
+        unsigned int run_length = 0;
+        if (i > 0 and get_file_block_run(file, i - 1, 1, previous, run_length) and previous != -1) {
+            goal = previous + 1;
+        }
+
+        unsigned int length = 0;
+        int start = reserve_data_blocks(count - done, length, goal);
+        if (start == -1) {
+            return done;
+        }
+
+        unsigned int mapped = set_file_block_run(file.inode, i, start, length);
+        {
+            lock_guard map_lock(file.block_map_mutex);
+            if (i + mapped > file.block_map.size()) {
+                file.block_map.resize(i + mapped, CachedINode::UNKNOWN_ADDRESS);
+            }
+            for (unsigned int k = 0; k < mapped; ++k) {
+                file.block_map[i + k] = start + k;
+            }
+        }
+
+        if (zero) {
+            vector<BlockCache::Range> ranges;
+            add_zero_ranges(ranges, data_block_i(start), 0, (size_t)mapped * sb_.block_size);
+            cache_->write(ranges);
+        }
+        if (mapped < length) {
+            free_data_blocks(start + mapped, length - mapped);
+            return done + mapped;
+        }
+        done += length;
+    }
+    return done;
+}
+
+unsigned int FFSys::reserve_missing_file_blocks(CachedINode& file, unsigned int first, unsigned int last, bool zero)
+{
+    unsigned int i = first;
+    while (i <= last) {
+        unsigned int run_length = 0;
+        int address = -1;
+        if (!get_file_block_run(file, i, last - i + 1, address, run_length)) {
+            break;
+        }
+        if (address != -1) {
+            i += run_length;
+            continue;
+        }
+
+        // Reserve all of the missing blocks from i on at once, so that
+        // they can be given one run of data blocks.
+        unsigned int n_missing = 1;
+        while (i + n_missing <= last and get_file_block_run(file, i + n_missing, 1, address, run_length) and
+               address == -1)
+        {
+            ++n_missing;
+        }
+
+        unsigned int reserved = reserve_file_blocks(file, i, n_missing, zero);
+        i += reserved;
+        if (reserved < n_missing) {
+            break;
+        }
+    }
+    return i;
+}
+
+bool FFSys::free_file_block(INode &inode, unsigned int i)
+{
+    int block = -1;
+    if (!get_file_block_address(inode, i, block) or block == -1) {
+        return false;
+    }
+
+    free_data_block(block);
+    set_file_block_address(inode, i, -1);
+
+    return true;
+}
+
+void FFSys::free_unused_file_blocks(CachedINode& file)
+{
+    INode& inode = file.inode;
+
+    // The blocks may still be read through views, so they are freed once
+    // the last one is released (see release_view).
+    if (file.n_views > 0) {
+        file.free_pending = true;
+        write_inode(inode);
+        return;
+    }
+
+    int last_block = (inode.size + sb_.block_size - 1) / sb_.block_size;
+
+    // Always keep at least one block reserved, even when the file size is 0.
+    if (last_block == 0) {
+        last_block = 1;
+    }
+
+    // Forget the cached addresses of the blocks that are freed.
+    {
+        lock_guard map_lock(file.block_map_mutex);
+        if (file.block_map.size() > (size_t)last_block) {
+            file.block_map.resize(last_block);
+        }
+    }
+
+    // An inline file has no blocks, only its size changes.
+    if (inode.flags & INODE_INLINE_DATA) {
+        write_inode(inode);
+        return;
+    }
+
+    if (inode.flags & INODE_EXTENTS) {
+        free_unused_extents(inode, last_block);
+        return;
+    }
+
+    // Collect the unused file blocks and the address blocks that only map
+    // them, clearing their addresses, and then free them in runs.
+    vector<int32_t> freed;
+    for (int i = last_block; i < N_STATIC_FILE_BLOCKS; ++i) {
+        if (inode.blocks[i] != -1) {
+            freed.push_back(inode.blocks[i]);
+            inode.blocks[i] = -1;
+        }
+    }
+    free_unused_address_blocks(inode, last_block, freed);
+    free_data_blocks(freed);
+
+    // Write to disk
+    write_inode(inode);
+}
+
+int FFSys::initialize_address_block()
+{
+    int reserved_i = reserve_data_block();
+    if (reserved_i == -1) {
+        return -1;
+    }
+
+    // Initialize the newly reserved block as empty.
+    write_block(data_block_i(reserved_i), (char*)empty_address_block_buffer, sb_.address_block_capacity*sizeof(int32_t));
+    return reserved_i;
+}
+
+bool FFSys::get_address_path(INode const& inode, unsigned int i, AddressPath& path)
+{
+    if (i < N_STATIC_FILE_BLOCKS) {
+        path.slot = i;
+        path.depth = 0;
+        return true;
+    }
+
+    uint64_t cap = sb_.address_block_capacity;
+    uint64_t j = i - N_STATIC_FILE_BLOCKS;
+    int n_single = inode.flags & INODE_INDIRECT_TREE ? N_SINGLE_INDIRECT_BLOCKS : N_DYNAMIC_FILE_BLOCKS;
+
+    if (j < n_single * cap) {
+        path.slot = N_STATIC_FILE_BLOCKS + j / cap;
+        path.depth = 1;
+        path.indices[0] = j % cap;
+        return true;
+    }
+    if (!(inode.flags & INODE_INDIRECT_TREE)) {
+        return false;
+    }
+
+    // Past the single indirect blocks, the double and then the triple
+    // indirect tree. The indices are the digits of j in base cap.
+    j -= n_single * cap;
+    path.slot = N_STATIC_FILE_BLOCKS + N_SINGLE_INDIRECT_BLOCKS;
+    path.depth = 2;
+    if (j >= cap * cap) {
+        j -= cap * cap;
+        path.slot += 1;
+        path.depth = 3;
+        if (j >= cap * cap * cap) {
+            return false;
+        }
+    }
+
+    for (int level = path.depth - 1; level >= 0; --level) {
+        path.indices[level] = j % cap;
+        j /= cap;
+    }
+    return true;
+}
+
+bool FFSys::read_address(int32_t address_block, unsigned int index, int32_t& address)
+{
+    if (!read_block(data_block_i(address_block), reinterpret_cast<char*>(&address), sizeof(int32_t),
+                    index * sizeof(int32_t)))
+    {
+        address = -1;
+        errnum_ = ErrorNumber::IO_ERROR;
+        return false;
+    }
+    return true;
+}
+
+void FFSys::write_address(int32_t address_block, unsigned int index, int32_t value)
+{
+    write_block(data_block_i(address_block), reinterpret_cast<char*>(&value), sizeof(int32_t), index * sizeof(int32_t));
+}
+
+bool FFSys::set_file_block_address(INode &inode, unsigned int i, int32_t new_value)
+{
+    if (inode.flags & INODE_EXTENTS) {
+        return set_extent_run(inode, i, new_value, 1);
+    }
+
+    AddressPath path;
+    if (!get_address_path(inode, i, path)) {
+        return false;
+    }
+
+    // If the wanted block is a static one, it can be set
+    // directly to the i-node.
+    if (path.depth == 0) {
+        inode.blocks[path.slot] = new_value;
+        write_inode(inode);
+        return true;
+    }
+
+    // If the first address block has not been reserved yet, try to
+    // reserve it. Clearing an address that has no address block is a
+    // no-op.
+    if (inode.blocks[path.slot] == -1) {
+        if (new_value == -1) {
+            return true;
+        }
+
+        inode.blocks[path.slot] = initialize_address_block();
+
+        // Reserving failed
+        if (inode.blocks[path.slot] == -1) {
+            return false;
+        }
+
+        write_inode(inode);
     }
-    inode.name[i] = '\0';
 
-    int initial_data_block = reserve_data_block();
-    if (initial_data_block != -1) {
-        inode.blocks[0] = initial_data_block;
+    // Walk down the interior address blocks, reserving the missing ones.
+    int32_t address_block = inode.blocks[path.slot];
+    for (unsigned int level = 0; level + 1 < path.depth; ++level) {
+        int32_t next = -1;
+        if (!read_address(address_block, path.indices[level], next)) {
+            return false;
+        }
+        if (next == -1) {
+            if (new_value == -1) {
+                return true;
+            }
+
+            next = initialize_address_block();
+            if (next == -1) {
+                return false;
+            }
+            write_address(address_block, path.indices[level], next);
+        }
+        address_block = next;
     }
 
-    // Write inode to disk
-    write_inode(inode);
+    // Write the new address to the last address block.
+    write_address(address_block, path.indices[path.depth - 1], new_value);
 
-    result = inode;
     return true;
 }
 
-bool FFSys::find_file(std::string name, INode& result)
+unsigned int FFSys::set_file_block_run(INode& inode, unsigned int i, int32_t address, unsigned int count)
 {
-    INode inode;
-    unsigned int inodes_checked = 0;
-    for (unsigned int i = 0; i < sb_.n_inodes; ++i) {
-        // If we have already checked all used inodes.
-        if (inodes_checked >= (sb_.n_inodes - sb_.n_free_inodes)) {
-            break;
-        }
+    if (inode.flags & INODE_EXTENTS) {
+        return set_extent_run(inode, i, address, count) ? count : 0;
+    }
 
-        if (!inode_bitmap_->is_free(i) and read_inode(i, inode)) {
-            if (inode.name == name) {
-                result = inode;
-                return true;
-            }
-            ++inodes_checked;
+    for (unsigned int k = 0; k < count; ++k) {
+        if (!set_file_block_address(inode, i + k, address + k)) {
+            return k;
         }
     }
-    return false;
+    return count;
 }
 
-size_t FFSys::read_n_bytes_from_file(INode const& file, char* buffer, size_t count, size_t pos)
+/**
+ * Gets the address of the i:th data block of the given inode
+ */
+bool FFSys::get_file_block_address(INode const& inode, unsigned int i, int& address)
 {
-    if (pos + count >= file.size) {
-        count = file.size - pos;
+    address = -1;
+    if (inode.flags & INODE_INLINE_DATA) {
+        return true;
     }
 
-    size_t read_count = 0;
-    unsigned int block_index = pos / sb_.block_size;
+    if (inode.flags & INODE_EXTENTS) {
+        unsigned int run_length = 0;
+        return get_extent_address(inode, i, 1, address, run_length);
+    }
 
-    // Read to the end of the current block, if we are starting from the middle.
-    size_t leftover = pos % sb_.block_size;
-    if (leftover != 0) {
-        int block_address = sb_.data_blocks_start_i + get_file_block_address(file, block_index);
-        size_t pos = (block_address) * sb_.block_size + leftover;
-        fs_.seekg(pos);
+    // Blocks over the max file block amount have no address.
+    AddressPath path;
+    if (!get_address_path(inode, i, path)) {
+        return true;
+    }
 
-        size_t to_read = min(sb_.block_size - leftover, count);
-        fs_.read(buffer, to_read);
-        read_count += to_read;
-        ++block_index;
+    // Follow the address blocks down from the i-node. If one of them has
+    // not been reserved yet, neither has the wanted block.
+    address = inode.blocks[path.slot];
+    for (unsigned int level = 0; level < path.depth and address != -1; ++level) {
+        if (!read_address(address, path.indices[level], address)) {
+            return false;
+        }
     }
+    return true;
+}
 
-    // Read the rest as full blocks until finished.
-    while (read_count < count) {
-        int block_address = get_file_block_address(file, block_index);
+void FFSys::free_unused_address_blocks(INode& inode, unsigned int last_block, vector<int32_t>& freed)
+{
+    uint64_t cap = sb_.address_block_capacity;
+    uint64_t first = N_STATIC_FILE_BLOCKS;
 
-        if (block_address == -1) {
-            break;
+    for (int slot = N_STATIC_FILE_BLOCKS; slot < N_STATIC_FILE_BLOCKS + N_DYNAMIC_FILE_BLOCKS; ++slot) {
+        unsigned int depth = 1;
+        if (inode.flags & INODE_INDIRECT_TREE and slot >= N_STATIC_FILE_BLOCKS + N_SINGLE_INDIRECT_BLOCKS) {
+            depth = slot - (N_STATIC_FILE_BLOCKS + N_SINGLE_INDIRECT_BLOCKS) + 2;
         }
 
-        size_t to_read = min((size_t)sb_.block_size, count - read_count);
-        read_block(sb_.data_blocks_start_i + block_address, buffer + read_count, to_read);
-        read_count += to_read;
+        uint64_t span = 1;
+        for (unsigned int level = 0; level < depth; ++level) {
+            span *= cap;
+        }
 
-        ++block_index;
+        if (inode.blocks[slot] != -1 and first + span > last_block) {
+            free_address_tree(inode.blocks[slot], depth, first, last_block, freed);
+        }
+        first += span;
     }
-
-    return read_count;
 }
 
-size_t FFSys::write_n_bytes_to_file(INode &file, char *buffer, size_t count, size_t pos)
+void FFSys::free_address_tree(int32_t& address, unsigned int depth, uint64_t first, uint64_t last_block,
+                              vector<int32_t>& freed)
 {
-    size_t left_to_write = count;
-    size_t written = 0;
-
-    // The index of the block we start from (not the index of the actual
-    // file data block, but the index into the i-node's blocks, which gives
-    // the actual one).
-    unsigned int current_file_block_i = pos / sb_.block_size;
+    uint64_t cap = sb_.address_block_capacity;
+    uint64_t child_span = 1;
+    for (unsigned int level = 1; level < depth; ++level) {
+        child_span *= cap;
+    }
 
-    while (left_to_write > 0) {
-        // Get the address of the current data block.
-        int current_block_address = get_file_block_address(file, current_file_block_i);
+    vector<int32_t> addresses(cap);
+    if (!read_block(data_block_i(address), reinterpret_cast<char*>(addresses.data()), cap * sizeof(int32_t), 0)) {
+        return;
+    }
 
-        // If file space has ran out, reserve a new block.
-        if (current_block_address == -1) {
-            current_block_address = reserve_file_block(file, current_file_block_i);
+    // Only the children that map blocks past the last one are cleared.
+    // The last level has the data blocks as children, the others address
+    // blocks.
+    uint64_t begin = last_block > first ? (last_block - first) / child_span : 0;
+    uint64_t changed_begin = cap;
+    uint64_t changed_end = begin;
+    for (uint64_t k = begin; k < cap; ++k) {
+        if (addresses[k] == -1) {
+            continue;
+        }
 
-            // No more free data blocks.
-            if (current_block_address == -1) {
-                break;
-            }
+        if (depth == 1) {
+            freed.push_back(addresses[k]);
+            addresses[k] = -1;
+        } else {
+            free_address_tree(addresses[k], depth - 1, first + k * child_span, last_block, freed);
+        }
+        if (addresses[k] == -1) {
+            changed_begin = min(changed_begin, k);
+            changed_end = k + 1;
         }
+    }
 
-        // Always write to the next block (or just whatever's left, if it is less).
-        size_t offset = pos % sb_.block_size;
-        size_t to_write = min(sb_.block_size - offset, left_to_write);
-        size_t block_i = sb_.data_blocks_start_i + current_block_address;
-        write_block(block_i, buffer + written, to_write, offset);
+    if (first >= last_block) {
+        freed.push_back(address);
+        address = -1;
+    } else if (changed_begin < changed_end) {
+        write_block(data_block_i(address), reinterpret_cast<char*>(addresses.data() + changed_begin),
+                    (changed_end - changed_begin) * sizeof(int32_t), changed_begin * sizeof(int32_t));
+    }
+}
 
-        written += to_write;
-        left_to_write -= to_write;
-        pos += to_write;
+bool FFSys::get_file_block_run(INode const& inode, unsigned int i, unsigned int max_count, int& address,
+                               unsigned int& run_length)
+{
+    address = -1;
+    run_length = 0;
+    if (inode.flags & INODE_INLINE_DATA) {
+        return true;
+    }
 
-        ++current_file_block_i;
+    // Data blocks only follow each other in the FFSys file within a group,
+    // so a run ends at the end of its group.
+    if (inode.flags & INODE_EXTENTS) {
+        if (!get_extent_address(inode, i, max_count, address, run_length)) {
+            return false;
+        }
+        if (address != -1) {
+            run_length = min(run_length, blocks_left_in_group(address));
+        }
+        return true;
     }
 
-    file.size = max((uint64_t)pos, file.size);
-    write_inode(file);
+    if (!get_file_block_address(inode, i, address)) {
+        return false;
+    }
+    if (address == -1) {
+        return true;
+    }
 
-    return written;
+    // A block whose address cannot be read ends the run, and the error
+    // comes up when it is looked up itself.
+    run_length = 1;
+    max_count = min(max_count, blocks_left_in_group(address));
+    int next = -1;
+    while (run_length < max_count and get_file_block_address(inode, i + run_length, next) and
+           next == address + (int)run_length)
+    {
+        ++run_length;
+    }
+    return true;
 }
 
-int FFSys::reserve_inode()
+bool FFSys::get_file_block_run(CachedINode& file, unsigned int i, unsigned int max_count, int& address,
+                               unsigned int& run_length)
 {
-    int reserved_i = inode_bitmap_->reserve_first_free();
-    if (reserved_i == -1) {
-        return -1;
-    }
+    lock_guard map_lock(file.block_map_mutex);
+    vector<int32_t>& map = file.block_map;
+    address = -1;
+    run_length = 0;
+
+    while (run_length < max_count) {
+        unsigned int block = i + run_length;
+
+        // Look up the rest of the run from the i-node, and remember it.
+        if (block >= map.size() or map[block] == CachedINode::UNKNOWN_ADDRESS) {
+            unsigned int found = 0;
+            int found_address = -1;
+            if (!get_file_block_run(file.inode, block, max_count - run_length, found_address, found)) {
+                if (run_length > 0) {
+                    break;
+                }
+                return false;
+            }
 
-    // Write to disk
-    unsigned int bm_pos = sb_.inode_bitmap_i * sb_.block_size;
-    unsigned int byte_pos = reserved_i / 8;
-    fs_.seekp(bm_pos + byte_pos);
-    fs_.write(inode_bitmap_->get_bm(byte_pos), 1);
+            if (block + max(found, 1u) > map.size()) {
+                map.resize(block + max(found, 1u), CachedINode::UNKNOWN_ADDRESS);
+            }
+            map[block] = found_address;
+            for (unsigned int k = 1; k < found; ++k) {
+                map[block + k] = found_address + k;
+            }
+        }
 
-    sb_.n_free_inodes -= 1;
-    write_superblock();
+        if (map[block] == -1 or (run_length > 0 and map[block] != address + (int)run_length)) {
+            break;
+        }
+        // A run ends where a new group starts.
+        if (run_length > 0 and blocks_left_in_group(map[block]) == sb_.data_blocks_per_group) {
+            break;
+        }
 
-    return reserved_i;
+        if (run_length == 0) {
+            address = map[block];
+        }
+        ++run_length;
+    }
+
+    return true;
 }
 
-int FFSys::reserve_data_block()
+unsigned int FFSys::count_file_blocks(INode const& inode)
 {
-    int reserved_i = data_block_bitmap_->reserve_first_free();
-    if (reserved_i == -1) {
-        errnum_ = ErrorNumber::NO_FREE_DATA_BLOCKS;
-        return -1;
-    }
+    unsigned int n_blocks = 0;
 
-    // Write to disk
-    unsigned int bm_pos = sb_.data_block_bitmap_i * sb_.block_size;
-    unsigned int byte_pos = reserved_i / 8;
-    fs_.seekp(bm_pos + byte_pos);
-    fs_.write(data_block_bitmap_->get_bm(byte_pos), 1);
+    if (inode.flags & INODE_INLINE_DATA) {
+        return 0;
+    }
 
-    sb_.n_free_data_blocks -= 1;
-    write_superblock();
+    if (inode.flags & INODE_EXTENTS) {
+        vector<Extent> extents;
+        read_extents(inode, extents);
+        for (Extent const& extent : extents) {
+            n_blocks += extent.length;
+        }
+        return n_blocks;
+    }
 
-    return reserved_i;
+    // Only the blocks found before an address block that cannot be read
+    // are counted.
+    unsigned int max_blocks = max_address_mapped_blocks(inode);
+    unsigned int i = 0;
+    while (find_mapped_block(inode, i, max_blocks, i) and i < max_blocks) {
+        ++n_blocks;
+        ++i;
+    }
+    return n_blocks;
 }
 
-bool FFSys::free_data_block(int i)
+bool FFSys::find_mapped_block(INode const& inode, unsigned int i, unsigned int end, unsigned int& next)
 {
-    if (!data_block_bitmap_->free(i)) {
-        return false;
+    next = end;
+    if (inode.flags & INODE_INLINE_DATA) {
+        return true;
     }
 
-    // Write to disk
-    unsigned int bm_pos = sb_.data_block_bitmap_i * sb_.block_size;
-    unsigned int byte_pos = i / 8;
-    fs_.seekp(bm_pos + byte_pos);
-    fs_.write(data_block_bitmap_->get_bm(byte_pos), 1);
+    if (inode.flags & INODE_EXTENTS) {
+        vector<Extent> extents;
+        if (!read_extents(inode, extents)) {
+            return false;
+        }
+        for (Extent const& extent : extents) {
+            if (extent.logical + extent.length > i) {
+                next = min(end, max(i, extent.logical));
+                return true;
+            }
+        }
+        return true;
+    }
 
-    sb_.n_free_data_blocks += 1;
-    write_superblock();
+    uint64_t cap = sb_.address_block_capacity;
+    end = min(end, max_address_mapped_blocks(inode));
+    while (i < end) {
+        AddressPath path;
+        get_address_path(inode, i, path);
+
+        int32_t address = inode.blocks[path.slot];
+        unsigned int level = 0;
+        for (; level < path.depth and address != -1; ++level) {
+            if (!read_address(address, path.indices[level], address)) {
+                return false;
+            }
+        }
+        if (address != -1) {
+            next = i;
+            return true;
+        }
 
+        // The missing address (at the slot, if level is 0) covers a whole
+        // subtree of blocks, all of which are missing. Skip to the next.
+        uint64_t within = 0;
+        uint64_t span = 1;
+        for (unsigned int l = level; l < path.depth; ++l) {
+            within = within * cap + path.indices[l];
+            span *= cap;
+        }
+        i = min<uint64_t>(end, i - within + span);
+    }
     return true;
 }
 
-/**
- * Reserves a data block for the i:th block of file.
- */
-int FFSys::reserve_file_block(INode &inode, unsigned int i)
+bool FFSys::find_mapped_block(CachedINode& file, unsigned int i, unsigned int end, unsigned int& next)
 {
-    int reserved_i = reserve_data_block();
-    if (reserved_i == -1) {
-        return -1;
-    }
+    lock_guard map_lock(file.block_map_mutex);
+    vector<int32_t>& map = file.block_map;
 
-    // Write the new address to the address block.
-    if (set_file_block_address(inode, i, (int32_t)reserved_i)) {
-        return reserved_i;
-    } else {
-        return -1;
+    while (i < end and i < map.size() and map[i] == -1) {
+        ++i;
+    }
+    if (i >= end or (i < map.size() and map[i] != CachedINode::UNKNOWN_ADDRESS)) {
+        next = min(i, end);
+        return true;
     }
-}
 
-bool FFSys::free_file_block(INode &inode, unsigned int i)
-{
-    int block = get_file_block_address(inode, i);
-    if (block == -1) {
+    // Remember the holes found, as far as the map reaches already.
+    if (!find_mapped_block(file.inode, i, end, next)) {
         return false;
     }
-
-    free_data_block(block);
-    set_file_block_address(inode, i, -1);
-
+    for (unsigned int k = i; k < next and k < map.size(); ++k) {
+        map[k] = -1;
+    }
     return true;
 }
 
-void FFSys::free_unused_file_blocks(INode &inode)
+uint64_t FFSys::max_file_size(INode const& inode)
 {
-    int last_block = (inode.size + sb_.block_size - 1) / sb_.block_size;
+    if (inode.flags & INODE_EXTENTS) {
+        return (uint64_t)numeric_limits<uint32_t>::max() * sb_.block_size;
+    }
+    return (uint64_t)max_address_mapped_blocks(inode) * sb_.block_size;
+}
 
-    // Always keep at least one block reserved, even when the file size is 0.
-    if (last_block == 0) {
-        last_block = 1;
+unsigned int FFSys::max_address_mapped_blocks(INode const& inode)
+{
+    uint64_t cap = sb_.address_block_capacity;
+    if (!(inode.flags & INODE_INDIRECT_TREE)) {
+        return N_STATIC_FILE_BLOCKS + N_DYNAMIC_FILE_BLOCKS * cap;
     }
 
-    // Free up each unused file block.
-    for (int i = last_block; i < N_STATIC_FILE_BLOCKS + N_DYNAMIC_FILE_BLOCKS * sb_.address_block_capacity; ++i) {
-        if (get_file_block_address(inode, i) == -1) {
-            break;
-        }
+    // File block indices are unsigned ints, so large block sizes map
+    // less than the full triple indirect tree.
+    uint64_t n = N_STATIC_FILE_BLOCKS + N_SINGLE_INDIRECT_BLOCKS * cap + cap * cap + cap * cap * cap;
+    return min<uint64_t>(n, numeric_limits<unsigned int>::max());
+}
 
-        free_file_block(inode, i);
+unsigned int FFSys::extents_per_block(size_t count)
+{
+    unsigned int in_one_block = sb_.block_size / sizeof(Extent);
+    if (count <= N_INODE_EXTENTS + in_one_block) {
+        return in_one_block;
     }
+    return (sb_.block_size - sizeof(int32_t)) / sizeof(Extent);
+}
 
-    // If any of the address blocks is no longer needed, free them.
-    // At this point, it should contain only -1:s anyway.
-    for (int i = 0; i < N_DYNAMIC_FILE_BLOCKS; ++i)
-    {
-        if (inode.blocks[N_STATIC_FILE_BLOCKS + i] != -1 &&
-            last_block < N_STATIC_FILE_BLOCKS + i * sb_.address_block_capacity)
-        {
-            free_data_block(inode.blocks[N_STATIC_FILE_BLOCKS + i]);
-            inode.blocks[N_STATIC_FILE_BLOCKS + i] = -1;
+bool FFSys::read_extents(INode const& inode, vector<Extent>& result)
+{
+    const ExtentList& list = inode.extent_list;
+    result.assign(list.extents, list.extents + min(list.count, (uint32_t)N_INODE_EXTENTS));
+    result.resize(list.count);
+
+    // The rest are in the overflow blocks.
+    unsigned int per_block = extents_per_block(list.count);
+    vector<char> block(sb_.block_size);
+    int32_t address = list.overflow_block;
+    for (size_t done = N_INODE_EXTENTS; done < list.count;) {
+        size_t n = min<size_t>(list.count - done, per_block);
+        if (!read_block(data_block_i(address), block.data())) {
+            errnum_ = ErrorNumber::IO_ERROR;
+            return false;
         }
+        memcpy(result.data() + done, block.data(), n * sizeof(Extent));
+        memcpy(&address, block.data() + sb_.block_size - sizeof(int32_t), sizeof(int32_t));
+        done += n;
     }
-
-    // Write to disk
-    write_block(sb_.data_block_bitmap_i, data_block_bitmap_->get_bm());
-    write_superblock();
-    write_inode(inode);
+    return true;
 }
 
-int FFSys::initialize_address_block()
+bool FFSys::read_overflow_chain(ExtentList const& list, vector<int32_t>& chain)
 {
-    int reserved_i = reserve_data_block();
-    if (reserved_i == -1) {
-        return -1;
+    unsigned int per_block = extents_per_block(list.count);
+    int32_t address = list.overflow_block;
+    for (size_t done = N_INODE_EXTENTS; done < list.count; done += per_block) {
+        chain.push_back(address);
+        if (done + per_block < list.count and
+            !read_block(data_block_i(address), reinterpret_cast<char*>(&address), sizeof(int32_t),
+                        sb_.block_size - sizeof(int32_t)))
+        {
+            errnum_ = ErrorNumber::IO_ERROR;
+            return false;
+        }
     }
-
-    // Initialize the newly reserved block as empty.
-    write_block(reserved_i + sb_.data_blocks_start_i, (char*)empty_address_block_buffer, sb_.address_block_capacity*sizeof(int32_t));
-    return reserved_i;
+    return true;
 }
 
-bool FFSys::set_file_block_address(INode &inode, unsigned int i, int32_t new_value)
+bool FFSys::write_extents(INode& inode, vector<Extent> const& extents, vector<Extent> const& old)
 {
-    // If the wanted block is a static one, it can be set
-    // directly to the i-node.
-    if (i < N_STATIC_FILE_BLOCKS) {
-        inode.blocks[i] = new_value;
-        write_inode(inode);
-        return true;
-    }
+    ExtentList& list = inode.extent_list;
 
-    int dyn_block_i = (i - N_STATIC_FILE_BLOCKS) / sb_.address_block_capacity + N_STATIC_FILE_BLOCKS;
-    if (dyn_block_i >= N_STATIC_FILE_BLOCKS + N_DYNAMIC_FILE_BLOCKS) {
+    // Reuse the overflow blocks the file has, and reserve the missing ones
+    // after them.
+    vector<int32_t> chain;
+    if (!read_overflow_chain(list, chain)) {
         return false;
     }
+    size_t n_old = chain.size();
+    unsigned int per_block = extents_per_block(extents.size());
+    size_t n_overflow = 0;
+    if (extents.size() > N_INODE_EXTENTS) {
+        n_overflow = (extents.size() - N_INODE_EXTENTS + per_block - 1) / per_block;
+    }
 
-    // If the address block has not been reserved yet, try to reserve it
-    if (inode.blocks[dyn_block_i] == -1) {
-        inode.blocks[dyn_block_i] = initialize_address_block();
+    auto free_new_blocks = [this, &chain, n_old]() {
+        for (size_t k = n_old; k < chain.size(); ++k) {
+            free_data_block(chain[k]);
+        }
+    };
 
-        // Reserving failed
-        if (inode.blocks[dyn_block_i] == -1) {
+    while (chain.size() < n_overflow) {
+        int32_t address = reserve_data_block(chain.empty() ? -1 : chain.back() + 1);
+        if (address == -1) {
+            free_new_blocks();
             return false;
         }
+        chain.push_back(address);
+    }
+
+    // An old block can be kept if its extents and the address of the next
+    // block stay the same.
+    auto same = [](Extent const& a, Extent const& b) {
+        return a.logical == b.logical and a.physical == b.physical and a.length == b.length;
+    };
+    size_t n_same = mismatch(extents.begin(), extents.end(), old.begin(), old.end(), same).first - extents.begin();
+    bool same_layout = per_block == extents_per_block(old.size());
+
+    // The i-node is only changed once the extents are in place.
+    vector<char> block(sb_.block_size);
+    for (size_t k = 0; k < n_overflow; ++k) {
+        size_t first = N_INODE_EXTENTS + k * per_block;
+        size_t n = min<size_t>(extents.size() - first, per_block);
+        bool same_next = (k + 1 < n_old) == (k + 1 < n_overflow);
+        if (k < n_old and same_layout and same_next and first + per_block <= n_same) {
+            continue;
+        }
 
-        write_inode(inode);
+        memcpy(block.data(), extents.data() + first, n * sizeof(Extent));
+        if (n_overflow > 1) {
+            int32_t next = k + 1 < n_overflow ? chain[k + 1] : -1;
+            memcpy(block.data() + sb_.block_size - sizeof(int32_t), &next, sizeof(int32_t));
+        }
+
+        if (!write_block(data_block_i(chain[k]), block.data())) {
+            free_new_blocks();
+            errnum_ = ErrorNumber::IO_ERROR;
+            return false;
+        }
     }
 
-    // The local index of the address inside the dynamic address block
-    int i_in_dyn_block = (i - N_STATIC_FILE_BLOCKS) % sb_.address_block_capacity;
+    for (size_t k = n_overflow; k < chain.size(); ++k) {
+        free_data_block(chain[k]);
+    }
+    list.overflow_block = n_overflow > 0 ? chain[0] : -1;
 
-    // Write the new address to the address block.
-    unsigned int address_block = sb_.data_blocks_start_i + inode.blocks[dyn_block_i];
-    write_block(address_block, reinterpret_cast<char*>(&new_value), sizeof(int32_t), i_in_dyn_block * sizeof(int32_t));
+    copy_n(extents.begin(), min(extents.size(), (size_t)N_INODE_EXTENTS), list.extents);
+    list.count = extents.size();
 
+    write_inode(inode);
     return true;
 }
 
-/**
- * Gets the address of the i:th data block of the given inode
- */
-int FFSys::get_file_block_address(INode const& inode, unsigned int i)
+bool FFSys::set_extent_run(INode& inode, unsigned int i, int32_t address, unsigned int count)
 {
-    // If the wanted block is a static one, it can be retrieved
-    // directly from the i-node.
-    if (i < N_STATIC_FILE_BLOCKS) {
-        return inode.blocks[i];
+    vector<Extent> old;
+    if (!read_extents(inode, old)) {
+        return false;
     }
 
-    int dyn_block_i = (i - N_STATIC_FILE_BLOCKS) / sb_.address_block_capacity + N_STATIC_FILE_BLOCKS;
+    // Remove the old mappings of the blocks, keeping the parts of their
+    // extents that are before and after them.
+    unsigned int end = i + count;
+    vector<Extent> extents;
+    extents.reserve(old.size() + 2);
+    for (Extent const& extent : old) {
+        unsigned int extent_end = extent.logical + extent.length;
+        if (extent_end <= i or extent.logical >= end) {
+            extents.push_back(extent);
+            continue;
+        }
+        if (extent.logical < i) {
+            extents.push_back({extent.logical, extent.physical, i - extent.logical});
+        }
+        if (extent_end > end) {
+            extents.push_back({end, extent.physical + (int32_t)(end - extent.logical), extent_end - end});
+        }
+    }
 
-    // If the wanted block is over the max file block amount, or it's
-    // corresponding address block has not been reserved yet, return -1.
-    if (dyn_block_i >= (N_DYNAMIC_FILE_BLOCKS + N_STATIC_FILE_BLOCKS) ||
-        inode.blocks[dyn_block_i] == -1)
-    {
-        return -1;
+    // Add the new mapping, joining it with the neighbouring extents that
+    // it continues.
+    if (address != -1) {
+        auto continues = [](Extent const& a, Extent const& b) {
+            return a.logical + a.length == b.logical and a.physical + (int32_t)a.length == b.physical;
+        };
+
+        auto next = upper_bound(extents.begin(), extents.end(), i, [](unsigned int i, Extent const& e) {
+            return i < e.logical;
+        });
+        auto added = extents.insert(next, {i, address, count});
+        if (added + 1 != extents.end() and continues(*added, *(added + 1))) {
+            added->length += (added + 1)->length;
+            extents.erase(added + 1);
+        }
+        if (added != extents.begin() and continues(*(added - 1), *added)) {
+            (added - 1)->length += added->length;
+            extents.erase(added);
+        }
+    }
+
+    return write_extents(inode, extents, old);
+}
+
+bool FFSys::get_extent_address(INode const& inode, unsigned int i, unsigned int max_count, int& address,
+                               unsigned int& run_length)
+{
+    vector<Extent> extents;
+    address = -1;
+    run_length = 0;
+    if (!read_extents(inode, extents)) {
+        return false;
+    }
+
+    auto next = upper_bound(extents.begin(), extents.end(), i, [](unsigned int i, Extent const& e) {
+        return i < e.logical;
+    });
+    if (next == extents.begin()) {
+        return true;
+    }
+
+    auto extent = next - 1;
+    if (i >= extent->logical + extent->length) {
+        return true;
+    }
+
+    run_length = min(max_count, extent->logical + extent->length - i);
+    address = extent->physical + (i - extent->logical);
+    return true;
+}
+
+void FFSys::free_unused_extents(INode& inode, unsigned int first_unused)
+{
+    vector<Extent> extents;
+    if (!read_extents(inode, extents)) {
+        return;
     }
+    vector<Extent> old = extents;
 
-    // The index of the wanted address inside the dyn block
-    int i_in_dyn_block = (i - N_STATIC_FILE_BLOCKS) % sb_.address_block_capacity;
+    while (!extents.empty()) {
+        Extent& last = extents.back();
+        if (last.logical + last.length <= first_unused) {
+            break;
+        }
 
-    unsigned int address_block = sb_.data_blocks_start_i + inode.blocks[dyn_block_i];
-    char pointer[sizeof(int32_t)];
+        unsigned int keep = last.logical < first_unused ? first_unused - last.logical : 0;
+        free_data_blocks(last.physical + keep, last.length - keep);
 
-    // Read only the wanted pointer from the address block.
-    read_block(address_block, pointer, sizeof(int32_t), i_in_dyn_block * sizeof(int32_t));
+        if (keep == 0) {
+            extents.pop_back();
+        } else {
+            last.length = keep;
+        }
+    }
 
-    // Return as int
-    return bit_cast<int32_t>(pointer);
+    write_extents(inode, extents, old);
 }
 
-void FFSys::print_inode(INode &inode) {
-    cout << "- " << string(inode.name) << endl;
+void FFSys::print_inode(INode &inode, string const& path) {
+    cout << "- " << path << (inode.flags & INODE_DIRECTORY ? "/" : "") << endl;
     cout << "  Size: " << inode.size << endl;
     cout << "  I-node: " << inode.index << endl;
 
     time_t created_time = (time_t)inode.created_time;
     cout << "  Created: " << put_time(localtime(&created_time), "%d/%m/%Y - %H:%M") << endl;
 
-    int reserved_blocks = 0;
-    for (int i = 0; i < N_STATIC_FILE_BLOCKS + N_DYNAMIC_FILE_BLOCKS * sb_.address_block_capacity; ++i) {
-        if (get_file_block_address(inode, i) == -1) {
-            break;
-        }
-        ++reserved_blocks;
+    if (inode.flags & INODE_INLINE_DATA) {
+        cout << "  Layout: inline data" << endl;
+    } else if (inode.flags & INODE_EXTENTS) {
+        cout << "  Layout: " << inode.extent_list.count << " extents" << endl;
+    } else {
+        cout << "  Layout: block addresses"
+             << (inode.flags & INODE_INDIRECT_TREE ? " (indirect tree)" : "") << endl;
     }
-    cout << "  Reserved " << reserved_blocks << " data blocks." << endl;
+    cout << "  Reserved " << count_file_blocks(inode) << " data blocks." << endl;
 }
 
 // PRINT FUNCTIONS FOR TESTING
@@ -664,25 +3558,48 @@ void FFSys::print_superblock() {
     cout << "Block size: " << sb_.block_size << endl;
     cout << "Address block capacity: " << sb_.address_block_capacity << endl << endl;
 
+    cout << "N block groups: " << sb_.n_groups << endl;
+    cout << "N i-nodes per group: " << sb_.inodes_per_group << endl;
+    cout << "N i-node blocks per group: " << sb_.inode_blocks_per_group << endl;
+    cout << "N data blocks per group: " << sb_.data_blocks_per_group << endl << endl;
+
     cout << "N i-nodes: " << sb_.n_inodes << endl;
     cout << "N free i-nodes: " << sb_.n_free_inodes << endl;
-    cout << "N i-node blocks: " << sb_.n_inode_blocks << endl << endl;
-
     cout << "N data blocks: " << sb_.n_data_blocks << endl;
     cout << "N free data blocks: " << sb_.n_free_data_blocks << endl << endl;
 
+    cout << "N journal blocks: " << sb_.n_journal_blocks << endl << endl;
+
     cout << "Total N blocks: " << sb_.total_n_blocks() << endl;
 }
 
 void FFSys::print_all_files()
 {
     cout << "Files: " << endl;
+
+    lock_guard names_lock(names_mutex_);
+    INode root;
+    if (read_inode(sb_.root_inode, root)) {
+        print_directory(root, "");
+    }
+}
+
+void FFSys::print_directory(INode& directory, string const& path)
+{
+    vector<DirEntry> entries;
+    if (!read_entries(directory, entries)) {
+        cout << "Error: could not read directory " << path << "/" << endl;
+        return;
+    }
+    sort(entries.begin(), entries.end(), [](DirEntry const& a, DirEntry const& b) { return a.name < b.name; });
+
     INode file;
-    for (int i = 0; i < sb_.n_inodes; ++i) {
-        if (!inode_bitmap_->is_free(i)) {
-            if (read_inode(i,file)) {
-                print_inode(file);
-                cout << endl;
+    for (DirEntry const& entry : entries) {
+        if (read_inode(entry.inode, file)) {
+            print_inode(file, path + "/" + entry.name);
+            cout << endl;
+            if (file.flags & INODE_DIRECTORY) {
+                print_directory(file, path + "/" + entry.name);
             }
         }
     }
@@ -691,8 +3608,15 @@ void FFSys::print_all_files()
 void FFSys::print_open_files()
 {
     cout << "Open files: " << endl;
+
+    map<file_descriptor, shared_ptr<OpenFile>> open_files;
+    for (OpenFileShard& shard : open_files_) {
+        shared_lock shard_lock(shard.mutex);
+        open_files.insert(shard.files.begin(), shard.files.end());
+    }
+
     INode file;
-    for (auto [fd, open_file] : open_files_) {
+    for (auto [fd, open_file] : open_files) {
         if (!read_inode(open_file->inode, file)) {
             cout << "Error: could not read i-node for open file with fd " << fd << endl;
             continue;
@@ -702,5 +3626,31 @@ void FFSys::print_open_files()
     }
 }
 
+void FFSys::print_stats()
+{
+    StatsSnapshot stats = get_stats();
+
+    cout << "Counters: " << endl;
+    for (size_t i = 0; i < stats.counters.size(); ++i) {
+        cout << "  " << left << setw(22) << to_string((StatCounter)i) << right << stats.counters[i] << endl;
+    }
+
+    cout << endl << "Calls (latencies in microseconds): " << endl;
+    cout << "  " << left << setw(20) << "operation" << right << setw(10) << "count"
+         << setw(10) << "avg" << setw(10) << "p50" << setw(10) << "p99" << setw(10) << "max" << endl;
+    cout << fixed << setprecision(1);
+    for (size_t i = 0; i < stats.ops.size(); ++i) {
+        OpStats const& op = stats.ops[i];
+        if (op.count == 0) {
+            continue;
+        }
+        cout << "  " << left << setw(20) << to_string((StatOp)i) << right << setw(10) << op.count
+             << setw(10) << op.total_ns / 1000.0 / op.count
+             << setw(10) << op.percentile(50) / 1000.0 << setw(10) << op.percentile(99) / 1000.0
+             << setw(10) << op.max_ns / 1000.0 << endl;
+    }
+    cout << defaultfloat;
+}
+
 
 } // namespace simfs
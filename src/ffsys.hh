@@ -3,12 +3,27 @@
 
 #include "fs_objects.hh"
 #include "bitmap.hh"
+#include "block_cache.hh"
+#include "dentry_cache.hh"
+#include "io_engine.hh"
+#include "stats.hh"
+#include "storage.hh"
 
+#include <algorithm>
 #include <string>
 #include <fstream>
 #include <map>
+#include <set>
+#include <unordered_map>
 #include <vector>
 #include <memory>
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <shared_mutex>
+#include <span>
 
 // FFSys = FileFileSystem
 namespace ffsys {
@@ -22,7 +37,12 @@ enum class ErrorNumber {
     NO_FREE_DATA_BLOCKS,
     FILE_ALREADY_EXISTS,
     NO_SUCH_FILE,
-    FILE_ALREADY_OPEN
+    FILE_ALREADY_OPEN,
+    INVALID_POSITION,
+    NOT_A_DIRECTORY,
+    IS_A_DIRECTORY,
+    NAME_TOO_LONG,
+    IO_ERROR
 };
 
 /**
@@ -31,6 +51,61 @@ enum class ErrorNumber {
  */
 using file_descriptor = int;
 
+/**
+ * In-memory copy of an open file's i-node, shared by all the file
+ * descriptors that refer to the file, so that reading and writing
+ * does not need to read the i-node or the file's addresses again.
+ */
+struct CachedINode {
+    // Held shared while reading the file (or its size), and exclusively
+    // while changing it.
+    std::shared_mutex lock;
+
+    INode inode;
+
+    // The data block addresses of the file's blocks, indexed by file block.
+    // Filled lazily as blocks are looked up, so addresses that have not been
+    // looked up yet (and any past the end) are UNKNOWN_ADDRESS. Updated
+    // whenever the file's blocks are reserved or freed.
+    std::vector<int32_t> block_map = {};
+
+    // Guards block_map, which is filled also by readers that only hold
+    // the lock shared.
+    std::mutex block_map_mutex;
+
+    static constexpr int32_t UNKNOWN_ADDRESS = -2;
+
+    // Data written to the file that has not been given data blocks yet
+    // (see MountOptions::write_buffer_size). It replaces the file's bytes
+    // from buffer_pos on, and can continue past the end of the i-node's
+    // size. Guarded by lock.
+    size_t buffer_pos = 0;
+    std::vector<char> buffer = {};
+
+    // The free data blocks claimed for writing the buffer.
+    unsigned int buffer_blocks = 0;
+
+    // Changed by every write and truncation, so that read-ahead buffers
+    // can tell whether they are still up to date. Guarded by lock.
+    uint64_t version = 0;
+
+    // The number of read views of the file that have not been released
+    // (see FFSys::read_view). While there are any, the blocks that the
+    // file no longer needs are not freed, but free_pending is set, so
+    // that a view never points to a block given to another file.
+    std::atomic<unsigned int> n_views = 0;
+    bool free_pending = false;
+
+    // The size of the file including the buffered data.
+    uint64_t size() const
+    {
+        return std::max<uint64_t>(inode.size, buffer_pos + buffer.size());
+    }
+
+    CachedINode(INode const& inode_p):
+        inode(inode_p) {}
+};
+
 /**
  * Describes the details of an open file in our simulated filesystem.
  */
@@ -42,10 +117,82 @@ struct OpenFile {
     unsigned int inode;
 
     // Current byte position in the file (from start of file).
-    unsigned int pos;
+    size_t pos;
+
+    // Held while using pos, so that the reads and writes through one file
+    // descriptor happen one at a time. Also guards the read-ahead below.
+    std::mutex pos_mutex;
+
+    // Where the previous read ended. A read that starts there is taken as
+    // sequential, and grows the read-ahead window (see
+    // MountOptions::read_ahead_size), while any other read shrinks it back
+    // to nothing.
+    size_t next_read_pos;
+    size_t read_ahead_window = 0;
+
+    // The bytes of the file from read_ahead_pos on, as they were when the
+    // file's version was read_ahead_version.
+    size_t read_ahead_pos = 0;
+    uint64_t read_ahead_version = 0;
+    std::vector<char> read_ahead = {};
+
+    // The file's i-node and block addresses.
+    std::shared_ptr<CachedINode> cached;
+
+    OpenFile(file_descriptor fd_p, unsigned int inode_p, size_t pos_p,
+             std::shared_ptr<CachedINode> cached_p):
+        fd(fd_p), inode(inode_p), pos(pos_p), next_read_pos(pos_p), cached(cached_p) {}
+};
 
-    OpenFile(file_descriptor fd_p, unsigned int inode_p, unsigned int pos_p):
-        fd(fd_p), inode(inode_p), pos(pos_p) {}
+/**
+ * One buffer of a vectored read or write (see FFSys::readv and
+ * FFSys::writev), like struct iovec.
+ */
+struct IOVec {
+    char* base;
+    size_t len;
+};
+
+/**
+ * The outcome of a read or write started with FFSys::submit_read or
+ * FFSys::submit_write. result is what pread or pwrite would have
+ * returned, and error the error code if it is -1.
+ */
+struct Completion {
+    uint64_t id;
+    ssize_t result;
+    ErrorNumber error;
+};
+
+/**
+ * One entry of a directory, as returned by FFSys::list_directory.
+ */
+struct DirEntry {
+    std::string name;
+    unsigned int inode;
+    bool directory;
+};
+
+/**
+ * Bytes of a file returned by FFSys::read_view without copying them. The
+ * spans point straight into the blocks of the block cache, or into the
+ * memory map of the FFSys file, and stay valid until the view is given
+ * to FFSys::release_view (or to read_view again). Must not be copied.
+ */
+struct ReadView {
+    // The bytes of the view in file order, one span per part that is
+    // contiguous in memory.
+    std::vector<std::span<const char>> spans = {};
+
+    // Keeps the file's blocks from being freed while the view is held.
+    std::shared_ptr<CachedINode> file = nullptr;
+
+    // The blocks pinned in the cache for the spans.
+    std::vector<unsigned int> pinned_blocks = {};
+
+    // Bytes that are not in any block (of a file with inline data) are
+    // copied here.
+    std::vector<char> copied = {};
 };
 
 /**
@@ -62,11 +209,89 @@ enum OpenFlags {
     END = 0x04,
 };
 
+/**
+ * Options that affect how an FFSys file is accessed while it is mounted.
+ * They are not stored in the file.
+ */
+struct MountOptions {
+    // How the FFSys file is accessed, see StorageBackend.
+    StorageBackend storage = StorageBackend::FSTREAM;
+
+    // How many blocks the write-back block cache may hold. Dirty blocks
+    // are written to the file when evicted, on sync() and on unmount.
+    // 0 disables the cache, which suits the MMAP storage, since it only
+    // copies memory anyway.
+    size_t cache_capacity = 256;
+
+    // Whether files created while mounted map their blocks with extents
+    // (runs of consecutive blocks) instead of one address per block.
+    // Existing files keep the layout they were created with.
+    bool extents = true;
+
+    // Whether files created while mounted keep their contents inside the
+    // i-node until they grow past INLINE_DATA_SIZE bytes, instead of
+    // getting a data block right away. Reading such a file needs no I/O
+    // besides its i-node, which an open file has cached.
+    bool inline_data = true;
+
+    // How the runs of blocks that one read or write transfers straight to
+    // the file are carried out, see IOEngineType. Other than SYNC, the runs
+    // are in flight at the same time.
+    IOEngineType io_engine = IOEngineType::SYNC;
+
+    // How many bytes of small writes are collected in memory per open file
+    // before they are given data blocks and written (also on close, fsync
+    // and sync). Delaying the allocation lets a run of small appends get
+    // one run of blocks, and one write of the i-node and bitmaps. Writes at
+    // least this large are not buffered. 0 disables the buffering.
+    size_t write_buffer_size = 64 * 1024;
+
+    // The most that read and readv read ahead per open file. Sequential
+    // small reads are served from an in-memory copy of the bytes that
+    // follow them, which is refilled with one read of the file when they
+    // run past it. The window starts at 4 blocks and doubles with each
+    // sequential read up to this. 0 disables read-ahead.
+    size_t read_ahead_size = 128 * 1024;
+
+    // Whether a newly created file gets a journal for its metadata. Only
+    // used when creating a file. With a journal, the block cache is
+    // always used, even if cache_capacity is 0.
+    bool journal = true;
+
+    // How many block groups a newly created file is divided into. Each
+    // group has 8 * block size data blocks and i-nodes (8 MiB of data with
+    // 1 KiB blocks), and bitmaps of its own. Only used when creating a
+    // file.
+    unsigned int block_groups = 1;
+
+    // How many directory entries are kept in memory, so that opening a
+    // path again does not read its directories. 0 disables the cache.
+    size_t dentry_cache_size = 4096;
+
+    // Whether calls are counted and timed for FFSys::get_stats(). Costs a
+    // few atomic additions and two clock reads per call and primitive.
+    bool stats = true;
+
+    // How many worker threads the THREAD_POOL engine uses, and how many
+    // run the reads and writes started with submit_read and submit_write.
+    unsigned int io_threads = 4;
+};
+
 /**
  * The objects of the FFSys (File FileSystem) class provide an interface
  * for creating, reading and writing files into a filesystem that lives in
  * a single actual file. The filesystem is based mainly on the EXT2 filesystem.
  * An object of this class represents a single FFileSystem.
+ *
+ * The public methods can be called from many threads at once. Each open
+ * file has a reader/writer lock, so reads of the same or different files
+ * run in parallel, and only writes (and truncation) of the same file
+ * exclude each other. The i-node and data block allocators, the file
+ * names and the block cache each have a lock of their own.
+ *
+ * The locks are always taken in this order: transaction, file descriptor,
+ * file, file's block addresses, names, i-node allocator, data block
+ * allocator, block cache.
  */
 class FFSys
 {
@@ -76,24 +301,43 @@ public:
      * Creates and mounts a new FFSys file.
      * @param path The path to create the file at.
      * @param block_size Specifies the block_size to use in the file.
+     * @param options Mount time options, see MountOptions.
      * @throws std::string, if the file could not be created.
      */
-    FFSys(std::string path, unsigned long block_size);
+    FFSys(std::string path, unsigned long block_size, MountOptions options = {});
 
     /**
      * Mounts the given FFSys file.
      * @param path The path of the file.
+     * @param options Mount time options, see MountOptions.
      * @throws std::string, if the file could not be opened.
      */
-    FFSys(std::string path);
+    FFSys(std::string path, MountOptions options = {});
 
     ~FFSys();
 
     /**
-     * Tries to open the file with the given name. Flags are used to specify
-     * how to open the file (see enum OpenFlags).
+     * Tries to open the file at the given path. Flags are used to specify
+     * how to open the file (see enum OpenFlags). A path is a list of names
+     * separated by '/', each of a directory in the previous one, starting
+     * from the root directory whether or not the path starts with '/'.
+     * The names "." and ".." refer to the directory itself and its parent.
+     * Only the last name of the path is created, directories have to
+     * exist already (see mkdir).
      */
-    file_descriptor open(std::string filename, int flags = 0);
+    file_descriptor open(std::string path, int flags = 0);
+
+    /**
+     * Creates a directory at the given path. Its parent directory has to
+     * exist.
+     */
+    bool mkdir(std::string path);
+
+    /**
+     * Replaces the contents of entries with the entries of the directory at
+     * the given path, in no particular order.
+     */
+    bool list_directory(std::string path, std::vector<DirEntry>& entries);
 
     /**
      * Tries to read count number of bytes from the file referred to
@@ -111,105 +355,624 @@ public:
      */
     ssize_t write(file_descriptor fd, char* buffer, size_t count);
 
+    /**
+     * Like read, but fills the iovcnt buffers of iov one after another,
+     * as if they were one buffer.
+     */
+    ssize_t readv(file_descriptor fd, IOVec const* iov, int iovcnt);
+
+    /**
+     * Like write, but writes the contents of the iovcnt buffers of iov
+     * one after another, as if they were one buffer. The blocks are
+     * looked up and the i-node is updated only once for all of them.
+     */
+    ssize_t writev(file_descriptor fd, IOVec const* iov, int iovcnt);
+
+    /**
+     * Like read, but reads starting from the given offset in the file,
+     * and does not use or move the file position. Calls on the same file
+     * descriptor do not wait for each other.
+     */
+    ssize_t pread(file_descriptor fd, char* buffer, size_t count, size_t offset);
+
+    /**
+     * Like pread, but instead of copying the bytes, returns them in view
+     * as spans into the blocks that hold them. The blocks stay pinned in
+     * the cache (or mapped, with StorageBackend::MMAP) until the view is
+     * released with release_view, which has to be done before unmount.
+     * Writes made to the range while the view is held may or may not show
+     * in it. Returns the number of bytes in the view, which can be less
+     * than count at the end of the file, or -1 if an error occurred.
+     */
+    ssize_t read_view(file_descriptor fd, size_t offset, size_t count, ReadView& view);
+
+    /**
+     * Releases the blocks of a view returned by read_view, and empties it.
+     * Does nothing to an empty view.
+     */
+    void release_view(ReadView& view);
+
+    /**
+     * Like write, but writes starting from the given offset in the file,
+     * and does not use or move the file position. An offset past the end
+     * of the file leaves a hole (see seek).
+     */
+    ssize_t pwrite(file_descriptor fd, char* buffer, size_t count, size_t offset);
+
+    /**
+     * Reserves data blocks for the bytes [offset, offset + len) of the
+     * file, so that writing them later does not need to allocate, and
+     * the blocks are as contiguous as possible. The file size does not
+     * change. Returns false if there was not enough space, in which case
+     * the blocks reserved before running out are kept.
+     */
+    bool fallocate(file_descriptor fd, size_t offset, size_t len);
+
+    /**
+     * Sets the size of the file. Shrinking frees the data blocks past the
+     * new end, growing leaves a hole that reads as zeros (see seek). The
+     * file position does not change. Returns false if the size is past the
+     * largest file, with INVALID_POSITION, or if the file's buffered writes
+     * did not fit before growing it.
+     */
+    bool truncate(file_descriptor fd, size_t size);
+
+    /**
+     * Starts a pread in the background and returns its id right away. The
+     * buffer must stay valid until the completion with that id has been
+     * returned by poll_completions or wait_completions.
+     */
+    uint64_t submit_read(file_descriptor fd, char* buffer, size_t count, size_t offset);
+
+    /**
+     * Starts a pwrite in the background, like submit_read.
+     */
+    uint64_t submit_write(file_descriptor fd, char* buffer, size_t count, size_t offset);
+
+    /**
+     * Moves the completions of the finished background reads and writes
+     * to the end of completions, without waiting. Returns how many
+     * were moved.
+     */
+    size_t poll_completions(std::vector<Completion>& completions);
+
+    /**
+     * Like poll_completions, but first waits until at least min_count
+     * completions are available (or all started reads and writes have
+     * finished, if fewer are in progress).
+     */
+    size_t wait_completions(std::vector<Completion>& completions, size_t min_count = 1);
+
     /**
      * Closes the file corresponding to the given file descriptor.
      * Returns true on success and false if an error occurred, in
      * which case errno is also set to indicate the reason for
-     * the error.
+     * the error. Buffered writes of the file are written first; if
+     * they do not fit, the descriptor is still closed, but false is
+     * returned.
      */
     bool close(file_descriptor fd);
 
     /**
      * Sets the file position of the corresponding file. Returns false
-     * if the position is larger than file size or the file descriptor
-     * is unknown.
+     * if the file descriptor is unknown. The position can be past the end
+     * of the file, in which case the next write leaves a hole between the
+     * end and the position: a part of the file that has no data blocks
+     * and reads as zeros.
      */
     bool seek(file_descriptor fd, size_t pos);
 
     /**
-     * Returns the current error code.
+     * Like lseek with SEEK_DATA and SEEK_HOLE: moves the file position to
+     * the start of the first data (or hole) at or after offset, and
+     * returns it. Holes are found in whole blocks, and the end of the
+     * file counts as a hole. Returns -1 if offset is not before the end
+     * of the file, or there is no data after it, with INVALID_POSITION.
+     */
+    ssize_t seek_data(file_descriptor fd, size_t offset);
+    ssize_t seek_hole(file_descriptor fd, size_t offset);
+
+    /**
+     * Writes the buffered writes of the file, and then like sync().
+     * Returns false if they did not fit or could not be written.
+     */
+    bool fsync(file_descriptor fd);
+
+    /**
+     * Writes all cached changes into the FFSys file. Returns false if
+     * the file could not be written. Also done automatically on unmount.
+     * With a journal, the changes are logged with one sequential write.
+     */
+    bool sync();
+
+    /**
+     * Returns the error code of the last failed call made by this thread.
      */
     ErrorNumber errnum();
 
+    /**
+     * Returns the call counts and latency histograms of the public
+     * operations and internal primitives, and the I/O, cache, journal and
+     * allocation counters, collected since mounting or the last
+     * reset_stats().
+     */
+    StatsSnapshot get_stats();
+    void reset_stats();
+
     // Printing functions to aid in testing
     void print_superblock();
     void print_all_files();
     void print_open_files();
+    void print_stats();
 
 private:
-    // File stream into an FFSys-file.
-    std::fstream fs_;
+    // Whether new files get the extent layout and inline data (see
+    // MountOptions).
+    bool use_extents_;
+    bool use_inline_data_;
+
+    // See MountOptions.
+    size_t write_buffer_size_;
+    size_t read_ahead_size_;
+
+    // Counters and latencies of the calls, see get_stats().
+    Stats stats_;
+
+    // Access to the FFSys-file.
+    Storage* storage_ = nullptr;
+    // Logs the block cache's changes, if the file has a journal.
+    Journal* journal_ = nullptr;
+    // Carries out the transfers that bypass the block cache.
+    IOEngine* io_engine_ = nullptr;
+    // Write-back cache for the blocks of storage_. All block, i-node and
+    // bitmap I/O goes through it.
+    BlockCache* cache_ = nullptr;
+
     // Superblock of the FFSys-file as a struct. Contains metadata about the FS.
+    // The free i-node counts are guarded by inode_alloc_mutex_ and the free
+    // data block counts by data_alloc_mutex_. The rest does not change.
     Superblock sb_ = {};
 
-    ErrorNumber errnum_ = ErrorNumber::NO_ERROR;
-
-    // Map of open files: file descriptor, file's inode and current file position.
-    std::map<file_descriptor, std::shared_ptr<OpenFile>> open_files_ = {};
-
-    // Helper bitmaps
-    Bitmap* inode_bitmap_ = nullptr;
-    Bitmap* data_block_bitmap_ = nullptr;
+    // Whether sb_ has changed since it was last written.
+    std::atomic<bool> sb_dirty_ = false;
+
+    // Held shared by every call that changes the filesystem, until it
+    // has written its changes into the block cache, and exclusively while
+    // the cache's changes are committed to the journal, so that every
+    // transaction holds whole calls only.
+    std::shared_mutex transaction_mutex_;
+
+    // With a journal, the cache's changes are committed after a call once
+    // this many blocks are dirty, so that one commit (one sequential write)
+    // usually covers the changes of many calls.
+    size_t commit_threshold_ = 0;
+
+    // Like errno, the error code is kept per thread.
+    static thread_local ErrorNumber errnum_;
+
+    // Map of open files: file descriptor, file's inode and current file
+    // position. Split into shards by file descriptor, each with its own
+    // lock, so that calls on different descriptors rarely meet.
+    struct OpenFileShard {
+        std::shared_mutex mutex;
+        std::map<file_descriptor, std::shared_ptr<OpenFile>> files = {};
+    };
+    static constexpr unsigned int N_OPEN_FILE_SHARDS = 16;
+    std::array<OpenFileShard, N_OPEN_FILE_SHARDS> open_files_ = {};
+
+    // Held while choosing a new file descriptor.
+    std::mutex fd_alloc_mutex_;
+
+    // Guards the directories, dentries_ and cached_inodes_.
+    std::mutex names_mutex_;
+
+    // The cached i-nodes of open files by i-node number. An entry lives as
+    // long as one of the file's descriptors is open.
+    std::map<unsigned int, std::weak_ptr<CachedINode>> cached_inodes_ = {};
+
+    // The directory entries looked up lately.
+    DentryCache* dentries_ = nullptr;
+
+    // The descriptors and helper bitmaps of the block groups. A file
+    // without FEATURE_BLOCK_GROUPS is one group, described by its
+    // superblock. The i-node bitmaps and free i-node counts are guarded
+    // by inode_alloc_mutex_, the data block ones by data_alloc_mutex_.
+    // The rest does not change.
+    std::vector<GroupDescriptor> groups_ = {};
+    std::vector<Bitmap*> inode_bitmaps_ = {};
+    std::vector<Bitmap*> data_block_bitmaps_ = {};
+    std::mutex inode_alloc_mutex_;
+    std::mutex data_alloc_mutex_;
+
+    // The groups whose bitmaps and descriptors have changed since they
+    // were last written, and the groups the previous i-node and data block
+    // were reserved from. Guarded like the bitmaps.
+    std::set<unsigned int> dirty_inode_groups_ = {};
+    std::set<unsigned int> dirty_data_groups_ = {};
+    unsigned int inode_group_hint_ = 0;
+    unsigned int data_group_hint_ = 0;
+
+    // The free data blocks claimed by write buffers, which are not given
+    // to other writes. Guarded by data_alloc_mutex_.
+    size_t n_buffered_blocks_ = 0;
+
+    // Runs the reads and writes started with submit_read and submit_write.
+    // Created on the first one.
+    unsigned int n_async_threads_;
+    ThreadPool* async_pool_ = nullptr;
+
+    // Guards everything below, and async_pool_ while it is created.
+    std::mutex async_mutex_;
+    std::condition_variable async_cv_;
+    uint64_t next_async_id_ = 0;
+    size_t n_async_in_progress_ = 0;
+    std::vector<Completion> async_completions_ = {};
 
     // Helper buffer for initializing new address blocks (filled with -1).
     int32_t* empty_address_block_buffer = nullptr;
 
+    // Commits the block cache's changes to the journal if there are
+    // enough of them. Called after each call that changes the filesystem,
+    // without transaction_mutex_ held.
+    void commit_if_due();
+
+    // Runs operation on the async pool and records its completion.
+    uint64_t submit(std::function<ssize_t()> operation);
+
+    // Creates the I/O engine, the journal (if the file has one) and the
+    // block cache.
+    void init_cache(MountOptions const& options);
+
+    // Finds the open file of the given descriptor, or returns nullptr.
+    std::shared_ptr<OpenFile> get_open_file(file_descriptor fd);
+
+    // Gives the file the lowest free file descriptor and adds it to the
+    // open files.
+    file_descriptor add_open_file(unsigned int inode, size_t pos, std::shared_ptr<CachedINode> cached);
+
     // Reads count n bytes from the i:th block of the file,
     // into the given buffer, starting from n bytes offset into the block.
+    // The range may continue over the following blocks.
     bool read_block(unsigned int block_i, char* block_buffer, size_t count, size_t offset = 0);
 
     // Reads the whole i:th block of the file into the given buffer.
     bool read_block(unsigned int block_i, char* block_buffer);
 
-    // Writes i:th block.
-    void write_block(unsigned int block_i, char* block_buffer, size_t count, size_t offset = 0);
-    void write_block(unsigned int block_i, char* block_buffer);
+    // Writes i:th block. Like with reading, the range may continue
+    // over the following blocks.
+    bool write_block(unsigned int block_i, char* block_buffer, size_t count, size_t offset = 0);
+    bool write_block(unsigned int block_i, char* block_buffer);
 
     // Reading and writing i-nodes.
     bool read_inode(int inode_i, INode& result);
     void write_inode(INode& inode);
 
-    // Reading and writing Superblock.
+    // Reading and writing Superblock. The superblock of a file without
+    // FEATURE_BLOCK_GROUPS is read as one group, and written back in the
+    // same form.
     bool read_superblock(Superblock& result);
     void write_superblock();
 
-    // Tries to create a file of the given name (reserves + initializes i-node)
-    bool create_file(std::string name, INode& result);
-
-    // Tries to find a file with the given name.
-    bool find_file(std::string name, INode& result);
+    // Reads the group descriptors and the bitmaps of the groups, and
+    // recounts their free i-nodes and data blocks from the bitmaps.
+    void load_groups();
+    void write_group_descriptor(unsigned int group);
+
+    // Writes the changed part of the bitmap into its block.
+    void write_bitmap_changes(Bitmap& bitmap, unsigned int block_i);
+
+    // Checks whether the i:th i-node is free from its group's bitmap.
+    bool is_inode_free(unsigned int i);
+
+    // The block index of the i:th data block, and the number of data
+    // blocks from it to the end of its group. Only data blocks within one
+    // group follow each other in the FFSys file.
+    unsigned int data_block_i(int32_t i);
+    unsigned int blocks_left_in_group(int32_t i);
+
+    // Writes the superblock and the changed parts of the bitmaps into the
+    // block cache, if they have changed. Reserving and freeing i-nodes and
+    // blocks only changes them in memory, and they are written with this
+    // once at the end of each operation that changes them, and on sync().
+    //
+    // With a journal, the cache's changes reach the FFSys file as whole
+    // transactions, so a crash leaves the metadata as it was after some
+    // call. Without one, like the rest of the block cache, they reach the
+    // FFSys file only on sync(), unmount or eviction. Blocks are flushed in
+    // block order, so the superblock and a group's bitmaps go before the
+    // i-nodes and addresses in the group that refer to them: a crash in
+    // between can leave reserved blocks that no file uses, but not blocks
+    // used by a file of the same group that are marked free, unless they
+    // were freed since the last sync. The free counts in the superblock
+    // and the group descriptors are recounted from the bitmaps on mount.
+    void flush_metadata();
+
+    // Tries to create a file (or directory) of the given name in the
+    // directory of the given i-node (reserves + initializes i-node, and
+    // adds it to the directory).
+    bool create_file(std::string name, unsigned int directory, INode& result, bool is_directory = false);
+
+    // Frees an i-node reserved with reserve_inode.
+    void free_inode(int i);
+
+    // Finds the directory that the last name of the path is in, and that
+    // name. The name is empty if the path ends in a directory itself
+    // (like "/", "a/." or "a/.."), in which case directory is that one.
+    bool resolve_parent(std::string const& path, unsigned int& directory, std::string& name);
+
+    // Finds the i-node of the name in the directory, from the dentry cache
+    // or the directory's index. -1 if there is no such entry.
+    int lookup(unsigned int directory, std::string const& name);
+
+    // The longest name a directory entry can have. Limited by the block
+    // size, so that a full leaf block can always be split in two.
+    unsigned int max_name_length();
+
+    // Initializes the i-node as an empty directory in parent: the root
+    // index block and one leaf block.
+    bool init_directory(INode& inode, unsigned int parent);
+
+    // Creates the root directory of a new file, or of an older file that
+    // is upgraded.
+    void create_root_directory();
+
+    // Reads and writes the i:th block of a directory. Writing reserves the
+    // block if it does not have one yet.
+    bool read_directory_block(INode const& directory, unsigned int i, char* buffer);
+    bool write_directory_block(INode& directory, unsigned int i, char* buffer);
+
+    // An index node passed on the way from a directory's root to one of
+    // its leaf blocks: the directory block it is in, and the position of
+    // the entry that was followed.
+    struct IndexStep {
+        unsigned int block;
+        unsigned int position;
+    };
+
+    // Finds the leaf block of the directory whose range of hashes has
+    // hash, and the index nodes on the way to it. root holds the
+    // directory's first block.
+    bool find_leaf(INode const& directory, char* root, uint32_t hash, std::vector<IndexStep>& path,
+                   unsigned int& leaf);
+
+    // Finds the name in the directory's index. -1 if it is not there.
+    int find_entry(INode const& directory, std::string const& name);
+
+    // Adds the entry to the directory's index, splitting the leaf block
+    // and the index blocks on the way that are full.
+    bool add_entry(INode& directory, std::string const& name, unsigned int inode, bool is_directory);
+
+    // Adds the entries in the directory's leaf blocks to entries.
+    bool read_entries(INode const& directory, std::vector<DirEntry>& entries);
+
+    // Puts the files of a file made before directories into a new root
+    // directory.
+    void upgrade_directories();
+
+    // Clears the flags byte of all i-nodes in files made before it existed.
+    void upgrade_inode_flags();
+
+    // Gets the cached i-node of the given file, shared with the file's
+    // other open file descriptors. names_mutex_ must be held.
+    std::shared_ptr<CachedINode> get_cached_inode(INode const& inode);
+
+    // Drops the cached i-node of the given file once nothing refers to it
+    // anymore. Takes names_mutex_.
+    void release_cached_inode(unsigned int inode);
 
     // Reading and writing files. Internal helpers for read() and
-    // write() respectively.
-    size_t read_n_bytes_from_file(INode const& file, char* buffer, size_t count, size_t pos = 0);
-    size_t write_n_bytes_to_file(INode& file, char* buffer, size_t count, size_t pos = 0);
+    // write() respectively. Return -1 with IO_ERROR if the FFSys file
+    // could not be read or written.
+    ssize_t read_n_bytes_from_file(CachedINode& file, char* buffer, size_t count, size_t pos = 0);
+    ssize_t write_n_bytes_to_file(CachedINode& file, char* buffer, size_t count, size_t pos = 0);
+
+    // Same as above, but for the buffers of readv() and writev().
+    ssize_t read_n_bytes_from_file(CachedINode& file, IOVec const* iov, int iovcnt, size_t pos);
+
+    // Reads from the file position of the open file into the buffers, using
+    // and updating its read-ahead. file.pos_mutex must be held, and the
+    // file's lock at least shared.
+    ssize_t read_at_position(OpenFile& file, IOVec const* iov, int iovcnt);
+    ssize_t write_n_bytes_to_file(CachedINode& file, IOVec const* iov, int iovcnt, size_t pos);
+
+    // Implements seek_data and seek_hole.
+    ssize_t seek_data_or_hole(file_descriptor fd, size_t offset, bool hole);
+
+    // Finds the first position from pos on that is in data of the file
+    // (or in a hole, if hole is set), or file.size() if there is none.
+    // Returns false with IO_ERROR if the file's addresses could not be
+    // read. file.lock must be held at least shared.
+    bool find_data(CachedINode& file, size_t pos, bool hole, size_t& found);
+
+    // Writes zeros over the bytes [begin, end) of the file that are in
+    // its data blocks, skipping holes. Used where the file grows over
+    // blocks it has reserved past its end, whose old contents must not
+    // show. Returns false with IO_ERROR if they could not be written.
+    bool zero_file_range(CachedINode& file, size_t begin, size_t end);
+
+    // Implements truncate for a file locked exclusively. Also used by open
+    // with TRUNCATE.
+    bool truncate_file(CachedINode& file, size_t size);
+
+    // Adds ranges that write count zeros to the blocks from block_i on,
+    // starting offset bytes in.
+    void add_zero_ranges(std::vector<BlockCache::Range>& ranges, unsigned int block_i, size_t offset, size_t count);
+
+    // Writes through the file's write buffer: the data is added to the
+    // buffer if it continues the buffered data and fits, and otherwise the
+    // buffer is flushed first (and the data is buffered, if it is small,
+    // or written). Returns the number of bytes written, which is 0 if the
+    // buffer could not be flushed, or -1 if writing failed. file.lock must
+    // be held exclusively.
+    ssize_t buffered_write(CachedINode& file, IOVec const* iov, int iovcnt, size_t pos);
+
+    // Gives the buffered data of the file blocks and writes it. Returns
+    // false if not all of it fit, leaving the rest in the buffer. file.lock
+    // must be held exclusively.
+    bool flush_write_buffer(CachedINode& file);
+
+    // Claims enough free data blocks for the file's buffer to take count
+    // more bytes at pos, so that they can not run out before the buffer is
+    // written. Returns false if there are not enough of them left.
+    bool claim_buffer_blocks(CachedINode& file, size_t pos, size_t count);
+    void release_buffer_blocks(CachedINode& file);
+
+    // Flushes the write buffers of all open files.
+    bool flush_write_buffers();
 
     // Helpers that reserve/free bits from the corresponding bitmaps, and
     // update the changes to the FFSys file.
     int reserve_inode();
-    int reserve_data_block();
+    int reserve_data_block(int goal = -1);
     bool free_data_block(int i);
 
+    // Frees the count data blocks starting from first, with one bitmap
+    // update per group. Returns how many of them were reserved.
+    unsigned int free_data_blocks(int first, unsigned int count);
+
+    // Frees the given data blocks in runs of consecutive ones. Sorts them.
+    void free_data_blocks(std::vector<int32_t>& blocks);
+
+    // Reserves up to wanted data blocks in a row, see Bitmap::reserve_run.
+    // They are taken from the group of goal if goal is free, and otherwise
+    // from the first group onwards from it (or from the previously used
+    // group) with wanted free blocks, or the group with the most.
+    int reserve_data_blocks(unsigned int wanted, unsigned int& length, int goal);
+
+    // Chooses the group of a new i-node: onwards from the previously used
+    // group, the first one with free i-nodes and at least the average
+    // number of free data blocks, so that the file's data can stay in the
+    // same group. Called with inode_alloc_mutex_ held.
+    unsigned int choose_inode_group();
+
+    // Chooses the group for reserve_data_blocks. Called with
+    // data_alloc_mutex_ held.
+    unsigned int choose_data_group(unsigned int wanted, int goal);
+
+    // Moves the contents of a file with inline data into its first data
+    // block, and gives it the block layout of its flags. Returns false if
+    // there was no free data block, in which case the file stays inline.
+    bool move_inline_data(CachedINode& file);
+
     // Helpers for reserving/freeing file blocks,
     int reserve_file_block(INode& inode, unsigned int i);
     bool free_file_block(INode& inode, unsigned int i);
-    void free_unused_file_blocks(INode& inode);
+    void free_unused_file_blocks(CachedINode& file);
+
+    // Reserves data blocks for the count file blocks from first on, which
+    // must not have any yet, in as few runs as possible. Returns how many
+    // were reserved before running out of space. If zero, the blocks are
+    // filled with zeros, for holes that are filled without being written.
+    unsigned int reserve_file_blocks(CachedINode& file, unsigned int first, unsigned int count, bool zero = false);
+
+    // Reserves data blocks for the file blocks from first to last that do
+    // not have one. Returns the first file block that is still missing
+    // one (or whose address could not be read), or last + 1.
+    unsigned int reserve_missing_file_blocks(CachedINode& file, unsigned int first, unsigned int last, bool zero = false);
 
     // Reserves a data block for use as an address block (block filled
     // with addresses of other data blocks), and fills it up with null
     // addresses (-1).
     int initialize_address_block();
 
-    // Low-level helpers for setting/getting a file block address.
+    // Low-level helpers for setting/getting a file block address. Getting
+    // gives -1 for a block that has no data block. Both return false (with
+    // IO_ERROR, if no block was missing) when an address block cannot be
+    // read.
     bool set_file_block_address(INode& inode, unsigned int i, int32_t new_value);
-    int get_file_block_address(INode const& inode, unsigned int i);
-
-    // Helper print function
-    void print_inode(ffsys::INode& inode);
+    bool get_file_block_address(INode const& inode, unsigned int i, int& address);
+
+    // Sets the addresses of the count file blocks from i on to the data
+    // blocks from address on, with one update of the extents if the file
+    // has them. Returns how many were set before running out of space.
+    unsigned int set_file_block_run(INode& inode, unsigned int i, int32_t address, unsigned int count);
+
+    // Where the address of a file block is kept: the slot of
+    // INode::blocks, and the index at each of the depth address blocks
+    // below it.
+    struct AddressPath {
+        int slot;
+        unsigned int depth;
+        unsigned int indices[3];
+    };
+
+    // Finds the path to the address of the i:th file block. False if the
+    // file cannot have that many blocks.
+    bool get_address_path(INode const& inode, unsigned int i, AddressPath& path);
+
+    // Reads/writes one address of an address block. Reading returns false
+    // with IO_ERROR if the address block cannot be read.
+    bool read_address(int32_t address_block, unsigned int index, int32_t& address);
+    void write_address(int32_t address_block, unsigned int index, int32_t value);
+
+    // Clears the addresses of the blocks from last_block on, and adds
+    // them and the address blocks that only map such blocks to freed.
+    void free_unused_address_blocks(INode& inode, unsigned int last_block, std::vector<int32_t>& freed);
+
+    // Does the same for the tree under address, whose first mapped file
+    // block is first. Each address block is read once, and written once
+    // if it is kept but had addresses cleared. Sets address to -1 if it
+    // was freed itself.
+    void free_address_tree(int32_t& address, unsigned int depth, uint64_t first, uint64_t last_block,
+                           std::vector<int32_t>& freed);
+
+    // Gets the address of the i:th data block of the file (-1 if it has
+    // none), and in run_length the number of blocks (at most max_count)
+    // from it on that lie one after another in the data blocks. Returns
+    // false with IO_ERROR if the address could not be read.
+    bool get_file_block_run(INode const& inode, unsigned int i, unsigned int max_count, int& address,
+                            unsigned int& run_length);
+
+    // Same as above, but uses and fills the cached block addresses.
+    bool get_file_block_run(CachedINode& file, unsigned int i, unsigned int max_count, int& address,
+                            unsigned int& run_length);
+
+    // Counts the data blocks reserved for the file's contents.
+    unsigned int count_file_blocks(INode const& inode);
+
+    // Finds the first file block from i on, before end, that has a data
+    // block, or end if there is none. Skips the holes of a sparse file a
+    // missing address block (or extent) at a time. Returns false with
+    // IO_ERROR if the addresses could not be read.
+    bool find_mapped_block(INode const& inode, unsigned int i, unsigned int end, unsigned int& next);
+
+    // Same as above, but skips the holes known in the cached block
+    // addresses, and only looks up the blocks that are not known yet.
+    bool find_mapped_block(CachedINode& file, unsigned int i, unsigned int end, unsigned int& next);
+
+    // The largest size the file can grow to with its layout.
+    uint64_t max_file_size(INode const& inode);
+
+    // The most blocks a file with block addresses can have.
+    unsigned int max_address_mapped_blocks(INode const& inode);
+
+    // Helpers for files with the extent layout (INODE_EXTENTS).
+    // How many extents each overflow block holds in a list of count
+    // extents. A list that fits into one block fills it (as before the
+    // blocks were chained), and a longer one leaves room at the end of
+    // each block for the address of the next.
+    unsigned int extents_per_block(size_t count);
+    bool read_extents(INode const& inode, std::vector<Extent>& result);
+
+    // Gets the addresses of the file's overflow blocks in order.
+    bool read_overflow_chain(ExtentList const& list, std::vector<int32_t>& chain);
+
+    // Writes the extents of the file, in place of the old ones read from
+    // it. Overflow blocks whose contents did not change are not written.
+    bool write_extents(INode& inode, std::vector<Extent> const& extents, std::vector<Extent> const& old);
+
+    // Maps the count file blocks from i on to the data blocks from address
+    // on, or unmaps them if address is -1.
+    bool set_extent_run(INode& inode, unsigned int i, int32_t address, unsigned int count);
+    bool get_extent_address(INode const& inode, unsigned int i, unsigned int max_count, int& address,
+                            unsigned int& run_length);
+    void free_unused_extents(INode& inode, unsigned int first_unused);
+
+    // Helper print functions
+    void print_inode(ffsys::INode& inode, std::string const& path);
+    void print_directory(ffsys::INode& directory, std::string const& path);
 
     // CONSTANTS
-    static constexpr char NULL_CHAR = '\0';
-
     // Superblock is always the first block.
     static constexpr unsigned long SUPERBLOCK_I = 0;
 };
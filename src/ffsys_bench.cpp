@@ -0,0 +1,552 @@
+/**
+ * This module is a benchmark driver for the ffsys::FFSys class. Each
+ * benchmark formats a new FFSys file with the given parameters, runs its
+ * operations and prints one line of results: the number of operations,
+ * operations and megabytes per second, and latency percentiles of a
+ * single operation.
+ *
+ * Usage: ffsys_bench [options] [benchmark ...], "ffsys_bench --help" lists
+ * both. Without benchmark names, all of them are run.
+ */
+#include "ffsys.hh"
+#include "utilities.hh"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <random>
+
+using namespace std;
+
+namespace {
+
+using Clock = chrono::steady_clock;
+
+struct Params {
+    string path = "ffsys_bench.ffsys";
+    unsigned int block_size = 4096;
+
+    // Size of the file of the sequential, random and truncate benchmarks.
+    size_t file_size = 16 << 20;
+
+    // Size and count of the files of the create benchmark. The fill
+    // benchmark also writes files of small_size.
+    size_t small_size = 16 << 10;
+    unsigned int n_files = 1000;
+
+    // Bytes per read or write call.
+    size_t io_size = 4096;
+
+    // Number of operations of the open and random benchmarks.
+    unsigned int n_ops = 10000;
+
+    // How full (in percent of the data blocks) the filesystem is made
+    // before a benchmark starts.
+    unsigned int fill = 0;
+
+    unsigned int seed = 1;
+    ffsys::MountOptions options = {};
+};
+
+/**
+ * The timings of one benchmark.
+ */
+struct Result {
+    // Latency of each operation in nanoseconds.
+    vector<double> latencies = {};
+
+    // Bytes read or written by the operations.
+    size_t bytes = 0;
+
+    // Wall time of the whole benchmark, including a final sync.
+    double seconds = 0;
+};
+
+// Runs op and adds its latency to result.
+template <typename Operation>
+void time_op(Result& result, Operation op)
+{
+    auto start = Clock::now();
+    op();
+    result.latencies.push_back(chrono::duration<double, nano>(Clock::now() - start).count());
+}
+
+double percentile(vector<double> const& sorted, double p)
+{
+    if (sorted.empty()) {
+        return 0;
+    }
+    size_t i = min(sorted.size() - 1, (size_t)(p / 100 * sorted.size()));
+    return sorted[i];
+}
+
+void print_header()
+{
+    printf("%-12s %9s %11s %9s %9s %9s %9s %10s\n",
+           "benchmark", "ops", "ops/s", "MB/s", "p50 us", "p90 us", "p99 us", "max us");
+}
+
+void print_result(string const& name, Result result)
+{
+    sort(result.latencies.begin(), result.latencies.end());
+    size_t n = result.latencies.size();
+    double seconds = max(result.seconds, 1e-9);
+
+    printf("%-12s %9zu %11.0f %9.1f %9.1f %9.1f %9.1f %10.1f\n",
+           name.c_str(), n, n / seconds, result.bytes / seconds / 1e6,
+           percentile(result.latencies, 50) / 1000, percentile(result.latencies, 90) / 1000,
+           percentile(result.latencies, 99) / 1000, n > 0 ? result.latencies.back() / 1000 : 0.0);
+}
+
+// The bytes of data blocks in a new FFSys file.
+size_t data_capacity(Params const& params)
+{
+    return (size_t)8 * params.block_size * params.block_size * params.options.block_groups;
+}
+
+// Formats a new FFSys file and fills params.fill percent of its data
+// blocks with files written a piece at a time in turns, so that the free
+// space left is scattered like on a used filesystem.
+ffsys::FFSys* make_fs(Params const& params)
+{
+    ffsys::FFSys* fs = new ffsys::FFSys(params.path, params.block_size, params.options);
+
+    size_t capacity = data_capacity(params);
+    size_t to_fill = capacity / 100 * params.fill;
+    const size_t piece = 4 * params.block_size;
+    vector<char> data(piece, 'f');
+
+    vector<ffsys::file_descriptor> fds;
+    for (unsigned int i = 0; i < 8; ++i) {
+        fds.push_back(fs->open("fill" + to_string(i), ffsys::OpenFlags::CREATE));
+    }
+
+    for (size_t filled = 0; filled < to_fill; filled += piece) {
+        if (fs->write(fds[(filled / piece) % fds.size()], data.data(), piece) != (ssize_t)piece) {
+            break;
+        }
+    }
+
+    for (ffsys::file_descriptor fd : fds) {
+        fs->close(fd);
+    }
+    fs->sync();
+    return fs;
+}
+
+// Writes a file of params.file_size bytes for the read benchmarks.
+void write_test_file(ffsys::FFSys& fs, Params const& params, string const& name)
+{
+    ffsys::file_descriptor fd = fs.open(name, ffsys::OpenFlags::CREATE);
+    vector<char> data(params.io_size, 'd');
+    for (size_t written = 0; written < params.file_size; written += data.size()) {
+        fs.write(fd, data.data(), min(data.size(), params.file_size - written));
+    }
+    fs.close(fd);
+    fs.sync();
+}
+
+// Opens and closes existing files in random order.
+Result bench_open(Params const& params)
+{
+    ffsys::FFSys* fs = make_fs(params);
+    for (unsigned int i = 0; i < params.n_files; ++i) {
+        fs->close(fs->open("o" + to_string(i), ffsys::OpenFlags::CREATE));
+    }
+    fs->sync();
+
+    Result result;
+    mt19937 random(params.seed);
+    auto start = Clock::now();
+    for (unsigned int i = 0; i < params.n_ops; ++i) {
+        string name = "o" + to_string(random() % params.n_files);
+        time_op(result, [&] {
+            fs->close(fs->open(name));
+        });
+    }
+    result.seconds = chrono::duration<double>(Clock::now() - start).count();
+
+    delete fs;
+    return result;
+}
+
+// Creates, writes and closes files of params.small_size bytes.
+Result bench_create(Params const& params)
+{
+    ffsys::FFSys* fs = make_fs(params);
+    vector<char> data(params.small_size, 'c');
+
+    Result result;
+    auto start = Clock::now();
+    for (unsigned int i = 0; i < params.n_files; ++i) {
+        string name = "c" + to_string(i);
+        time_op(result, [&] {
+            ffsys::file_descriptor fd = fs->open(name, ffsys::OpenFlags::CREATE);
+            ssize_t written = fs->write(fd, data.data(), data.size());
+            fs->close(fd);
+            result.bytes += max(written, (ssize_t)0);
+        });
+    }
+    fs->sync();
+    result.seconds = chrono::duration<double>(Clock::now() - start).count();
+
+    delete fs;
+    return result;
+}
+
+Result bench_seq_write(Params const& params)
+{
+    ffsys::FFSys* fs = make_fs(params);
+    ffsys::file_descriptor fd = fs->open("seq", ffsys::OpenFlags::CREATE);
+    vector<char> data(params.io_size, 's');
+
+    Result result;
+    auto start = Clock::now();
+    for (size_t pos = 0; pos < params.file_size; pos += data.size()) {
+        size_t count = min(data.size(), params.file_size - pos);
+        time_op(result, [&] {
+            result.bytes += max(fs->write(fd, data.data(), count), (ssize_t)0);
+        });
+    }
+    fs->close(fd);
+    fs->sync();
+    result.seconds = chrono::duration<double>(Clock::now() - start).count();
+
+    delete fs;
+    return result;
+}
+
+Result bench_seq_read(Params const& params)
+{
+    ffsys::FFSys* fs = make_fs(params);
+    write_test_file(*fs, params, "seq");
+    ffsys::file_descriptor fd = fs->open("seq");
+    vector<char> buffer(params.io_size);
+
+    Result result;
+    auto start = Clock::now();
+    ssize_t read = 1;
+    while (read > 0) {
+        time_op(result, [&] {
+            read = fs->read(fd, buffer.data(), buffer.size());
+        });
+        result.bytes += max(read, (ssize_t)0);
+    }
+    result.seconds = chrono::duration<double>(Clock::now() - start).count();
+
+    fs->close(fd);
+    delete fs;
+    return result;
+}
+
+// Like seq_read, but takes views of the file instead of copying it.
+Result bench_seq_view(Params const& params)
+{
+    ffsys::FFSys* fs = make_fs(params);
+    write_test_file(*fs, params, "seq");
+    ffsys::file_descriptor fd = fs->open("seq");
+    ffsys::ReadView view;
+
+    Result result;
+    auto start = Clock::now();
+    ssize_t read = 1;
+    while (read > 0) {
+        time_op(result, [&] {
+            read = fs->read_view(fd, result.bytes, params.io_size, view);
+        });
+        result.bytes += max(read, (ssize_t)0);
+    }
+    fs->release_view(view);
+    result.seconds = chrono::duration<double>(Clock::now() - start).count();
+
+    fs->close(fd);
+    delete fs;
+    return result;
+}
+
+// Writes a file of file_size bytes and truncates it to 0, a few times
+// over. Only the truncations are timed.
+Result bench_truncate(Params const& params)
+{
+    ffsys::FFSys* fs = make_fs(params);
+
+    Result result;
+    for (unsigned int i = 0; i < 8; ++i) {
+        write_test_file(*fs, params, "trunc");
+        ffsys::file_descriptor fd = fs->open("trunc");
+        time_op(result, [&] {
+            if (fs->truncate(fd, 0)) {
+                result.bytes += params.file_size;
+            }
+        });
+        result.seconds += result.latencies.back() / 1e9;
+        fs->close(fd);
+    }
+
+    delete fs;
+    return result;
+}
+
+// Reads or writes io_size bytes at random io_size aligned offsets.
+Result bench_random(Params const& params, bool write)
+{
+    ffsys::FFSys* fs = make_fs(params);
+    write_test_file(*fs, params, "rand");
+    ffsys::file_descriptor fd = fs->open("rand");
+    vector<char> buffer(params.io_size, 'r');
+    size_t n_positions = max((size_t)1, params.file_size / params.io_size);
+
+    Result result;
+    mt19937_64 random(params.seed);
+    auto start = Clock::now();
+    for (unsigned int i = 0; i < params.n_ops; ++i) {
+        size_t offset = random() % n_positions * params.io_size;
+        time_op(result, [&] {
+            ssize_t count = write ? fs->pwrite(fd, buffer.data(), buffer.size(), offset)
+                                  : fs->pread(fd, buffer.data(), buffer.size(), offset);
+            result.bytes += max(count, (ssize_t)0);
+        });
+    }
+    fs->close(fd);
+    fs->sync();
+    result.seconds = chrono::duration<double>(Clock::now() - start).count();
+
+    delete fs;
+    return result;
+}
+
+// Writes files of params.small_size bytes until the filesystem is full,
+// and prints the results separately for each tenth of the way, to show
+// how the cost of allocation changes as free space gets scarce.
+void bench_fill(Params const& params)
+{
+    Params empty = params;
+    empty.fill = 0;
+    ffsys::FFSys* fs = make_fs(empty);
+    vector<char> data(params.small_size, 'a');
+
+    size_t capacity = data_capacity(params);
+    vector<Result> tenths(10);
+    size_t written = 0;
+    auto start = Clock::now();
+
+    for (unsigned int i = 0; ; ++i) {
+        Result& result = tenths[min((size_t)9, written * 10 / capacity)];
+        ssize_t count = 0;
+        time_op(result, [&] {
+            ffsys::file_descriptor fd = fs->open("a" + to_string(i), ffsys::OpenFlags::CREATE);
+            if (fd != -1) {
+                count = fs->write(fd, data.data(), data.size());
+                fs->close(fd);
+            }
+        });
+        if (count <= 0) {
+            result.latencies.pop_back();
+            break;
+        }
+
+        result.bytes += count;
+        written += count;
+
+        auto now = Clock::now();
+        result.seconds += chrono::duration<double>(now - start).count();
+        start = now;
+    }
+
+    for (size_t i = 0; i < tenths.size(); ++i) {
+        print_result("fill " + to_string(i * 10) + "%", tenths[i]);
+    }
+
+    delete fs;
+}
+
+void print_usage()
+{
+    cout
+        << "Usage: ffsys_bench [options] [benchmark ...]" << endl << endl
+        << "Benchmarks (all by default):" << endl
+        << " - open        open and close existing files" << endl
+        << " - create      create, write and close small files" << endl
+        << " - seq_write   write one file sequentially" << endl
+        << " - seq_read    read one file sequentially" << endl
+        << " - seq_view    read one file sequentially with read_view" << endl
+        << " - rand_read   pread at random offsets" << endl
+        << " - rand_write  pwrite at random offsets" << endl
+        << " - truncate    truncate a written file to 0" << endl
+        << " - fill        write small files until the filesystem is full" << endl << endl
+        << "Options:" << endl
+        << " --path <file>          FFSys file to use (ffsys_bench.ffsys)" << endl
+        << " --block-size <bytes>   (4096)" << endl
+        << " --groups <n>           block groups of 8 * block size data blocks (1)" << endl
+        << " --file-size <bytes>    file of the seq, rand and truncate benchmarks (16 MiB)" << endl
+        << " --small-size <bytes>   files of the create and fill benchmarks (16 KiB)" << endl
+        << " --files <n>            files of the open and create benchmarks (1000)" << endl
+        << " --io-size <bytes>      bytes per read or write (4096)" << endl
+        << " --ops <n>              operations of the open and rand benchmarks (10000)" << endl
+        << " --fill <percent>       fill the filesystem this far first (0)" << endl
+        << " --seed <n>             (1)" << endl
+        << " --storage <fstream|posix|mmap>" << endl
+        << " --engine <sync|pool|uring>" << endl
+        << " --cache <blocks>       block cache capacity (256)" << endl
+        << " --write-buffer <bytes> (65536)" << endl
+        << " --read-ahead <bytes>   (131072)" << endl
+        << " --block-map            use block addresses instead of extents" << endl
+        << " --no-inline            give small files data blocks instead of inline data" << endl
+        << " --no-journal" << endl
+        << " --no-stats             do not count and time calls for FFSys::get_stats" << endl;
+}
+
+// Parses the options into params and the rest into benchmarks. Returns
+// false and prints the reason if they are not valid.
+bool parse_args(int argc, char* argv[], Params& params, vector<string>& benchmarks)
+{
+    map<string, function<bool(string const&)>> numeric = {
+        {"--block-size", [&](string const& v) { params.block_size = stoul(v); return true; }},
+        {"--groups", [&](string const& v) { params.options.block_groups = stoul(v); return true; }},
+        {"--file-size", [&](string const& v) { params.file_size = stoull(v); return true; }},
+        {"--small-size", [&](string const& v) { params.small_size = stoull(v); return true; }},
+        {"--files", [&](string const& v) { params.n_files = stoul(v); return true; }},
+        {"--io-size", [&](string const& v) { params.io_size = stoull(v); return true; }},
+        {"--ops", [&](string const& v) { params.n_ops = stoul(v); return true; }},
+        {"--fill", [&](string const& v) { params.fill = min(100ul, stoul(v)); return true; }},
+        {"--seed", [&](string const& v) { params.seed = stoul(v); return true; }},
+        {"--cache", [&](string const& v) { params.options.cache_capacity = stoull(v); return true; }},
+        {"--write-buffer", [&](string const& v) { params.options.write_buffer_size = stoull(v); return true; }},
+        {"--read-ahead", [&](string const& v) { params.options.read_ahead_size = stoull(v); return true; }},
+    };
+
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+
+        if (arg == "--block-map") {
+            params.options.extents = false;
+        } else if (arg == "--no-inline") {
+            params.options.inline_data = false;
+        } else if (arg == "--no-journal") {
+            params.options.journal = false;
+        } else if (arg == "--no-stats") {
+            params.options.stats = false;
+        } else if (!arg.starts_with("--")) {
+            benchmarks.push_back(arg);
+        } else if (!numeric.count(arg) and arg != "--path" and arg != "--storage" and arg != "--engine") {
+            cout << "Error: unknown option " << arg << "!" << endl;
+            return false;
+        } else if (i + 1 >= argc) {
+            cout << "Error: " << arg << " needs a value!" << endl;
+            return false;
+        } else if (numeric.count(arg)) {
+            string value = argv[++i];
+            if (!Utilities::is_int(value)) {
+                cout << "Error: " << arg << " is not an integer!" << endl;
+                return false;
+            }
+            numeric[arg](value);
+        } else if (arg == "--path") {
+            params.path = argv[++i];
+        } else if (arg == "--storage") {
+            string value = Utilities::string_to_lower(argv[++i]);
+            if (value == "fstream") {
+                params.options.storage = ffsys::StorageBackend::FSTREAM;
+            } else if (value == "posix") {
+                params.options.storage = ffsys::StorageBackend::POSIX;
+            } else if (value == "mmap") {
+                params.options.storage = ffsys::StorageBackend::MMAP;
+            } else {
+                cout << "Error: unknown storage " << value << "!" << endl;
+                return false;
+            }
+        } else if (arg == "--engine") {
+            string value = Utilities::string_to_lower(argv[++i]);
+            if (value == "sync") {
+                params.options.io_engine = ffsys::IOEngineType::SYNC;
+            } else if (value == "pool") {
+                params.options.io_engine = ffsys::IOEngineType::THREAD_POOL;
+            } else if (value == "uring") {
+                params.options.io_engine = ffsys::IOEngineType::IO_URING;
+            } else {
+                cout << "Error: unknown engine " << value << "!" << endl;
+                return false;
+            }
+        }
+    }
+
+    if (params.io_size == 0 or params.n_files == 0 or params.small_size == 0) {
+        cout << "Error: sizes and counts must be positive!" << endl;
+        return false;
+    }
+    return true;
+}
+
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc > 1 and (string(argv[1]) == "--help" or string(argv[1]) == "-h")) {
+        print_usage();
+        return EXIT_SUCCESS;
+    }
+
+    Params params;
+    vector<string> benchmarks;
+    if (!parse_args(argc, argv, params, benchmarks)) {
+        return EXIT_FAILURE;
+    }
+
+    map<string, function<Result(Params const&)>> all = {
+        {"open", bench_open},
+        {"create", bench_create},
+        {"seq_write", bench_seq_write},
+        {"seq_read", bench_seq_read},
+        {"seq_view", bench_seq_view},
+        {"rand_read", [](Params const& p) { return bench_random(p, false); }},
+        {"rand_write", [](Params const& p) { return bench_random(p, true); }},
+        {"truncate", bench_truncate},
+    };
+    vector<string> order = {"open", "create", "seq_write", "seq_read", "seq_view", "rand_read", "rand_write", "truncate", "fill"};
+
+    if (benchmarks.empty()) {
+        benchmarks = order;
+    }
+    for (string const& name : benchmarks) {
+        if (name != "fill" and !all.count(name)) {
+            cout << "Error: unknown benchmark " << name << "!" << endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    printf("block size %u, file size %zu, small size %zu, files %u, io size %zu, ops %u, fill %u%%\n\n",
+           params.block_size, params.file_size, params.small_size, params.n_files,
+           params.io_size, params.n_ops, params.fill);
+
+    try {
+        // The FFSys destructor reports on cout, so the results are
+        // collected first and printed at the end.
+        vector<pair<string, Result>> results;
+        for (string const& name : benchmarks) {
+            if (name == "fill") {
+                continue;
+            }
+            results.push_back({name, all[name](params)});
+        }
+
+        cout.flush();
+        print_header();
+        for (auto const& [name, result] : results) {
+            print_result(name, result);
+        }
+        if (find(benchmarks.begin(), benchmarks.end(), "fill") != benchmarks.end()) {
+            bench_fill(params);
+        }
+    } catch (std::string const& error) {
+        cout << error << endl;
+        filesystem::remove(params.path);
+        return EXIT_FAILURE;
+    }
+
+    filesystem::remove(params.path);
+    return EXIT_SUCCESS;
+}
@@ -4,6 +4,7 @@
  * Contains type definitions of objects used in the SimFS filesystem.
  */
 
+#include <cstddef>
 #include <stdint.h>
 
 namespace ffsys {
@@ -11,6 +12,63 @@ namespace ffsys {
 
 static constexpr int N_STATIC_FILE_BLOCKS = 15;
 static constexpr int N_DYNAMIC_FILE_BLOCKS = 5;
+
+// With INODE_INDIRECT_TREE, the first 3 dynamic addresses are single
+// indirect, and the last two double and triple indirect.
+static constexpr int N_SINGLE_INDIRECT_BLOCKS = 3;
+
+// How many bytes of contents a file with INODE_INLINE_DATA keeps in place
+// of its block addresses.
+static constexpr unsigned int INLINE_DATA_SIZE = (N_STATIC_FILE_BLOCKS + N_DYNAMIC_FILE_BLOCKS) * sizeof(int32_t);
+
+/**
+ * A run of a file's blocks that lie one after another in the data blocks.
+ */
+struct Extent {
+    // The index of the first file block in the run.
+    uint32_t logical;
+
+    // The data block address of the first block in the run.
+    int32_t physical;
+
+    // The number of blocks in the run.
+    uint32_t length;
+};
+
+static constexpr int N_INODE_EXTENTS = 6;
+
+/**
+ * The block mapping of a file with the INODE_EXTENTS flag. Extents are
+ * kept sorted by their logical index and never overlap.
+ */
+struct ExtentList {
+    // The first extents are kept in the i-node itself.
+    Extent extents[N_INODE_EXTENTS];
+
+    // The total number of extents of the file.
+    uint32_t count;
+
+    // Address of the first data block holding the extents that do not
+    // fit into the i-node, or -1 if there are none. Each of these overflow
+    // blocks ends with the address of the next one, if the extents
+    // continue past it.
+    int32_t overflow_block;
+};
+
+// I-node flags
+// The file's blocks are mapped with an ExtentList instead of addresses.
+static constexpr uint8_t INODE_EXTENTS = 0x01;
+// The file's dynamic addresses end with a double and a triple indirect
+// one, instead of being all single indirect (see INode::blocks).
+static constexpr uint8_t INODE_INDIRECT_TREE = 0x02;
+// The file is a directory (see DirectoryHeader). Directories always map
+// their blocks with addresses and INODE_INDIRECT_TREE.
+static constexpr uint8_t INODE_DIRECTORY = 0x04;
+// The file's contents are in INode::inline_data, and it has no data
+// blocks. The layout flags above tell how its blocks are mapped once it
+// outgrows the i-node.
+static constexpr uint8_t INODE_INLINE_DATA = 0x08;
+
 /**
  * I-nodes are essentially tables that hold
  * metadata for each file.
@@ -19,26 +77,74 @@ struct INode {
     // The ordinal number of this inode.
     uint32_t index;
 
-    // The name of the file in ascii.
+    // The name of the file in ascii, cut to 16 characters. The full name
+    // is kept in the entry of the file's directory.
     char name[17];
 
+    // Layout flags of the file (INODE_* constants). Fits into the padding
+    // after the name, so the i-node size is unchanged.
+    uint8_t flags;
+
     // The size of the file in bytes. Important for
     // determining, and keeping track of, EOF.
     uint64_t size;
 
-    // The addresses of this file's data blocks.
-    // 15 first are the direct addresses (static) of data blocks,
-    // and the last 5 are reserved for indirect (dynamic) block addresses
-    // (i.e. for address of a block that contains more of this file's data
-    // block addresses), if the static ones are not enough.
-    // The value -1 is used to indicate unreserved blocks.
-    int32_t blocks[N_STATIC_FILE_BLOCKS + N_DYNAMIC_FILE_BLOCKS]
-        = {-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1};
+    union {
+        // The addresses of this file's data blocks.
+        // 15 first are the direct addresses (static) of data blocks,
+        // and the last 5 are reserved for indirect (dynamic) block addresses
+        // (i.e. for address of a block that contains more of this file's data
+        // block addresses), if the static ones are not enough.
+        // With INODE_INDIRECT_TREE, only the first 3 of the 5 are single
+        // indirect. The 4th is double indirect: the address of a block of
+        // addresses of address blocks. The 5th is triple indirect, with
+        // one more level of address blocks.
+        // The value -1 is used to indicate unreserved blocks.
+        int32_t blocks[N_STATIC_FILE_BLOCKS + N_DYNAMIC_FILE_BLOCKS]
+            = {-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1};
+
+        // Used instead of the addresses when flags has INODE_EXTENTS.
+        ExtentList extent_list;
+
+        // Used instead of the addresses when flags has INODE_INLINE_DATA.
+        char inline_data[INLINE_DATA_SIZE];
+    };
 
     // Datetime the file was created.
     uint64_t created_time;
 };
 static constexpr unsigned int INODE_SIZE = sizeof(INode);
+static_assert(sizeof(ExtentList) <= sizeof(INode::blocks));
+
+// Superblock features
+// The INode::flags byte is valid. Before it, the byte was padding that
+// could contain anything.
+static constexpr uint32_t FEATURE_INODE_FLAGS = 0x01;
+// The file is divided into block groups, and the superblock has the
+// fields from n_groups on.
+static constexpr uint32_t FEATURE_BLOCK_GROUPS = 0x02;
+// Files are kept in directories, starting from Superblock::root_inode.
+// Before it, all files were at the top level, known by INode::name.
+static constexpr uint32_t FEATURE_DIRECTORIES = 0x04;
+
+/**
+ * Describes one block group: the part of the FFSys file with its own
+ * bitmaps, i-nodes and data blocks (see Superblock::n_groups).
+ */
+struct GroupDescriptor {
+    // The blocks of the group's 'free i-node' and 'free data block'
+    // bitmaps.
+    uint32_t inode_bitmap_i;
+    uint32_t data_block_bitmap_i;
+
+    // The block indices at which the group's i-nodes and data blocks start.
+    uint32_t inodes_start_i;
+    uint32_t data_blocks_start_i;
+
+    uint32_t n_free_inodes;
+    uint32_t n_free_data_blocks;
+};
+static constexpr unsigned int GROUP_DESCRIPTOR_SIZE = sizeof(GroupDescriptor);
 
 /**
  * The superblock contains basic information about the filesystem,
@@ -49,19 +155,18 @@ struct Superblock {
     // The size of one block in bytes.
     uint16_t block_size;
 
+    // The 16-bit fields from here on describe a file without
+    // FEATURE_BLOCK_GROUPS, as its one group. Files with block groups
+    // leave them 0, and use the wider fields at the end instead.
+
     // The number of i-nodes. Has to be less than or equal to block_size * 8.
-    uint16_t n_inodes;
+    uint16_t n_inodes16;
 
     // The amount of blocks reserved for i-nodes.
-    uint16_t n_inode_blocks;
+    uint16_t n_inode_blocks16;
 
     // The number of file data blocks. Same size restriction as with i-nodes.
-    uint16_t n_data_blocks;
-
-    // The three is for the superblock, the i-node bitmap and the data block bitmap.
-    uint16_t total_n_blocks() {
-        return 3 + n_inode_blocks + n_data_blocks;
-    }
+    uint16_t n_data_blocks16;
 
     // The index of the block containing the 'free i-node' bitmap.
     uint16_t inode_bitmap_i;
@@ -75,14 +180,135 @@ struct Superblock {
     // The block index at which blocks reserved for file data start.
     uint16_t data_blocks_start_i;
 
-    uint16_t n_free_inodes;
-    uint16_t n_free_data_blocks;
+    uint16_t n_free_inodes16;
+    uint16_t n_free_data_blocks16;
 
     // The amount of address pointers that fit into one address data block.
     uint32_t address_block_capacity;
+
+    // Optional features in use (FEATURE_* constants). Files made before
+    // this field existed read it as 0.
+    uint32_t features;
+
+    // The journal region after the data blocks: its first block and its
+    // length in blocks. 0 blocks if the file has no journal, like files
+    // made before these fields existed.
+    uint32_t journal_start_i;
+    uint32_t n_journal_blocks;
+
+    // The block groups, each with a 'free i-node' bitmap block, a 'free
+    // data block' bitmap block, its i-nodes and its data blocks, in this
+    // order. The GroupDescriptors are kept in the blocks starting at
+    // group_table_i, and the groups follow them. I-node and data block
+    // numbers run over the groups one after another: inode i is in
+    // group i / inodes_per_group. Only stored with FEATURE_BLOCK_GROUPS,
+    // otherwise filled from the fields above when read.
+    uint32_t n_groups;
+    uint32_t group_table_i;
+    uint32_t inodes_per_group;
+    uint32_t inode_blocks_per_group;
+    uint32_t data_blocks_per_group;
+
+    // The totals over all groups.
+    uint32_t n_inodes;
+    uint32_t n_data_blocks;
+    uint32_t n_free_inodes;
+    uint32_t n_free_data_blocks;
+
+    // The i-node of the root directory, with FEATURE_DIRECTORIES. Also
+    // kept by files without FEATURE_BLOCK_GROUPS, unlike the fields
+    // before it.
+    uint32_t root_inode;
+
+    // The number of blocks the group descriptors take.
+    uint32_t n_group_table_blocks() {
+        return ((uint64_t)n_groups * GROUP_DESCRIPTOR_SIZE + block_size - 1) / block_size;
+    }
+
+    // The blocks of one group: the two bitmaps, i-nodes and data blocks.
+    uint32_t n_group_blocks() {
+        return 2 + inode_blocks_per_group + data_blocks_per_group;
+    }
+
+    // The superblock, the group descriptors, the groups and the journal.
+    uint64_t total_n_blocks() {
+        if (!(features & FEATURE_BLOCK_GROUPS)) {
+            return 3 + n_inode_blocks16 + n_data_blocks16 + n_journal_blocks;
+        }
+        return 1 + n_group_table_blocks() + (uint64_t)n_groups * n_group_blocks() + n_journal_blocks;
+    }
 };
+
 static constexpr unsigned int SUPERBLOCK_SIZE = sizeof(Superblock);
 
+// The part of the superblock that files without FEATURE_BLOCK_GROUPS have.
+static constexpr unsigned int LEGACY_SUPERBLOCK_SIZE = offsetof(Superblock, n_groups);
+
+// Directories
+static constexpr uint32_t DIRECTORY_MAGIC = 0x52494446;
+static constexpr unsigned int MAX_NAME_LENGTH = 255;
+
+/**
+ * The start of the first block of a directory. A directory maps names to
+ * i-nodes with a tree of blocks keyed by the hashes of the names, like
+ * the htree of EXT3: the first block is the root of the index, index
+ * blocks point to the blocks below them by ranges of hashes, and leaf
+ * blocks hold the entries whose names hash into their range. Finding a
+ * name reads one block per level of the tree, however many entries the
+ * directory has.
+ */
+struct DirectoryHeader {
+    uint32_t magic;
+
+    // The i-node of the directory this one is in. The root directory is
+    // in itself.
+    uint32_t parent;
+
+    // The number of entries in the directory, and of blocks in its file.
+    uint32_t n_entries;
+    uint32_t n_blocks;
+
+    // The number of index block levels between the root and the leaf
+    // blocks.
+    uint32_t depth;
+};
+
+/**
+ * Starts every index node: the root, right after the DirectoryHeader, and
+ * the other index blocks. Followed by count DirectoryIndexEntries sorted by
+ * their hashes. The first entry of the root has the hash 0.
+ */
+struct DirectoryIndexNode {
+    uint32_t count;
+};
+
+/**
+ * Points to the block (of the directory's file) below the index node that
+ * holds the hashes from hash up to the next entry's.
+ */
+struct DirectoryIndexEntry {
+    uint32_t hash;
+    uint32_t block;
+};
+
+/**
+ * Starts every leaf block. Followed by used bytes of entries, each a
+ * DirectoryEntry and its name without a terminating null.
+ */
+struct DirectoryLeaf {
+    uint32_t used;
+};
+
+struct DirectoryEntry {
+    uint32_t inode;
+    uint16_t name_length;
+
+    // Whether the entry is a directory, so that listing one does not have
+    // to read the i-nodes of its entries.
+    uint8_t directory;
+    uint8_t reserved;
+};
+
 }
 
 #endif // FS_OBJECTS_HH
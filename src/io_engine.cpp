@@ -0,0 +1,457 @@
+#include "io_engine.hh"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace ffsys {
+
+ThreadPool::ThreadPool(unsigned int n_threads)
+{
+    for (unsigned int i = 0; i < max(n_threads, 1u); ++i) {
+        workers_.emplace_back(&ThreadPool::work, this);
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        lock_guard lock(mutex_);
+        stopping_ = true;
+    }
+    cv_.notify_all();
+
+    for (thread& worker : workers_) {
+        worker.join();
+    }
+}
+
+void ThreadPool::post(function<void()> task)
+{
+    {
+        lock_guard lock(mutex_);
+        tasks_.push_back(std::move(task));
+    }
+    cv_.notify_one();
+}
+
+void ThreadPool::work()
+{
+    while (true) {
+        function<void()> task;
+        {
+            unique_lock lock(mutex_);
+            cv_.wait(lock, [this] { return stopping_ or !tasks_.empty(); });
+            if (tasks_.empty()) {
+                return;
+            }
+            task = std::move(tasks_.front());
+            tasks_.pop_front();
+        }
+        task();
+    }
+}
+
+IOEngine* IOEngine::create(Storage& storage, IOEngineType type, unsigned int n_threads)
+{
+    switch (type) {
+    case IOEngineType::IO_URING:
+        try {
+            return new UringEngine(storage);
+        } catch (std::string const&) {
+            // Not available here, use the threads instead.
+        }
+        [[fallthrough]];
+    case IOEngineType::THREAD_POOL:
+        return new ThreadPoolEngine(storage, n_threads);
+    case IOEngineType::SYNC:
+    default:
+        return new IOEngine(storage);
+    }
+}
+
+IOEngine::IOEngine(Storage& storage):
+    storage_(storage)
+{
+}
+
+bool IOEngine::run(vector<IORequest> const& requests)
+{
+    for (IORequest const& request : requests) {
+        if (!transfer(request)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+IOEngineType IOEngine::get_type()
+{
+    return IOEngineType::SYNC;
+}
+
+bool IOEngine::transfer(IORequest const& request)
+{
+    if (request.write) {
+        return storage_.write(request.pos, request.buffer, request.count);
+    }
+    return storage_.read(request.pos, request.buffer, request.count);
+}
+
+ThreadPoolEngine::ThreadPoolEngine(Storage& storage, unsigned int n_threads):
+    IOEngine(storage), pool_(n_threads)
+{
+}
+
+bool ThreadPoolEngine::run(vector<IORequest> const& requests)
+{
+    if (requests.size() <= 1) {
+        return IOEngine::run(requests);
+    }
+
+    mutex done_mutex;
+    condition_variable done_cv;
+    size_t n_left = requests.size();
+    bool ok = true;
+
+    auto finish = [&](bool transferred) {
+        // Notify while holding the lock, so that the waiting thread cannot
+        // return (and destroy these) before this thread is done with them.
+        lock_guard lock(done_mutex);
+        ok = ok and transferred;
+        --n_left;
+        done_cv.notify_one();
+    };
+
+    // The calling thread does the first request itself instead of just
+    // waiting.
+    for (size_t i = 1; i < requests.size(); ++i) {
+        pool_.post([this, &request = requests[i], &finish] {
+            finish(transfer(request));
+        });
+    }
+    finish(transfer(requests[0]));
+
+    unique_lock lock(done_mutex);
+    done_cv.wait(lock, [&] { return n_left == 0; });
+    return ok;
+}
+
+IOEngineType ThreadPoolEngine::get_type()
+{
+    return IOEngineType::THREAD_POOL;
+}
+
+namespace {
+
+int io_uring_setup(unsigned int entries, io_uring_params* params)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+int io_uring_enter(int ring_fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags)
+{
+    return (int)syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, nullptr, 0);
+}
+
+// The ring indices are shared with the kernel.
+unsigned int load_acquire(unsigned int* index)
+{
+    return atomic_ref<unsigned int>(*index).load(memory_order_acquire);
+}
+
+void store_release(unsigned int* index, unsigned int value)
+{
+    atomic_ref<unsigned int>(*index).store(value, memory_order_release);
+}
+
+} // namespace
+
+struct UringEngine::Ring {
+    int fd = -1;
+    unsigned int n_entries = 0;
+
+    void* sq_ring = MAP_FAILED;
+    size_t sq_ring_size = 0;
+    void* cq_ring = MAP_FAILED;
+    size_t cq_ring_size = 0;
+    io_uring_sqe* sqes = (io_uring_sqe*)MAP_FAILED;
+    size_t sqes_size = 0;
+
+    unsigned int* sq_head;
+    unsigned int* sq_tail;
+    unsigned int* sq_mask;
+    unsigned int* sq_array;
+    unsigned int* cq_head;
+    unsigned int* cq_tail;
+    unsigned int* cq_mask;
+    io_uring_cqe* cqes;
+
+    // @throws std::string, if the ring could not be set up.
+    Ring(unsigned int queue_depth)
+    {
+        io_uring_params params = {};
+        fd = io_uring_setup(queue_depth, &params);
+        if (fd < 0) {
+            throw std::string("io_uring is not available");
+        }
+        n_entries = params.sq_entries;
+
+        sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+        cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap) {
+            sq_ring_size = cq_ring_size = max(sq_ring_size, cq_ring_size);
+        }
+
+        sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       fd, IORING_OFF_SQ_RING);
+        if (sq_ring == MAP_FAILED) {
+            close(fd);
+            throw std::string("io_uring is not available");
+        }
+
+        if (single_mmap) {
+            cq_ring = sq_ring;
+        } else {
+            cq_ring = mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                           fd, IORING_OFF_CQ_RING);
+        }
+
+        sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = (io_uring_sqe*)mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                   fd, IORING_OFF_SQES);
+
+        if (cq_ring == MAP_FAILED or sqes == MAP_FAILED) {
+            release();
+            throw std::string("io_uring is not available");
+        }
+
+        char* sq = (char*)sq_ring;
+        sq_head = (unsigned int*)(sq + params.sq_off.head);
+        sq_tail = (unsigned int*)(sq + params.sq_off.tail);
+        sq_mask = (unsigned int*)(sq + params.sq_off.ring_mask);
+        sq_array = (unsigned int*)(sq + params.sq_off.array);
+
+        char* cq = (char*)cq_ring;
+        cq_head = (unsigned int*)(cq + params.cq_off.head);
+        cq_tail = (unsigned int*)(cq + params.cq_off.tail);
+        cq_mask = (unsigned int*)(cq + params.cq_off.ring_mask);
+        cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+    }
+
+    ~Ring()
+    {
+        release();
+    }
+
+    void release()
+    {
+        if (sqes != MAP_FAILED) {
+            munmap(sqes, sqes_size);
+        }
+        if (cq_ring != MAP_FAILED and cq_ring != sq_ring) {
+            munmap(cq_ring, cq_ring_size);
+        }
+        if (sq_ring != MAP_FAILED) {
+            munmap(sq_ring, sq_ring_size);
+        }
+        close(fd);
+    }
+};
+
+UringEngine::UringEngine(Storage& storage, unsigned int queue_depth):
+    IOEngine(storage), fd_(storage.get_fd()), queue_depth_(queue_depth)
+{
+    if (fd_ == -1) {
+        throw std::string("Storage has no file descriptor");
+    }
+
+    // Set up the first ring right away, so that a missing io_uring is
+    // noticed here and not on the first batch.
+    rings_.push_back(make_unique<Ring>(queue_depth_));
+    free_rings_.push_back(rings_.back().get());
+}
+
+UringEngine::~UringEngine() = default;
+
+bool UringEngine::run(vector<IORequest> const& requests)
+{
+    if (requests.size() <= 1) {
+        return IOEngine::run(requests);
+    }
+
+    Ring* ring = take_ring();
+    if (ring == nullptr) {
+        return IOEngine::run(requests);
+    }
+
+    bool ok = true;
+    bool broken = false;
+    size_t i = 0;
+    while (i < requests.size() and !broken) {
+        size_t n = min((size_t)ring->n_entries, requests.size() - i);
+        ok = run_on(*ring, requests.data() + i, n, broken) and ok;
+        i += n;
+    }
+
+    if (!broken) {
+        give_ring(ring);
+        return ok;
+    }
+
+    // A broken ring is not used again, and the rest of the batch is
+    // transferred without it.
+    drop_ring(ring);
+    vector<IORequest> rest(requests.begin() + i, requests.end());
+    return IOEngine::run(rest) and ok;
+}
+
+IOEngineType UringEngine::get_type()
+{
+    return IOEngineType::IO_URING;
+}
+
+UringEngine::Ring* UringEngine::take_ring()
+{
+    lock_guard lock(mutex_);
+
+    if (!free_rings_.empty()) {
+        Ring* ring = free_rings_.back();
+        free_rings_.pop_back();
+        return ring;
+    }
+
+    try {
+        rings_.push_back(make_unique<Ring>(queue_depth_));
+    } catch (std::string const&) {
+        return nullptr;
+    }
+    return rings_.back().get();
+}
+
+void UringEngine::give_ring(Ring* ring)
+{
+    lock_guard lock(mutex_);
+    free_rings_.push_back(ring);
+}
+
+void UringEngine::drop_ring(Ring* ring)
+{
+    lock_guard lock(mutex_);
+    erase_if(rings_, [ring](unique_ptr<Ring> const& owned) {
+        return owned.get() == ring;
+    });
+}
+
+bool UringEngine::run_on(Ring& ring, IORequest const* requests, size_t n, bool& broken)
+{
+    // What is left of each request. A transfer can come back short, in
+    // which case the rest is submitted again.
+    vector<IORequest> left(requests, requests + n);
+    vector<size_t> to_queue(n);
+    for (size_t i = 0; i < n; ++i) {
+        to_queue[i] = i;
+    }
+
+    unsigned int n_unsubmitted = 0;
+    size_t n_in_flight = 0;
+    bool ok = true;
+
+    // Takes the completions off the completion queue, queueing again what
+    // is left of the requests that came back short or were interrupted.
+    auto reap = [&] {
+        unsigned int head = *ring.cq_head;
+        unsigned int cq_tail = load_acquire(ring.cq_tail);
+        for (; head != cq_tail; ++head) {
+            io_uring_cqe const& cqe = ring.cqes[head & *ring.cq_mask];
+            size_t i = cqe.user_data;
+            int result = cqe.res;
+            --n_in_flight;
+
+            if (result == -EINTR or result == -EAGAIN) {
+                to_queue.push_back(i);
+            } else if (result <= 0) {
+                ok = false;
+            } else {
+                left[i].pos += result;
+                left[i].buffer += result;
+                left[i].count -= result;
+                if (left[i].count > 0 and ok) {
+                    to_queue.push_back(i);
+                }
+            }
+        }
+        store_release(ring.cq_head, head);
+    };
+
+    while (!to_queue.empty() or n_unsubmitted > 0 or n_in_flight > 0) {
+        // Only this thread adds to the submission queue, so its tail
+        // can be read without synchronization.
+        unsigned int tail = *ring.sq_tail;
+        for (size_t i : to_queue) {
+            IORequest const& request = left[i];
+            unsigned int slot = tail & *ring.sq_mask;
+            io_uring_sqe* sqe = &ring.sqes[slot];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = request.write ? IORING_OP_WRITE : IORING_OP_READ;
+            sqe->fd = fd_;
+            sqe->addr = (uint64_t)request.buffer;
+            sqe->len = (uint32_t)min(request.count, (size_t)1 << 30);
+            sqe->off = request.pos;
+            sqe->user_data = i;
+            ring.sq_array[slot] = slot;
+            storage_.count_transfer(request.write, request.pos, sqe->len);
+            ++tail;
+        }
+        store_release(ring.sq_tail, tail);
+        n_unsubmitted += to_queue.size();
+        n_in_flight += to_queue.size();
+        to_queue.clear();
+
+        int submitted = io_uring_enter(ring.fd, n_unsubmitted, 1, IORING_ENTER_GETEVENTS);
+        if (submitted < 0) {
+            if (errno == EINTR or errno == EAGAIN or errno == EBUSY) {
+                continue;
+            }
+            broken = true;
+            break;
+        }
+        n_unsubmitted -= submitted;
+        reap();
+    }
+
+    if (!broken) {
+        return ok;
+    }
+
+    // The ring itself is broken. The entries that were never submitted
+    // are left in its queue, which is dropped by the caller, and the ones
+    // the kernel took are waited for as far as it still lets us, since
+    // they use the caller's buffers. Whatever did not complete is then
+    // transferred again without the ring.
+    n_in_flight -= n_unsubmitted;
+    while (n_in_flight > 0) {
+        if (io_uring_enter(ring.fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 and errno != EINTR) {
+            break;
+        }
+        reap();
+    }
+
+    vector<IORequest> rest;
+    for (IORequest const& request : left) {
+        if (request.count > 0) {
+            rest.push_back(request);
+        }
+    }
+    return IOEngine::run(rest) and ok;
+}
+
+} // namespace ffsys
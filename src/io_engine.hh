@@ -0,0 +1,146 @@
+#ifndef IO_ENGINE_HH
+#define IO_ENGINE_HH
+
+#include "storage.hh"
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace ffsys {
+
+/**
+ * The ways a batch of independent transfers can be carried out.
+ */
+enum class IOEngineType {
+    // One transfer after another on the calling thread.
+    SYNC,
+
+    // Spread over a pool of worker threads, each doing plain Storage
+    // calls, so up to one transfer per worker is in flight.
+    THREAD_POOL,
+
+    // Submitted to the kernel at once through io_uring on the file's
+    // descriptor. Falls back to THREAD_POOL if the storage has no
+    // descriptor (FSTREAM) or io_uring is not available.
+    IO_URING
+};
+
+/**
+ * One transfer of a batch given to IOEngine::run.
+ */
+struct IORequest {
+    bool write;
+    size_t pos;
+    char* buffer;
+    size_t count;
+};
+
+/**
+ * Fixed set of worker threads that run posted tasks in posting order.
+ */
+class ThreadPool
+{
+public:
+    ThreadPool(unsigned int n_threads);
+
+    // Runs the tasks that are still queued, then stops the workers.
+    ~ThreadPool();
+
+    void post(std::function<void()> task);
+
+private:
+    std::vector<std::thread> workers_;
+
+    // Guards everything below.
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<std::function<void()>> tasks_;
+    bool stopping_ = false;
+
+    void work();
+};
+
+/**
+ * Carries out batches of transfers on a Storage. The transfers of a batch
+ * must not overlap each other, so that they can be in flight at the same
+ * time. The base class transfers them one after another, the subclasses
+ * overlap them. Can be used from many threads at once.
+ */
+class IOEngine
+{
+public:
+    // Creates the engine of the given type, or the nearest one that works
+    // with the storage.
+    static IOEngine* create(Storage& storage, IOEngineType type, unsigned int n_threads = 4);
+
+    IOEngine(Storage& storage);
+    virtual ~IOEngine() = default;
+
+    // Carries out all of the requests and returns once they have finished.
+    // Returns false if any of them failed.
+    virtual bool run(std::vector<IORequest> const& requests);
+
+    // The type that is actually in use.
+    virtual IOEngineType get_type();
+
+protected:
+    Storage& storage_;
+
+    bool transfer(IORequest const& request);
+};
+
+class ThreadPoolEngine : public IOEngine
+{
+public:
+    ThreadPoolEngine(Storage& storage, unsigned int n_threads);
+
+    bool run(std::vector<IORequest> const& requests) override;
+    IOEngineType get_type() override;
+
+private:
+    ThreadPool pool_;
+};
+
+class UringEngine : public IOEngine
+{
+public:
+    // @throws std::string, if io_uring could not be set up.
+    UringEngine(Storage& storage, unsigned int queue_depth = 64);
+    ~UringEngine();
+
+    bool run(std::vector<IORequest> const& requests) override;
+    IOEngineType get_type() override;
+
+private:
+    // One submission and completion queue pair. A batch uses a ring
+    // alone from submission to the last completion, so each thread
+    // running a batch takes a ring of its own.
+    struct Ring;
+
+    int fd_;
+    unsigned int queue_depth_;
+
+    // Guards the ring lists.
+    std::mutex mutex_;
+    std::vector<std::unique_ptr<Ring>> rings_;
+    std::vector<Ring*> free_rings_;
+
+    Ring* take_ring();
+    void give_ring(Ring* ring);
+
+    // Closes a ring that is broken, instead of giving it back.
+    void drop_ring(Ring* ring);
+
+    // Transfers up to the ring's size of requests. If entering the ring
+    // fails, sets broken and finishes the requests without it.
+    bool run_on(Ring& ring, IORequest const* requests, size_t n, bool& broken);
+};
+
+} // namespace ffsys
+
+#endif // IO_ENGINE_HH
@@ -0,0 +1,230 @@
+#include "journal.hh"
+
+#include <algorithm>
+#include <cstring>
+
+using namespace std;
+
+namespace ffsys {
+
+Journal::Journal(Storage& storage, unsigned int block_size, unsigned int start_i, unsigned int n_blocks):
+    storage_(storage), block_size_(block_size), start_i_(start_i), n_blocks_(n_blocks)
+{
+}
+
+bool Journal::replay(unsigned int& replayed)
+{
+    replayed = 0;
+
+    // The first descriptor tells the sequence number of the log. If the
+    // first block is not a descriptor, its write was torn (or the log was
+    // emptied before the numbers existed), and the log is started again
+    // with a number that no descriptor in the region has.
+    vector<char> descriptor_block(block_size_);
+    if (!storage_.read(block_pos(0), descriptor_block.data(), block_size_)) {
+        return false;
+    }
+    Descriptor first;
+    memcpy(&first, descriptor_block.data(), sizeof(first));
+    if (first.magic != MAGIC) {
+        return find_last_sequence(sequence_) and clear();
+    }
+    sequence_ = first.sequence;
+
+    size_t pos = 0;
+    uint64_t seed = sequence_;
+    vector<uint32_t> indices;
+    vector<char> images;
+
+    // The images of the transaction read so far, written once its last
+    // descriptor has been read.
+    vector<uint32_t> pending_indices;
+    vector<char> pending_images;
+
+    while (pos < n_blocks_) {
+        if (!storage_.read(block_pos(pos), descriptor_block.data(), block_size_)) {
+            return false;
+        }
+
+        Descriptor descriptor;
+        memcpy(&descriptor, descriptor_block.data(), sizeof(descriptor));
+        if (descriptor.magic != MAGIC or descriptor.sequence != sequence_ or descriptor.n_blocks == 0
+            or descriptor.n_blocks > per_descriptor() or pos + 1 + descriptor.n_blocks > n_blocks_) {
+            break;
+        }
+
+        indices.resize(descriptor.n_blocks);
+        memcpy(indices.data(), descriptor_block.data() + sizeof(descriptor), indices.size() * sizeof(uint32_t));
+        images.resize((size_t)descriptor.n_blocks * block_size_);
+        if (!storage_.read(block_pos(pos + 1), images.data(), images.size())) {
+            return false;
+        }
+
+        uint64_t sum = checksum(seed, descriptor, indices.data(), images.data());
+        if (sum != descriptor.checksum) {
+            break;
+        }
+
+        pending_indices.insert(pending_indices.end(), indices.begin(), indices.end());
+        pending_images.insert(pending_images.end(), images.begin(), images.end());
+        seed = sum;
+        pos += 1 + descriptor.n_blocks;
+
+        if (descriptor.last) {
+            for (size_t i = 0; i < pending_indices.size(); ++i) {
+                if (!storage_.write((size_t)pending_indices[i] * block_size_,
+                                    pending_images.data() + i * block_size_, block_size_)) {
+                    return false;
+                }
+            }
+            pending_indices.clear();
+            pending_images.clear();
+            ++replayed;
+        }
+    }
+
+    if (pos == 0 and first.n_blocks == 0) {
+        // Nothing was logged.
+        end_ = 0;
+        checksum_ = sequence_;
+        return true;
+    }
+
+    return storage_.sync() and clear();
+}
+
+size_t Journal::blocks_needed(size_t n)
+{
+    return n + (n + per_descriptor() - 1) / per_descriptor();
+}
+
+size_t Journal::get_size()
+{
+    return n_blocks_;
+}
+
+size_t Journal::get_free()
+{
+    return n_blocks_ - end_;
+}
+
+bool Journal::append(vector<pair<unsigned int, const char*>> const& blocks, vector<size_t>& positions)
+{
+    size_t needed = blocks_needed(blocks.size());
+    if (blocks.empty() or needed > get_free()) {
+        return false;
+    }
+
+    // The whole transaction is built in memory, so that it is written
+    // with one sequential write.
+    vector<char> log(needed * block_size_);
+    size_t journal_i = end_;
+    uint64_t sum = checksum_;
+    char* out = log.data();
+
+    for (size_t first = 0; first < blocks.size(); first += per_descriptor()) {
+        size_t n = min(per_descriptor(), blocks.size() - first);
+
+        Descriptor descriptor = {MAGIC, (uint32_t)n, first + n == blocks.size(), sequence_, 0};
+        uint32_t* indices = reinterpret_cast<uint32_t*>(out + sizeof(descriptor));
+        char* images = out + block_size_;
+        for (size_t i = 0; i < n; ++i) {
+            indices[i] = blocks[first + i].first;
+            memcpy(images + i * block_size_, blocks[first + i].second, block_size_);
+            positions.push_back(journal_i + 1 + i);
+        }
+
+        sum = checksum(sum, descriptor, indices, images);
+        descriptor.checksum = sum;
+        memcpy(out, &descriptor, sizeof(descriptor));
+
+        out += (1 + n) * block_size_;
+        journal_i += 1 + n;
+    }
+
+    if (!storage_.write(block_pos(end_), log.data(), log.size()) or !storage_.sync()) {
+        return false;
+    }
+
+    end_ = journal_i;
+    checksum_ = sum;
+    return true;
+}
+
+bool Journal::read_image(size_t position, char* buffer)
+{
+    return storage_.read(block_pos(position), buffer, block_size_);
+}
+
+bool Journal::clear()
+{
+    // Overwriting the first descriptor is enough, the ones after it have
+    // an earlier sequence number.
+    vector<char> empty(block_size_, 0);
+    Descriptor descriptor = {MAGIC, 0, 0, sequence_ + 1, 0};
+    memcpy(empty.data(), &descriptor, sizeof(descriptor));
+    if (!storage_.write(block_pos(0), empty.data(), block_size_) or !storage_.sync()) {
+        return false;
+    }
+
+    ++sequence_;
+    end_ = 0;
+    checksum_ = sequence_;
+    return true;
+}
+
+size_t Journal::per_descriptor()
+{
+    return (block_size_ - sizeof(Descriptor)) / sizeof(uint32_t);
+}
+
+size_t Journal::block_pos(size_t journal_i)
+{
+    return (start_i_ + journal_i) * block_size_;
+}
+
+bool Journal::find_last_sequence(uint32_t& result)
+{
+    result = 0;
+
+    // Read in chunks, as the region can be large.
+    const size_t chunk = 256;
+    vector<char> blocks(chunk * block_size_);
+    for (size_t i = 0; i < n_blocks_; i += chunk) {
+        size_t n = min(chunk, n_blocks_ - i);
+        if (!storage_.read(block_pos(i), blocks.data(), n * block_size_)) {
+            return false;
+        }
+
+        for (size_t j = 0; j < n; ++j) {
+            Descriptor descriptor;
+            memcpy(&descriptor, blocks.data() + j * block_size_, sizeof(descriptor));
+            if (descriptor.magic == MAGIC) {
+                result = max(result, descriptor.sequence);
+            }
+        }
+    }
+    return true;
+}
+
+uint64_t Journal::checksum(uint64_t seed, Descriptor const& descriptor,
+                           uint32_t const* indices, const char* images)
+{
+    // 64-bit FNV-1a, starting from the previous descriptor's checksum.
+    uint64_t hash = 14695981039346656037ull ^ seed;
+    auto add = [&hash](const void* data, size_t count) {
+        const unsigned char* bytes = static_cast<const unsigned char*>(data);
+        for (size_t i = 0; i < count; ++i) {
+            hash ^= bytes[i];
+            hash *= 1099511628211ull;
+        }
+    };
+
+    add(&descriptor.n_blocks, sizeof(descriptor.n_blocks));
+    add(&descriptor.last, sizeof(descriptor.last));
+    add(indices, descriptor.n_blocks * sizeof(uint32_t));
+    add(images, (size_t)descriptor.n_blocks * block_size_);
+    return hash;
+}
+
+} // namespace ffsys
@@ -0,0 +1,108 @@
+#ifndef JOURNAL_HH
+#define JOURNAL_HH
+
+#include "storage.hh"
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace ffsys {
+
+/**
+ * Write-ahead log of whole block images in a region of the FFSys file.
+ *
+ * A transaction is a set of blocks that has to reach its places in the
+ * file all or not at all. It is appended to the log with one sequential
+ * write (and a sync) before any of its blocks are written to their
+ * places, so after a crash the blocks of every complete transaction can
+ * be written again from the log with replay(). Once all logged blocks are
+ * in their places, the log is emptied with clear().
+ *
+ * In the log, a transaction is one or more descriptor blocks, each
+ * followed by the images of the blocks it lists. The checksum of a
+ * descriptor covers its list and its images, and continues from the
+ * checksum of the previous descriptor, so a torn write ends the log.
+ * Like the transaction ids of JBD, every clear() starts a new sequence
+ * number, which each descriptor carries and the first checksum starts
+ * from, so a descriptor left over from before the last clear() ends the
+ * log even if the transactions before it were logged again byte for byte.
+ * The empty log is a descriptor of no blocks, which keeps the number.
+ *
+ * Not thread safe, the block cache calls it with its lock held.
+ */
+class Journal
+{
+public:
+    // Start and length of the journal region, in blocks.
+    Journal(Storage& storage, unsigned int block_size, unsigned int start_i, unsigned int n_blocks);
+
+    // Writes the blocks of all complete transactions in the log to their
+    // places and empties the log. Done when mounting, before anything
+    // else is read. Sets replayed to the number of transactions written.
+    bool replay(unsigned int& replayed);
+
+    // The number of journal blocks needed to log n block images.
+    size_t blocks_needed(size_t n);
+
+    size_t get_size();
+    size_t get_free();
+
+    // Appends the given block images (block index and contents) as one
+    // transaction and syncs the storage. Returns false if the transaction
+    // does not fit or could not be written. The journal position of each
+    // image is added to positions.
+    bool append(std::vector<std::pair<unsigned int, const char*>> const& blocks,
+                std::vector<size_t>& positions);
+
+    // Reads the image at the given journal position.
+    bool read_image(size_t position, char* buffer);
+
+    // Empties the log and starts the next sequence number. The blocks of
+    // the logged transactions must be in their places, and synced, before
+    // this.
+    bool clear();
+
+private:
+    struct Descriptor {
+        uint32_t magic;
+        uint32_t n_blocks;
+        uint32_t last;
+
+        // The sequence number of the log the descriptor belongs to. Logs
+        // written before it existed have 0 here.
+        uint32_t sequence;
+        uint64_t checksum;
+    };
+
+    static constexpr uint32_t MAGIC = 0x4a464653; // "SFFJ"
+
+    Storage& storage_;
+    unsigned int block_size_;
+    unsigned int start_i_;
+    unsigned int n_blocks_;
+
+    // Next free journal block, and the checksum of the last descriptor.
+    size_t end_ = 0;
+    uint64_t checksum_ = 1;
+
+    // The sequence number of the current log. A new journal region is all
+    // zeros, so it has no descriptors of earlier numbers.
+    uint32_t sequence_ = 1;
+
+    // How many block indices fit into a descriptor.
+    size_t per_descriptor();
+
+    size_t block_pos(size_t journal_i);
+
+    // The largest sequence number of the blocks in the region that look
+    // like descriptors. Used when the first descriptor is unreadable.
+    bool find_last_sequence(uint32_t& result);
+
+    uint64_t checksum(uint64_t seed, Descriptor const& descriptor,
+                      uint32_t const* indices, const char* images);
+};
+
+} // namespace ffsys
+
+#endif // JOURNAL_HH
@@ -41,7 +41,19 @@ int main() {
                 }
             }
 
-            fs = new ffsys::FFSys(name, block_size);
+            // Ask for the number of block groups.
+            ffsys::MountOptions options;
+            cout << "Block groups, " << 8 * block_size << " data blocks each (1): ";
+            getline(cin, input);
+            if (!input.empty()) {
+                if (!Utilities::is_int(input) or stoi(input) < 1) {
+                    cout << "Block groups is not a positive integer, using 1." << endl;
+                } else {
+                    options.block_groups = stoi(input);
+                }
+            }
+
+            fs = new ffsys::FFSys(name, block_size, options);
         } else if (input.starts_with("O")) {
             fs = new ffsys::FFSys(name);
         } else {
@@ -76,13 +88,22 @@ int main() {
                     << "Available commands: " << endl
                     << " - help" << endl << endl
 
-                    << " - open <filename> <flag(trunc|end|create)?>" << endl
+                    << " - open <path> <flag(trunc|end|create)?>" << endl
                     << " - write <fd> <file_name> <count?>" << endl
                     << " - read <fd> <dest_file> <count>" << endl
+                    << " - pwrite <fd> <file_name> <offset> <count?>" << endl
+                    << " - pread <fd> <dest_file> <count> <offset>" << endl
                     << " - close <fd>" << endl
-                    << " - seek <fd> <pos>" << endl << endl
-
-                    << " - stats" << endl
+                    << " - seek <fd> <pos> <to(data|hole)?>" << endl
+                    << " - fallocate <fd> <offset> <len>" << endl
+                    << " - truncate <fd> <size>" << endl
+                    << " - fsync <fd>" << endl
+                    << " - sync" << endl
+                    << " - mkdir <path>" << endl
+                    << " - ls <path?>" << endl << endl
+
+                    << " - superblock" << endl
+                    << " - stats <reset?>" << endl
                     << " - files" << endl
                     << " - open_files" << endl;
             }
@@ -200,6 +221,94 @@ int main() {
                 file.close();
             }
 
+            // PWRITE command
+            else if (cmd == "pwrite") {
+                if (params.size() < 3) {
+                    cout << "Error: wrong N params!" << endl;
+                    continue;
+                }
+
+                if (!Utilities::is_int(params.at(0))) {
+                    cout << "Error: file descriptor is not integer!" << endl;
+                    continue;
+                }
+                ffsys::file_descriptor fd = stoi(params.at(0));
+
+                if (!Utilities::is_int(params.at(2))) {
+                    cout << "Error: offset is not integer!" << endl;
+                    continue;
+                }
+                size_t offset = stoul(params.at(2));
+
+                ifstream file(params.at(1), ios_base::ate);
+                if (!file) {
+                    cout << "Error: could not open file!" << endl;
+                    continue;
+                }
+
+                unsigned int to_read = file.tellg();
+                if (params.size() == 4 and Utilities::is_int(params.at(3))) {
+                    to_read = stoi(params.at(3));
+                }
+
+                // Read file
+                char* buffer = new char[to_read];
+                file.seekg(0);
+                file.read(buffer, to_read);
+
+                ssize_t count = fs->pwrite(fd, buffer, to_read, offset);
+                if (count == -1) {
+                    print_error(fs->errnum());
+                } else {
+                    cout << "Wrote " << count << " bytes into file." << endl;
+                }
+
+                // Clean up
+                delete[] buffer;
+                file.close();
+            }
+
+            // PREAD command
+            else if (cmd == "pread") {
+                if (params.size() < 4) {
+                    cout << "Error: wrong N params!" << endl;
+                    continue;
+                }
+
+                if (!Utilities::is_int(params.at(0))) {
+                    cout << "Error: file descriptor is not integer!" << endl;
+                    continue;
+                }
+                ffsys::file_descriptor fd = stoi(params.at(0));
+
+                ofstream file(params.at(1));
+                if (!file) {
+                    cout << "Error: could not open file!" << endl;
+                    continue;
+                }
+
+                if (!Utilities::is_int(params.at(2)) or !Utilities::is_int(params.at(3))) {
+                    cout << "Error: count or offset is not integer!" << endl;
+                    continue;
+                }
+                unsigned int to_read = stoi(params.at(2));
+                size_t offset = stoul(params.at(3));
+
+                // Read ffile
+                char* buffer = new char[to_read];
+                ssize_t count = fs->pread(fd, buffer, to_read, offset);
+                if (count == -1) {
+                    print_error(fs->errnum());
+                } else {
+                    cout << "Read " << count << " bytes from file." << endl;
+                    file.write(buffer, count);
+                }
+
+                // Clean up
+                delete[] buffer;
+                file.close();
+            }
+
             // CLOSE command
             else if (cmd == "close") {
                 if (params.size() != 1) {
@@ -219,7 +328,7 @@ int main() {
 
             // SEEK command
             else if (cmd == "seek") {
-                if (params.size() != 2) {
+                if (params.size() != 2 and params.size() != 3) {
                     cout << "Error: wrong N params!" << endl;
                     continue;
                 }
@@ -233,16 +342,143 @@ int main() {
                     continue;
                 }
 
+                // With data or hole, seek to the next data or hole from pos.
+                if (params.size() == 3) {
+                    if (params.at(2) != "data" and params.at(2) != "hole") {
+                        cout << "Error: unknown seek target " << params.at(2) << "!" << endl;
+                        continue;
+                    }
+
+                    ssize_t pos = params.at(2) == "data" ? fs->seek_data(stoi(params.at(0)), stoi(params.at(1)))
+                                                         : fs->seek_hole(stoi(params.at(0)), stoi(params.at(1)));
+                    if (pos == -1) {
+                        print_error(fs->errnum());
+                        continue;
+                    }
+                    cout << "Position: " << pos << endl;
+                    continue;
+                }
+
                 if (!fs->seek(stoi(params.at(0)), stoi(params.at(1)))) {
                     print_error(fs->errnum());
                     continue;
                 }
             }
 
+            // FALLOCATE command
+            else if (cmd == "fallocate") {
+                if (params.size() != 3) {
+                    cout << "Error: wrong N params!" << endl;
+                    continue;
+                }
+
+                if (!Utilities::is_int(params.at(0))) {
+                    cout << "Error: file descriptor is not integer!" << endl;
+                    continue;
+                }
+                if (!Utilities::is_int(params.at(1)) or !Utilities::is_int(params.at(2))) {
+                    cout << "Error: offset or length is not integer!" << endl;
+                    continue;
+                }
+
+                if (!fs->fallocate(stoi(params.at(0)), stoul(params.at(1)), stoul(params.at(2)))) {
+                    print_error(fs->errnum());
+                }
+            }
+
+            // TRUNCATE command
+            else if (cmd == "truncate") {
+                if (params.size() != 2) {
+                    cout << "Error: wrong N params!" << endl;
+                    continue;
+                }
+
+                if (!Utilities::is_int(params.at(0))) {
+                    cout << "Error: file descriptor is not integer!" << endl;
+                    continue;
+                }
+                if (!Utilities::is_int(params.at(1))) {
+                    cout << "Error: size is not integer!" << endl;
+                    continue;
+                }
+
+                if (!fs->truncate(stoi(params.at(0)), stoul(params.at(1)))) {
+                    print_error(fs->errnum());
+                }
+            }
+
+            // FSYNC command
+            else if (cmd == "fsync") {
+                if (params.size() != 1) {
+                    cout << "Error: wrong N params!" << endl;
+                    continue;
+                }
+
+                if (!Utilities::is_int(params.at(0))) {
+                    cout << "Error: file descriptor is not integer!" << endl;
+                    continue;
+                }
+
+                if (!fs->fsync(stoi(params.at(0)))) {
+                    print_error(fs->errnum());
+                }
+            }
+
+            // SYNC command
+            else if (cmd == "sync") {
+                if (!fs->sync()) {
+                    cout << "Error: could not write to the FFSys file!" << endl;
+                }
+            }
+
+            // MKDIR command
+            else if (cmd == "mkdir") {
+                if (params.size() != 1) {
+                    cout << "Error: wrong N params!" << endl;
+                    continue;
+                }
+
+                if (!fs->mkdir(params.at(0))) {
+                    print_error(fs->errnum());
+                }
+            }
+
+            // LS command
+            else if (cmd == "ls") {
+                if (params.size() > 1) {
+                    cout << "Error: wrong N params!" << endl;
+                    continue;
+                }
+
+                vector<ffsys::DirEntry> entries;
+                if (!fs->list_directory(params.empty() ? "/" : params.at(0), entries)) {
+                    print_error(fs->errnum());
+                    continue;
+                }
+
+                sort(entries.begin(), entries.end(),
+                     [](ffsys::DirEntry const& a, ffsys::DirEntry const& b) { return a.name < b.name; });
+                for (ffsys::DirEntry const& entry : entries) {
+                    cout << entry.name << (entry.directory ? "/" : "") << endl;
+                }
+            }
+
             // Stat commands
-            else if (cmd == "stats") {
+            else if (cmd == "superblock") {
                 fs->print_superblock();
             }
+            else if (cmd == "stats") {
+                if (params.size() > 1 or (params.size() == 1 and params.at(0) != "reset")) {
+                    cout << "Error: unknown param!" << endl;
+                    continue;
+                }
+
+                if (params.empty()) {
+                    fs->print_stats();
+                } else {
+                    fs->reset_stats();
+                }
+            }
             else if (cmd == "files") {
                 fs->print_all_files();
             }
@@ -293,5 +529,21 @@ void print_error(ffsys::ErrorNumber errnum) {
         break;
     case ffsys::ErrorNumber::FILE_ALREADY_OPEN:
         cout << "FILE_ALREADY_OPEN" << endl;
+        break;
+    case ffsys::ErrorNumber::INVALID_POSITION:
+        cout << "INVALID_POSITION" << endl;
+        break;
+    case ffsys::ErrorNumber::NOT_A_DIRECTORY:
+        cout << "NOT_A_DIRECTORY" << endl;
+        break;
+    case ffsys::ErrorNumber::IS_A_DIRECTORY:
+        cout << "IS_A_DIRECTORY" << endl;
+        break;
+    case ffsys::ErrorNumber::NAME_TOO_LONG:
+        cout << "NAME_TOO_LONG" << endl;
+        break;
+    case ffsys::ErrorNumber::IO_ERROR:
+        cout << "IO_ERROR" << endl;
+        break;
     }
 }
@@ -0,0 +1,129 @@
+#include "stats.hh"
+
+#include <algorithm>
+#include <bit>
+
+using namespace std;
+
+namespace ffsys {
+
+const char* to_string(StatOp op)
+{
+    static const char* names[] = {
+        "open", "close", "read", "write", "readv", "writev", "pread", "pwrite",
+        "seek", "fallocate", "truncate", "fsync", "sync", "mkdir",
+        "list_directory", "read_view",
+        "read_block", "write_block", "read_inode", "write_inode",
+        "reserve_inode", "reserve_data_block"
+    };
+    static_assert(size(names) == (size_t)StatOp::N_OPS);
+    return names[(size_t)op];
+}
+
+const char* to_string(StatCounter counter)
+{
+    static const char* names[] = {
+        "storage_reads", "storage_writes", "storage_bytes_read", "storage_bytes_written",
+        "storage_seeks", "storage_syncs",
+        "cache_hits", "cache_misses", "cache_evictions",
+        "dentry_hits", "dentry_misses",
+        "journal_commits", "bitmap_scan_steps"
+    };
+    static_assert(size(names) == (size_t)StatCounter::N_COUNTERS);
+    return names[(size_t)counter];
+}
+
+uint64_t OpStats::percentile(double p) const
+{
+    if (count == 0) {
+        return 0;
+    }
+
+    uint64_t wanted = max<uint64_t>(1, (uint64_t)(p / 100 * count + 0.5));
+    uint64_t seen = 0;
+    for (unsigned int i = 0; i < N_BUCKETS; ++i) {
+        seen += histogram[i];
+        if (seen >= wanted) {
+            return min((uint64_t)1 << i, max_ns);
+        }
+    }
+    return max_ns;
+}
+
+void Stats::set_enabled(bool enabled)
+{
+    enabled_ = enabled;
+}
+
+void Stats::add(StatCounter counter, uint64_t n)
+{
+    if (!enabled_) {
+        return;
+    }
+    counters_[(size_t)counter].fetch_add(n, memory_order_relaxed);
+}
+
+void Stats::record(StatOp op, uint64_t ns)
+{
+    AtomicOpStats& stats = ops_[(size_t)op];
+    stats.count.fetch_add(1, memory_order_relaxed);
+    stats.total_ns.fetch_add(ns, memory_order_relaxed);
+
+    uint64_t max_ns = stats.max_ns.load(memory_order_relaxed);
+    while (ns > max_ns and !stats.max_ns.compare_exchange_weak(max_ns, ns, memory_order_relaxed)) {
+    }
+
+    unsigned int bucket = min<unsigned int>(bit_width(ns), OpStats::N_BUCKETS - 1);
+    stats.histogram[bucket].fetch_add(1, memory_order_relaxed);
+}
+
+StatsSnapshot Stats::snapshot() const
+{
+    StatsSnapshot snapshot;
+    for (size_t i = 0; i < ops_.size(); ++i) {
+        snapshot.ops[i].count = ops_[i].count.load(memory_order_relaxed);
+        snapshot.ops[i].total_ns = ops_[i].total_ns.load(memory_order_relaxed);
+        snapshot.ops[i].max_ns = ops_[i].max_ns.load(memory_order_relaxed);
+        for (unsigned int j = 0; j < OpStats::N_BUCKETS; ++j) {
+            snapshot.ops[i].histogram[j] = ops_[i].histogram[j].load(memory_order_relaxed);
+        }
+    }
+    for (size_t i = 0; i < counters_.size(); ++i) {
+        snapshot.counters[i] = counters_[i].load(memory_order_relaxed);
+    }
+    return snapshot;
+}
+
+void Stats::reset()
+{
+    for (AtomicOpStats& stats : ops_) {
+        stats.count.store(0, memory_order_relaxed);
+        stats.total_ns.store(0, memory_order_relaxed);
+        stats.max_ns.store(0, memory_order_relaxed);
+        for (auto& bucket : stats.histogram) {
+            bucket.store(0, memory_order_relaxed);
+        }
+    }
+    for (auto& counter : counters_) {
+        counter.store(0, memory_order_relaxed);
+    }
+}
+
+Stats::Timer::Timer(Stats& stats, StatOp op):
+    stats_(stats), op_(op)
+{
+    if (stats_.enabled_) {
+        start_ = chrono::steady_clock::now();
+    }
+}
+
+Stats::Timer::~Timer()
+{
+    if (!stats_.enabled_) {
+        return;
+    }
+    auto elapsed = chrono::steady_clock::now() - start_;
+    stats_.record(op_, chrono::duration_cast<chrono::nanoseconds>(elapsed).count());
+}
+
+} // namespace ffsys
@@ -0,0 +1,158 @@
+#ifndef STATS_HH
+#define STATS_HH
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+namespace ffsys {
+
+/**
+ * The calls that are counted and timed: the public operations of the FFSys
+ * class and the internal primitives they are built from.
+ */
+enum class StatOp {
+    OPEN,
+    CLOSE,
+    READ,
+    WRITE,
+    READV,
+    WRITEV,
+    PREAD,
+    PWRITE,
+    SEEK,
+    FALLOCATE,
+    TRUNCATE,
+    FSYNC,
+    SYNC,
+    MKDIR,
+    LIST_DIRECTORY,
+    READ_VIEW,
+
+    READ_BLOCK,
+    WRITE_BLOCK,
+    READ_INODE,
+    WRITE_INODE,
+    RESERVE_INODE,
+    RESERVE_DATA_BLOCK,
+
+    N_OPS
+};
+
+/**
+ * Plain event counts.
+ */
+enum class StatCounter {
+    // Transfers to and from the FFSys file, and the bytes they moved.
+    STORAGE_READS,
+    STORAGE_WRITES,
+    STORAGE_BYTES_READ,
+    STORAGE_BYTES_WRITTEN,
+
+    // Transfers that did not start where the previous one ended.
+    STORAGE_SEEKS,
+    STORAGE_SYNCS,
+
+    // Block cache lookups, and entries evicted to make room.
+    CACHE_HITS,
+    CACHE_MISSES,
+    CACHE_EVICTIONS,
+
+    // Path components found in, and missing from, the dentry cache.
+    DENTRY_HITS,
+    DENTRY_MISSES,
+
+    // Transactions logged to the journal.
+    JOURNAL_COMMITS,
+
+    // Bitmap words examined while searching for free i-nodes and blocks.
+    BITMAP_SCAN_STEPS,
+
+    N_COUNTERS
+};
+
+const char* to_string(StatOp op);
+const char* to_string(StatCounter counter);
+
+/**
+ * The calls of one StatOp and their latencies. Latencies are kept in a
+ * histogram of powers of two: bucket i counts the calls that took less
+ * than 2^i nanoseconds (and at least 2^(i-1)), the last bucket everything
+ * slower.
+ */
+struct OpStats {
+    static constexpr unsigned int N_BUCKETS = 32;
+
+    uint64_t count = 0;
+    uint64_t total_ns = 0;
+    uint64_t max_ns = 0;
+    std::array<uint64_t, N_BUCKETS> histogram = {};
+
+    // The upper bound, in nanoseconds, of the bucket the p:th percentile
+    // of the latencies falls into. 0 if there have been no calls.
+    uint64_t percentile(double p) const;
+};
+
+/**
+ * A copy of the statistics at one point in time.
+ */
+struct StatsSnapshot {
+    std::array<OpStats, (size_t)StatOp::N_OPS> ops = {};
+    std::array<uint64_t, (size_t)StatCounter::N_COUNTERS> counters = {};
+
+    OpStats const& operator[](StatOp op) const { return ops[(size_t)op]; }
+    uint64_t operator[](StatCounter counter) const { return counters[(size_t)counter]; }
+};
+
+/**
+ * Counters and latency histograms of one mounted FFSys file. Everything
+ * is a relaxed atomic, so recording is cheap and can be done from many
+ * threads at once. A snapshot taken while others record is not exactly
+ * consistent between its values.
+ */
+class Stats
+{
+public:
+    // A disabled Stats records nothing, and its Timers do not read the
+    // clock.
+    void set_enabled(bool enabled);
+
+    void add(StatCounter counter, uint64_t n = 1);
+    void record(StatOp op, uint64_t ns);
+
+    StatsSnapshot snapshot() const;
+    void reset();
+
+    /**
+     * Records the time from its creation to its destruction as one call
+     * of op.
+     */
+    class Timer
+    {
+    public:
+        Timer(Stats& stats, StatOp op);
+        ~Timer();
+
+    private:
+        Stats& stats_;
+        StatOp op_;
+        std::chrono::steady_clock::time_point start_;
+    };
+
+private:
+    struct AtomicOpStats {
+        std::atomic<uint64_t> count = 0;
+        std::atomic<uint64_t> total_ns = 0;
+        std::atomic<uint64_t> max_ns = 0;
+        std::array<std::atomic<uint64_t>, OpStats::N_BUCKETS> histogram = {};
+    };
+
+    bool enabled_ = true;
+    std::array<AtomicOpStats, (size_t)StatOp::N_OPS> ops_ = {};
+    std::array<std::atomic<uint64_t>, (size_t)StatCounter::N_COUNTERS> counters_ = {};
+};
+
+} // namespace ffsys
+
+#endif // STATS_HH
@@ -0,0 +1,255 @@
+#include "storage.hh"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace ffsys {
+
+Storage* Storage::open(string path, StorageBackend backend)
+{
+    switch (backend) {
+    case StorageBackend::POSIX:
+        return new PosixStorage(path);
+    case StorageBackend::MMAP:
+        return new MmapStorage(path);
+    case StorageBackend::FSTREAM:
+    default:
+        return new FstreamStorage(path);
+    }
+}
+
+int Storage::get_fd()
+{
+    return -1;
+}
+
+const char* Storage::mapped(size_t, size_t)
+{
+    return nullptr;
+}
+
+void Storage::set_stats(Stats* stats)
+{
+    stats_ = stats;
+}
+
+void Storage::count_transfer(bool write, size_t pos, size_t count)
+{
+    if (stats_ == nullptr) {
+        return;
+    }
+
+    stats_->add(write ? StatCounter::STORAGE_WRITES : StatCounter::STORAGE_READS);
+    stats_->add(write ? StatCounter::STORAGE_BYTES_WRITTEN : StatCounter::STORAGE_BYTES_READ, count);
+    if (next_pos_.exchange(pos + count, memory_order_relaxed) != pos) {
+        stats_->add(StatCounter::STORAGE_SEEKS);
+    }
+}
+
+void Storage::count_sync()
+{
+    if (stats_ != nullptr) {
+        stats_->add(StatCounter::STORAGE_SYNCS);
+    }
+}
+
+FstreamStorage::FstreamStorage(string path):
+    fs_(path,
+        std::ios_base::binary
+      | std::ios_base::in
+      | std::ios_base::out
+    )
+{
+    if (!fs_) {
+        throw std::string("Error opening file");
+    }
+
+    sync_fd_ = ::open(path.c_str(), O_RDWR);
+    if (sync_fd_ == -1) {
+        throw std::string("Error opening file");
+    }
+}
+
+FstreamStorage::~FstreamStorage()
+{
+    ::close(sync_fd_);
+}
+
+bool FstreamStorage::read(size_t pos, char* buffer, size_t count)
+{
+    count_transfer(false, pos, count);
+
+    lock_guard lock(mutex_);
+    fs_.seekg(pos);
+    if (!fs_.read(buffer, count)) {
+        fs_.clear();
+        return false;
+    }
+    return true;
+}
+
+bool FstreamStorage::write(size_t pos, const char* buffer, size_t count)
+{
+    count_transfer(true, pos, count);
+
+    lock_guard lock(mutex_);
+    fs_.seekp(pos);
+    if (!fs_.write(buffer, count)) {
+        fs_.clear();
+        return false;
+    }
+    return true;
+}
+
+bool FstreamStorage::sync()
+{
+    count_sync();
+
+    lock_guard lock(mutex_);
+    if (!fs_.flush()) {
+        fs_.clear();
+        return false;
+    }
+    return fdatasync(sync_fd_) == 0;
+}
+
+PosixStorage::PosixStorage(string path)
+{
+    fd_ = ::open(path.c_str(), O_RDWR);
+    if (fd_ == -1) {
+        throw std::string("Error opening file");
+    }
+}
+
+PosixStorage::~PosixStorage()
+{
+    ::close(fd_);
+}
+
+bool PosixStorage::read(size_t pos, char* buffer, size_t count)
+{
+    count_transfer(false, pos, count);
+
+    while (count > 0) {
+        ssize_t n = ::pread(fd_, buffer, count, pos);
+        if (n <= 0) {
+            if (n == -1 and errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        buffer += n;
+        pos += n;
+        count -= n;
+    }
+    return true;
+}
+
+bool PosixStorage::write(size_t pos, const char* buffer, size_t count)
+{
+    count_transfer(true, pos, count);
+
+    while (count > 0) {
+        ssize_t n = ::pwrite(fd_, buffer, count, pos);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        buffer += n;
+        pos += n;
+        count -= n;
+    }
+    return true;
+}
+
+bool PosixStorage::sync()
+{
+    count_sync();
+
+    return fdatasync(fd_) == 0;
+}
+
+int PosixStorage::get_fd()
+{
+    return fd_;
+}
+
+MmapStorage::MmapStorage(string path)
+{
+    fd_ = ::open(path.c_str(), O_RDWR);
+    if (fd_ == -1) {
+        throw std::string("Error opening file");
+    }
+
+    struct stat st;
+    if (fstat(fd_, &st) == -1 or st.st_size == 0) {
+        ::close(fd_);
+        throw std::string("Error opening file");
+    }
+    size_ = st.st_size;
+
+    void* data = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+    if (data == MAP_FAILED) {
+        ::close(fd_);
+        throw std::string("Error mapping file to memory");
+    }
+    data_ = static_cast<char*>(data);
+}
+
+MmapStorage::~MmapStorage()
+{
+    munmap(data_, size_);
+    ::close(fd_);
+}
+
+bool MmapStorage::read(size_t pos, char* buffer, size_t count)
+{
+    count_transfer(false, pos, count);
+
+    if (pos + count > size_) {
+        return false;
+    }
+    memcpy(buffer, data_ + pos, count);
+    return true;
+}
+
+bool MmapStorage::write(size_t pos, const char* buffer, size_t count)
+{
+    count_transfer(true, pos, count);
+
+    if (pos + count > size_) {
+        return false;
+    }
+    memcpy(data_ + pos, buffer, count);
+    return true;
+}
+
+bool MmapStorage::sync()
+{
+    count_sync();
+
+    return msync(data_, size_, MS_SYNC) == 0;
+}
+
+int MmapStorage::get_fd()
+{
+    return fd_;
+}
+
+const char* MmapStorage::mapped(size_t pos, size_t count)
+{
+    if (pos + count > size_) {
+        return nullptr;
+    }
+    return data_ + pos;
+}
+
+} // namespace ffsys
@@ -0,0 +1,136 @@
+#ifndef STORAGE_HH
+#define STORAGE_HH
+
+#include "stats.hh"
+
+#include <atomic>
+#include <fstream>
+#include <mutex>
+#include <string>
+
+namespace ffsys {
+
+/**
+ * The ways the FFSys file can be accessed.
+ */
+enum class StorageBackend {
+    // Through a std::fstream, with a seek and a copy through the stream
+    // buffer on every access.
+    FSTREAM,
+
+    // Through a POSIX file descriptor with pread and pwrite, which do not
+    // share a file position, so threads can access the file in parallel.
+    POSIX,
+
+    // Through a shared memory mapping of the whole file, so every access
+    // is a plain memory copy.
+    MMAP
+};
+
+/**
+ * Byte level access to the FFSys file. Everything the FFSys class reads
+ * or writes goes through one of these (via the block cache). The methods
+ * can be called from many threads at once.
+ */
+class Storage
+{
+public:
+    // Opens the file at path with the given backend.
+    // @throws std::string, if the file could not be opened.
+    static Storage* open(std::string path, StorageBackend backend);
+
+    virtual ~Storage() = default;
+
+    // Reads count bytes starting from byte pos of the file.
+    virtual bool read(size_t pos, char* buffer, size_t count) = 0;
+
+    // Writes count bytes starting from byte pos of the file.
+    virtual bool write(size_t pos, const char* buffer, size_t count) = 0;
+
+    // Pushes written data to the file.
+    virtual bool sync() = 0;
+
+    // Returns the file's descriptor, or -1 if the backend has none.
+    virtual int get_fd();
+
+    // Returns the count bytes of the file from pos in memory, valid until
+    // the storage is closed, or nullptr if the backend does not keep the
+    // file in memory. Reading them is not counted as a transfer.
+    virtual const char* mapped(size_t pos, size_t count);
+
+    // Counts the transfers and syncs into stats from now on.
+    void set_stats(Stats* stats);
+
+    // Adds a transfer to the stats. Called by the backends, and by those
+    // that transfer through the file's descriptor themselves.
+    void count_transfer(bool write, size_t pos, size_t count);
+    void count_sync();
+
+private:
+    Stats* stats_ = nullptr;
+
+    // Where the previous transfer ended, to count the ones that do not
+    // continue from there as seeks.
+    std::atomic<size_t> next_pos_ = 0;
+};
+
+class FstreamStorage : public Storage
+{
+public:
+    FstreamStorage(std::string path);
+    ~FstreamStorage();
+
+    bool read(size_t pos, char* buffer, size_t count) override;
+    bool write(size_t pos, const char* buffer, size_t count) override;
+    bool sync() override;
+
+private:
+    std::fstream fs_;
+
+    // A descriptor of the same file, only for syncing it to disk, since
+    // flushing the stream just hands the data to the kernel. Not given
+    // out by get_fd, as transfers through it would bypass the stream's
+    // buffer.
+    int sync_fd_ = -1;
+
+    // The stream has a single position, so seeking and transferring
+    // have to happen one thread at a time.
+    std::mutex mutex_;
+};
+
+class PosixStorage : public Storage
+{
+public:
+    PosixStorage(std::string path);
+    ~PosixStorage();
+
+    bool read(size_t pos, char* buffer, size_t count) override;
+    bool write(size_t pos, const char* buffer, size_t count) override;
+    bool sync() override;
+    int get_fd() override;
+
+private:
+    int fd_ = -1;
+};
+
+class MmapStorage : public Storage
+{
+public:
+    MmapStorage(std::string path);
+    ~MmapStorage();
+
+    bool read(size_t pos, char* buffer, size_t count) override;
+    bool write(size_t pos, const char* buffer, size_t count) override;
+    bool sync() override;
+    int get_fd() override;
+    const char* mapped(size_t pos, size_t count) override;
+
+private:
+    int fd_ = -1;
+    char* data_ = nullptr;
+    size_t size_ = 0;
+};
+
+} // namespace ffsys
+
+#endif // STORAGE_HH